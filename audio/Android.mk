@@ -21,7 +21,8 @@ LOCAL_MODULE := audio.primary.$(TARGET_BOOTLOADER_BOARD_NAME)
 LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 LOCAL_MODULE_TAGS := optional
 
-LOCAL_SRC_FILES := audio_hw.c ril_interface.c
+LOCAL_SRC_FILES := audio_hw.c ril_interface.c audio_kernels.c echo_ref.c \
+	audio_stats.c route_table.c kvpairs.c capture_fx.c
 
 LOCAL_C_INCLUDES += \
 	external/tinyalsa/include \
@@ -32,6 +33,11 @@ LOCAL_C_INCLUDES += \
 LOCAL_SHARED_LIBRARIES := liblog libcutils libtinyalsa libaudioutils libdl \
 	libaudience_voicefx libaudioroute
 
+# hot path trace, recorded when audio.trace is 1; compiled out of user builds
+ifneq ($(TARGET_BUILD_VARIANT),user)
+LOCAL_CFLAGS += -DAUDIO_TRACE
+endif
+
 include $(BUILD_SHARED_LIBRARY)
 
 
@@ -59,3 +65,142 @@ LOCAL_MODULE_CLASS := ETC
 LOCAL_SRC_FILES := mixer_paths.xml
 LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)
 include $(BUILD_PREBUILT)
+
+
+# Compiled mixer configuration, audio_hw falls back to the XML without it
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := mixer_paths_compiler
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := mixer_paths_compiler.c
+
+LOCAL_C_INCLUDES += \
+	external/expat/lib \
+	system/core/include \
+	hardware/libhardware/include \
+	$(call include-path-for, audio-effects)
+
+LOCAL_STATIC_LIBRARIES := libexpat
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+LOCAL_MODULE := mixer_paths.bin
+LOCAL_MODULE_TAGS := optional eng
+LOCAL_MODULE_CLASS := ETC
+LOCAL_MODULE_PATH := $(TARGET_OUT_ETC)
+include $(BUILD_SYSTEM)/base_rules.mk
+
+MIXER_PATHS_COMPILER := $(HOST_OUT_EXECUTABLES)/mixer_paths_compiler$(HOST_EXECUTABLE_SUFFIX)
+$(LOCAL_BUILT_MODULE): PRIVATE_COMPILER := $(MIXER_PATHS_COMPILER)
+$(LOCAL_BUILT_MODULE): $(LOCAL_PATH)/mixer_paths.xml $(MIXER_PATHS_COMPILER)
+	@echo "Mixer paths: $@"
+	@mkdir -p $(dir $@)
+	$(hide) $(PRIVATE_COMPILER) $< $@
+
+
+# Host benchmark of the HAL, on stand-ins for tinyalsa, audio_route,
+# libaudioutils and libsecril-client, see host/audio_hw_bench.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libsecril-client
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := host/fake_secril_client.c
+
+LOCAL_C_INCLUDES += $(LOCAL_PATH)
+
+include $(BUILD_HOST_SHARED_LIBRARY)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_hw_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := audio_hw.c ril_interface.c audio_kernels.c echo_ref.c \
+	audio_stats.c route_table.c kvpairs.c capture_fx.c \
+	eS325VoiceProcessing.cpp \
+	host/fake_tinyalsa.c host/fake_audio_route.c host/fake_audio_utils.c \
+	host/host_compat.c host/audio_hw_bench.c
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	$(LOCAL_PATH)/host \
+	external/tinyalsa/include \
+	system/core/include \
+	hardware/libhardware/include \
+	$(call include-path-for, audio-effects) \
+	$(call include-path-for, audio-utils) \
+	$(call include-path-for, audio-route)
+
+LOCAL_CFLAGS += -DAUDIO_TRACE \
+	-DROUTE_TABLE_PATH=\"/tmp/audio_hw_host/mixer_paths.bin\" \
+	-DES325_SYSFS_PATH=\"/tmp/audio_hw_host/es325/\"
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -ldl -lrt -lm
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# Benchmark of the audio_kernels.c kernels, the NEON versions on the device
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_kernels_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := audio_kernels.c host/audio_kernels_bench.c
+
+include $(BUILD_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_kernels_bench_host
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := audio_kernels.c host/audio_kernels_bench.c
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# Offline cost of the route_configs[][] transitions on a compiled table,
+# see host/audio_route_bench.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := audio_route_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := route_table.c host/fake_tinyalsa.c host/audio_route_bench.c
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	$(LOCAL_PATH)/host \
+	external/tinyalsa/include \
+	system/core/include \
+	hardware/libhardware/include \
+	$(call include-path-for, audio-effects)
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread -lrt
+
+include $(BUILD_HOST_EXECUTABLE)
+
+
+# kvpairs.c against libcutils str_parms, see host/kvpairs_bench.c
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := kvpairs_bench
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_SRC_FILES := kvpairs.c host/kvpairs_bench.c
+
+LOCAL_C_INCLUDES += \
+	$(LOCAL_PATH) \
+	system/core/include \
+	hardware/libhardware/include
+
+LOCAL_STATIC_LIBRARIES := libcutils liblog
+LOCAL_LDLIBS := -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
@@ -19,29 +19,43 @@
  */
 
 #define LOG_TAG "audio_hw_primary"
-#define LOG_NDEBUG 0
+/*#define LOG_NDEBUG 0*/
 
 #include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/resource.h>
 #include <sys/time.h>
+#include <time.h>
 
+#include <cutils/atomic.h>
 #include <cutils/log.h>
 #include <cutils/properties.h>
-#include <cutils/str_parms.h>
 
 #include <hardware/audio.h>
 #include <hardware/hardware.h>
 
 #include <system/audio.h>
+#include <system/thread_defs.h>
 
 #include <tinyalsa/asoundlib.h>
 
+#include <audio_effects/effect_aec.h>
 #include <audio_utils/resampler.h>
-#include <audio_utils/echo_reference.h>
+#include <audio_utils/fifo.h>
+#include <audio_utils/primitives.h>
 #include <audio_route/audio_route.h>
 
+#include "audio_hw_params.h"
+#include "audio_kernels.h"
+#include "audio_stats.h"
+#include "capture_fx.h"
+#include "echo_ref.h"
+#include "kvpairs.h"
+#include "route_table.h"
 #include "routing.h"
 
 #include "eS325VoiceProcessing.h"
@@ -49,7 +63,6 @@
 #include "ril_interface.h"
 
 #define PCM_CARD 0
-#define PCM_TOTAL 1
 
 #define PCM_DEVICE 0
 #define PCM_DEVICE_VOICE 1
@@ -58,8 +71,106 @@
 
 #define MIXER_CARD 0
 
+/* built from mixer_paths.xml, audio_route parses the XML when it is missing */
+#ifndef ROUTE_TABLE_PATH
+#define ROUTE_TABLE_PATH "/system/etc/mixer_paths.bin"
+#endif
+
 #define CAPTURE_START_RAMP_MS 8
 
+/* give up on a write when the playback mixer drained nothing for this long */
+#define MIXER_STALL_TIMEOUT_US 500000
+
+/* periods of silence queued when restarting the mixer pcm after an underrun,
+ * enough headroom to restart cleanly while keeping the glitch short */
+#define XRUN_SILENCE_PERIODS 1
+
+/* at most one underrun warning per interval, counting the ones not logged */
+#define XRUN_LOG_INTERVAL_NS 1000000000LL
+
+/* set to 1 to open the fast output as an mmap/no-irq ultra low latency output */
+#define MMAP_OUTPUT_PROPERTY "audio.mmap_output"
+
+/* time an output stays routed and mixed after the client put it in standby,
+ * 0 puts it in standby right away */
+#define STANDBY_DELAY_PROPERTY "audio.standby_delay_ms"
+#define DEFAULT_STANDBY_DELAY_MS 2000
+
+/* set to 1 to route streams when they are opened or rerouted and to open the
+ * capture pcm ahead of the first read, instead of on the first buffer. The
+ * paths stay powered while the streams are idle. */
+#define PREWARM_PROPERTY "audio.prewarm"
+
+/* set to 1 to record the hot path events dumped with the HAL state, in builds
+ * with AUDIO_TRACE defined */
+#define TRACE_PROPERTY "audio.trace"
+
+/* set to 0 to always capture at the rate of pcm_config_in and resample, instead
+ * of opening the capture pcm at the client rate when the codec runs at it */
+#define NATIVE_CAPTURE_PROPERTY "audio.native_capture"
+
+/* the mixer output is ramped down and back up over this many frames around
+ * an output route change, 5 ms at 48 kHz */
+#define ROUTE_RAMP_FRAMES 240
+/* longest wait for the hardware buffer to play out before a route change,
+ * a deep buffer plus a period */
+#define ROUTE_MUTE_TIMEOUT_MS 250
+
+/* SCHED_FIFO priority of the mixer thread while a FAST output is active,
+ * same as the AudioFlinger fast mixer */
+#define MIXER_RT_PRIORITY 3
+
+/* echo reference fifo, must hold the largest hardware buffer the mixer
+ * keeps queued plus a capture period */
+#define ECHO_REF_FRAMES 16384
+
+/*
+ * Logging tiers: errors and warnings are always logged, ALOGV() is kept for
+ * cold paths and only built with LOG_NDEBUG 0. The routing, stream state and
+ * mixer thread events go through HAL_TRACE() instead, which formats nothing
+ * and compiles to nothing unless AUDIO_TRACE is defined.
+ */
+enum {
+    TRACE_SELECT_DEVICES,
+    TRACE_ROUTE_APPLIED,
+    TRACE_ES325_PRESET,
+    TRACE_CALL_AUDIO_PATH,
+    TRACE_OUT_ROUTING,
+    TRACE_OUT_START,
+    TRACE_OUT_STANDBY,
+    TRACE_OUT_DELAYED_STANDBY,
+    TRACE_MIXER_PCM_OPEN,
+    TRACE_MIXER_UNDERRUN,
+    TRACE_CAPTURE_PCM_OPEN,
+    TRACE_CAPTURE_OVERRUN,
+    TRACE_CNT
+};
+
+#ifdef AUDIO_TRACE
+static const char *const trace_formats[TRACE_CNT] = {
+    [TRACE_SELECT_DEVICES] = "select devices: route %#x out %#x",
+    [TRACE_ROUTE_APPLIED] = "route %#x applied in %d us",
+    [TRACE_ES325_PRESET] = "es325 preset %d -> %d",
+    [TRACE_CALL_AUDIO_PATH] = "ril call audio path %d",
+    [TRACE_OUT_ROUTING] = "output routing %#x -> %#x",
+    [TRACE_OUT_START] = "output start: device %#x, out devices %#x",
+    [TRACE_OUT_STANDBY] = "output standby: device %#x",
+    [TRACE_OUT_DELAYED_STANDBY] = "delayed standby of output %d",
+    [TRACE_MIXER_PCM_OPEN] = "mixer pcm open: %d frames x %d periods",
+    [TRACE_MIXER_UNDERRUN] = "mixer underrun %d",
+    [TRACE_CAPTURE_PCM_OPEN] = "capture pcm open: %d Hz, %d frames periods",
+    [TRACE_CAPTURE_OVERRUN] = "capture overrun %d",
+};
+
+#define HAL_TRACE(adev, event, arg0, arg1) \
+    do { \
+        if ((adev)->trace_enabled) \
+            stats_trace_add(&(adev)->trace, (event), (arg0), (arg1)); \
+    } while (0)
+#else
+#define HAL_TRACE(adev, event, arg0, arg1) do { } while (0)
+#endif
+
 #define MAX_SUPPORTED_CHANNEL_MASKS 1
 
 #define ARRAY_SIZE(a) (sizeof((a)) / sizeof((a[0])))
@@ -72,6 +183,16 @@ struct pcm_config pcm_config_fast = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+/* mmap/no-irq, the mixer thread wakes up on its own to feed the DMA */
+struct pcm_config pcm_config_mmap = {
+    .channels = 2,
+    .rate = 48000,
+    .period_size = 96,
+    .period_count = 2,
+    .format = PCM_FORMAT_S16_LE,
+    .avail_min = 96,
+};
+
 struct pcm_config pcm_config_deep = {
     .channels = 2,
     .rate = 48000,
@@ -80,6 +201,18 @@ struct pcm_config pcm_config_deep = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+/*
+ * Config of the ultra low latency output when the mixer thread cannot run
+ * SCHED_FIFO: its periods, queued as deep as pcm_config_fast.
+ */
+struct pcm_config pcm_config_mmap_fallback = {
+    .channels = 2,
+    .rate = 48000,
+    .period_size = 96,
+    .period_count = 5,
+    .format = PCM_FORMAT_S16_LE,
+};
+
 struct pcm_config pcm_config_in = {
     .channels = 2,
     .rate = 48000,
@@ -88,6 +221,10 @@ struct pcm_config pcm_config_in = {
     .format = PCM_FORMAT_S16_LE,
 };
 
+/* client rates the codec captures at directly, with the clocking of
+ * pcm_config_in. Other rates are resampled from pcm_config_in. */
+static const unsigned int capture_native_rates[] = { 8000, 16000, 32000, 48000 };
+
 struct pcm_config pcm_config_sco = {
     .channels = 1,
     .rate = 8000,
@@ -123,9 +260,182 @@ struct pcm_config pcm_config_voice_wide = {
 enum output_type {
     OUTPUT_DEEP_BUF,
     OUTPUT_LOW_LATENCY,
+    OUTPUT_ULTRA_LOW_LATENCY,
     OUTPUT_TOTAL
 };
 
+/* Output stream states, published with release semantics in stream_out.state */
+enum stream_state {
+    STREAM_STANDBY,
+    STREAM_RUNNING,
+};
+
+/*
+ * The output streams share PCM_DEVICE: each one queues its frames in a
+ * single-producer single-consumer fifo and the mixer thread owns the pcm.
+ * The pcm runs with the config of the lowest latency active output, so deep
+ * buffer playback alone lets the thread sleep between long periods. When a
+ * lower latency output starts, the pcm is reopened and the deep buffer
+ * frames it still held are mixed again, see playback_mixer_switch().
+ */
+struct playback_mixer {
+    pthread_t thread;
+    pthread_mutex_t lock;       /* protects inputs[], echo_ref and the stream
+                                 * fifo resets */
+    pthread_cond_t cond;        /* signalled when inputs[] changes */
+    bool exit;
+    struct stream_out *inputs[OUTPUT_TOTAL];
+
+    /* output muted around a route change, see playback_mixer_mute() */
+    pthread_cond_t mute_cond;   /* signalled when only silence is queued */
+    bool route_mute;
+    size_t silent_frames;       /* muted frames written since the last sound */
+
+    /* only accessed by the mixer thread */
+    struct pcm *pcm;
+    struct pcm_config *config;  /* config pcm was opened with */
+    int16_t *in_buffer;
+    int32_t *sum_buffer;
+    int16_t *mix_buffer;
+    bool mmap_running;          /* mmap pcm started since the last prepare */
+    bool rt;                    /* thread runs SCHED_FIFO */
+    struct echo_ref *echo_ref;  /* AEC reference of a capture stream */
+    int16_t route_gain;         /* q15 gain ramping to 0 while route_mute */
+    bool period_silent;         /* mix_buffer muted from start to end */
+    int64_t xrun_log_ns;        /* last underrun warning */
+    int32_t xruns_logged;       /* xruns when it was logged */
+
+    /*
+     * Deep buffer input as mixed, padded to whole periods: a ring of
+     * history_frames written up to history_pos. Frames from replay_pos to
+     * replay_end are mixed again before its fifo, see playback_mixer_read().
+     * Reset when history_out is removed.
+     */
+    struct stream_out *history_out;
+    int16_t *history;
+    size_t history_frames;
+    int64_t history_pos;
+    int64_t replay_pos;
+    int64_t replay_end;
+
+    /* SCHED_FIFO was refused, the ultra low latency output plays at
+     * pcm_config_mmap_fallback. Read without locks. */
+    volatile int32_t rt_refused;
+
+    /* pcm statistics, may be read without locks */
+    volatile int32_t xruns;     /* underruns of the hardware buffer */
+    volatile int32_t errors;    /* other pcm_write() failures */
+    volatile int32_t reopens;   /* pcm reopened to recover from an error */
+};
+
+/*
+ * The input streams share PCM_DEVICE_IN: the capture thread owns the pcm and
+ * writes every period to a ring that each stream reads at its own position,
+ * through its own resampler and channel conversion. The thread never waits
+ * for the streams, one that falls a ring behind loses the oldest frames. The
+ * pcm runs at the highest rate its users asked for, the others resample from
+ * it. A user asking for more reopens it, see in_attach_capture().
+ */
+#define CAPTURE_MUX_INPUTS 4
+#define CAPTURE_RING_PERIODS 32
+
+/* give up on a read when the capture thread published nothing for this long */
+#define CAPTURE_READ_TIMEOUT_MS 200
+
+struct capture_mux {
+    pthread_t thread;
+    pthread_mutex_t lock;       /* protects users, the configs and the gens */
+    pthread_cond_t cond;        /* signalled when users or wanted change and
+                                 * when the pcm was opened for them */
+    pthread_cond_t data_cond;   /* broadcast when a period is published */
+    bool exit;
+    unsigned int users;         /* started streams and the pre-warm */
+    struct pcm_config wanted;   /* config asked for by the first user or by
+                                 * one with a higher rate */
+    int32_t config_gen;         /* bumped when wanted is set */
+    int32_t open_gen;           /* config_gen the pcm was last opened for */
+    int open_status;            /* result of that open */
+
+    /*
+     * Only changed by the capture thread, with the mutex held. Stable for
+     * the streams while they are attached.
+     */
+    struct pcm_config config;   /* config of the pcm, wanted or pcm_config_in */
+    int16_t *ring;
+    size_t ring_frames;         /* CAPTURE_RING_PERIODS periods */
+
+    /* writer position, odd seq while it is being updated */
+    volatile int32_t seq;
+    volatile int64_t written;   /* frames written since config was set */
+    volatile int64_t next_ns;   /* CLOCK_MONOTONIC time frame 'written' is
+                                 * captured */
+
+    /* only accessed by the capture thread */
+    struct pcm *pcm;
+    bool pcm_running;           /* a period was read since the pcm was opened */
+
+    /* pcm statistics, may be read without locks */
+    volatile int32_t overruns;  /* hardware buffer full or pcm stopped */
+    volatile int32_t errors;    /* pcm_read() failures */
+    volatile int32_t reopens;   /* pcm reopened to recover from an error */
+    volatile int32_t frames_lost;   /* gaps in the capture timeline, at
+                                     * config.rate */
+};
+
+/* mixer path of an entry of route_configs[][] */
+struct route_path {
+    const char *name;           /* NULL for none */
+    int in_source_id;           /* entry, used by the route table */
+    int out_device_id;
+};
+
+/*
+ * Output paths of a combination of output devices, one per device with the
+ * duplicates removed. Built on first use and never changed afterwards.
+ */
+struct output_route {
+    unsigned int num_paths;
+    struct route_path paths[OUT_DEVICE_TAB_SIZE];
+};
+
+/*
+ * Routing state read by the audio I/O threads without the hw device mutex.
+ * select_devices() fills a free slot of route_snapshots[] and publishes it
+ * by storing its generation in route_gen, see route_snapshot_get().
+ */
+#define ROUTE_SNAPSHOTS 4
+
+struct route_snapshot {
+    int32_t gen;
+    audio_devices_t out_device;
+    audio_devices_t in_device;
+    audio_source_t input_source;
+    int es325_preset;           /* preset of the route queued */
+    int input_channel;          /* INPUT_CHANNEL_* of the input route */
+};
+
+struct route_snapshot_slot {
+    volatile int32_t seq;       /* odd while the slot is written */
+    struct route_snapshot snapshot;
+};
+
+/*
+ * Route queued by select_devices() for the routing thread. It carries
+ * everything needed to apply it, the thread never reads the audio_device
+ * state protected by the hw device mutex.
+ */
+struct route_request {
+    int route_id;
+    int64_t queued_ns;          /* CLOCK_MONOTONIC time of the request */
+    const struct output_route *output;  /* NULL for none */
+    struct route_path input;
+    int es325_preset;
+    audio_devices_t out_device;
+    audio_devices_t in_device;
+    audio_source_t input_source;
+    bool bluetooth_nrec;
+};
+
 struct audio_device {
     struct audio_hw_device hw_device;
 
@@ -133,24 +443,32 @@ struct audio_device {
     audio_devices_t out_device;
     audio_devices_t in_device;
     bool mic_mute;
-    struct audio_route *ar;
+    struct audio_route *ar;     /* NULL when route_table is loaded */
+    struct route_table *route_table;
     audio_source_t input_source;
     int cur_route_id;     /* current route ID: combination of input source
                            * and output device IDs */
+    /* output routes built so far, by input source and mask of output
+     * device IDs */
+    struct output_route *output_routes[IN_SOURCE_TAB_SIZE][1 << OUT_DEVICE_TAB_SIZE];
     audio_mode_t mode;
 
     /* ES325 */
-    int es325_preset;
+    int es325_preset;           /* preset of the last route queued */
+    int input_channel;          /* INPUT_CHANNEL_* of the last route queued */
     int es325_new_mode;
     int es325_mode;
 
     audio_channel_mask_t in_channel_mask;
 
-    /* Call audio */
+    /* Call audio, protected by call_lock */
+    pthread_mutex_t call_lock;
     struct pcm *pcm_voice_rx;
     struct pcm *pcm_voice_tx;
+    bool wb_amr;
 
-    /* SCO audio */
+    /* SCO audio, protected by sco_lock */
+    pthread_mutex_t sco_lock;
     struct pcm *pcm_sco_rx;
     struct pcm *pcm_sco_tx;
 
@@ -158,26 +476,143 @@ struct audio_device {
     bool in_call;
     bool tty_mode;
     bool bluetooth_nrec;
-    bool wb_amr;
 
     /* RIL */
     struct ril_handle ril;
 
+    /* changed with both lock and streams_lock held, read with either */
+    pthread_mutex_t streams_lock;
     struct stream_out *outputs[OUTPUT_TOTAL];
+    struct playback_mixer mixer;
+    struct capture_mux capture;
+    bool mmap_output;           /* fast output uses the mmap pcm */
+    float master_volume;
+    volatile int32_t master_gain; /* q15 gain, see pack_gain() */
+
+    /* generation of the last route queued by select_devices(), it indexes
+     * the current snapshot */
+    volatile int32_t route_gen;
+    struct route_snapshot_slot route_snapshots[ROUTE_SNAPSHOTS];
+
+    /*
+     * Routing thread, applies the routes queued by select_devices(). The
+     * route_* fields are protected by route_lock, which is never held with
+     * another mutex.
+     */
+    pthread_t route_thread;
+    pthread_mutex_t route_lock;
+    pthread_cond_t route_cond;      /* signalled when a route is queued */
+    pthread_cond_t route_done_cond; /* signalled when a route is applied */
+    bool route_exit;
+    bool route_queued;              /* route_pending not picked up yet */
+    struct route_request route_pending;
+    uint32_t route_requested;       /* sequence of the last route queued */
+    uint32_t route_applied;         /* sequence of the last route applied */
+    volatile int32_t routes_coalesced;  /* replaced before being applied */
+
+    /* only accessed by the routing thread */
+    const struct output_route *cur_output;  /* mixer paths applied */
+    struct route_path cur_input;
+    int applied_es325_preset;
+
+    /* housekeeping thread, puts idle output streams in standby once their
+     * grace period is over. housekeeping_cond is used with lock. */
+    pthread_t housekeeping_thread;
+    pthread_cond_t housekeeping_cond;
+    bool housekeeping_exit;
+    unsigned int standby_delay_ms;
+
+    /*
+     * Pre-warm, see PREWARM_PROPERTY. The housekeeping thread opens the
+     * capture pcm and routes prewarm_input while it is in standby, its
+     * first read then takes them over. Protected by lock.
+     */
+    bool prewarm;
+    struct stream_in *prewarm_input;
+    bool prewarm_queued;        /* prewarm_input not handled yet */
+    bool prewarm_routed;        /* the input route is the one of prewarm_input */
+    bool prewarm_capture;       /* capture started for prewarm_input */
+
+    /*
+     * Input streams out of standby, in the order they started. The input
+     * route follows the one with the highest priority, see select_input().
+     * Protected by lock.
+     */
+    struct stream_in *active_inputs[CAPTURE_MUX_INPUTS];
+    unsigned int num_active_inputs;
+
+    bool native_capture;        /* see NATIVE_CAPTURE_PROPERTY */
+
+    /* instrumentation, see audio_stats.h */
+    struct stats_histogram lock_wait;   /* contended adev_lock() calls */
+    struct stats_histogram out_lock_wait; /* contended adev_lock_output() */
+    /* first out_write()/in_read() after standby, [0] when the route or pcm
+     * still had to be set up, [1] when it was ready */
+    struct stats_histogram first_write[2];
+    struct stats_histogram first_read[2];
+    volatile int32_t lock_uncontended;
+    struct stats_route_history route_history;
+#ifdef AUDIO_TRACE
+    bool trace_enabled;         /* see TRACE_PROPERTY */
+    struct stats_trace trace;
+#endif
 };
 
 struct stream_out {
     struct audio_stream_out stream;
 
     pthread_mutex_t lock;       /* see note below on mutex acquisition order */
-    struct pcm *pcm[PCM_TOTAL];
     struct pcm_config config;
-    unsigned int pcm_device;
-    bool standby;
+    enum output_type type;
+    volatile int32_t state;     /* enum stream_state, changed with both the hw
+                                 * device and stream mutexes held */
+    int32_t route_gen;          /* adev->route_gen when last routed */
     audio_devices_t device;
 
+    /* frames queued for the playback mixer */
+    struct audio_utils_fifo fifo;
+    int16_t *fifo_buffer;
+    size_t fifo_frames;
+    /* a writer waiting for space sleeps on space_cond until the mixer read
+     * space_wanted frames from the fifo, 0 when none waits. Protected by the
+     * mixer mutex. */
+    pthread_cond_t space_cond;
+    uint64_t fifo_read;
+    uint64_t space_wanted;
+
+    /*
+     * Playback position since the stream was opened. frames_written is
+     * protected by the stream mutex, the other fields by the mixer mutex.
+     * Frames dropped on errors or flushed at standby count as presented so
+     * that the position stays consistent with what the client wrote.
+     */
+    uint64_t frames_written;
+    uint64_t frames_mixed;
+    uint64_t frames_presented;
+    struct timespec presented_ts;
+
+    /* q15 volume set by the client, see pack_gain() */
+    volatile int32_t volume;
+    int16_t gain[2];            /* gain applied by the mixer, left and right */
+
+    /* periods the mixer had to pad with silence after this stream had
+     * started playing, may be read without locks */
+    volatile int32_t underruns;
+    bool mixer_primed;          /* protected by the mixer mutex */
+    bool mixer_idle;            /* standby pending, protected by the mixer mutex */
+
+    /*
+     * Delayed standby: out_standby() only arms a deadline, the housekeeping
+     * thread tears the stream down when it passes and a write before that
+     * cancels it. Protected by the stream mutex.
+     */
+    bool standby_pending;
+    int64_t standby_deadline_ns;
+    volatile int32_t standby_avoided;   /* pcm reopens saved by the delay */
+
+    struct stats_histogram write_time;  /* out_write() call durations */
+
     struct resampler_itfe *resampler;
-    struct echo_reference_itfe *echo_reference;
     int16_t *buffer;
     size_t buffer_frames;
 
@@ -192,16 +627,97 @@ struct stream_in {
     struct audio_stream_in stream;
 
     pthread_mutex_t lock;       /* see note below on mutex acquisition order */
-    struct pcm *pcm;
     bool standby;
 
     unsigned int requested_rate;
+    /* capture ring, at requested_rate unless resampler is set */
+    struct pcm_config config;
     struct resampler_itfe *resampler;
     struct resampler_buffer_provider buf_provider;
     int16_t *buffer;
     size_t frames_in;
     int read_status;
 
+    /* position in the capture ring, see capture_mux_read() */
+    int64_t mux_read;
+    int32_t mux_overruns;       /* capture statistics accounted so far */
+    int32_t mux_errors;
+    int32_t mux_frames_lost;
+    /*
+     * Capture ring frames a failed read returned filler for, at the pcm
+     * rate. in_read() counted the filler as lost, so the gaps and skips
+     * reported next are deducted from it, and ring frames still there are
+     * dropped without counting them again.
+     */
+    int64_t mux_filled;
+
+    /*
+     * Frames the client never got, at the client rate: dropped by the
+     * hardware, skipped in the capture ring or not read because of an error.
+     * Protected by the stream mutex.
+     */
+    uint32_t frames_lost;       /* since the last in_get_input_frames_lost() */
+    int64_t frames_lost_count;  /* since the stream was opened */
+    int64_t frames_read;        /* returned by in_read() since the stream was
+                                 * opened */
+
+    /*
+     * Capture position published after every read, see
+     * in_get_capture_position(). Odd position_seq while it is being updated.
+     */
+    volatile int32_t position_seq;
+    volatile int64_t frames_captured;   /* frames_read plus frames lost */
+    volatile int64_t frames_lost_total;
+    volatile int64_t capture_ns;    /* time frame frames_captured was captured */
+
+    /* xrun statistics, may be read without locks */
+    volatile int32_t overruns;
+    volatile int32_t read_errors;
+
+    /*
+     * Software echo cancellation. The reference is fed to the AEC pre
+     * processor while the eS325 does not process the route. The mixer
+     * writes it, only this stream reads it.
+     */
+    effect_handle_t aec;
+    bool aec_reverse;           /* feed the reference to aec */
+    struct echo_ref *echo_ref;  /* registered with the playback mixer */
+    struct resampler_itfe *ref_resampler;
+    int16_t *ref_buffer;        /* reference at the mixer rate */
+    int16_t *ref_mono;          /* mono reference at the capture rate */
+    size_t ref_frames;          /* capture frames ref_mono can hold */
+    struct echo_delay *echo_delay;  /* measurement mode */
+    volatile int32_t echo_delay_us;
+    int32_t route_gen;          /* route followed, see in_update_route() */
+    /* stereo to mono kernel of the input route */
+    void (*to_mono)(int16_t *dst, const int16_t *src, size_t frames);
+
+    /*
+     * Preprocessing of the frames returned by in_read(). The filter and the
+     * gate duplicate the eS325 processing, they only run on the routes it
+     * bypasses.
+     */
+    struct capture_fx fx;
+    uint32_t fx_allowed;        /* CAPTURE_FX_* the route allows */
+
+    struct stats_histogram read_time;   /* in_read() call durations */
+
+    /*
+     * Resampler cost of the capture session, from leaving standby. The time
+     * spent in capture_mux_read() by the provider is not counted. The totals
+     * of the last session, and the running totals since the stream was
+     * opened, are kept for in_dump(), which reads them without locks.
+     */
+    int64_t session_frames;
+    int64_t session_resample_ns;
+    int64_t ring_read_ns;       /* capture_mux_read() time, resampled streams
+                                 * only */
+    int64_t last_session_frames;
+    int64_t last_session_resample_ns;
+    int64_t native_frames;      /* captured without the resampler */
+    int64_t resampled_frames;
+    int64_t resample_ns;
+
     audio_source_t input_source;
     audio_io_handle_t io_handle;
     audio_devices_t device;
@@ -230,43 +746,34 @@ const struct string_to_enum out_channels_name_to_enum_table[] = {
 
 /* Routing functions */
 
-static int get_output_device_id(audio_devices_t device)
-{
-    if (device == AUDIO_DEVICE_NONE)
-        return OUT_DEVICE_NONE;
+static const struct {
+    audio_devices_t devices;
+    int id;
+} out_device_ids[] = {
+    { AUDIO_DEVICE_OUT_SPEAKER, OUT_DEVICE_SPEAKER },
+    { AUDIO_DEVICE_OUT_EARPIECE, OUT_DEVICE_EARPIECE },
+    { AUDIO_DEVICE_OUT_WIRED_HEADSET, OUT_DEVICE_HEADSET },
+    { AUDIO_DEVICE_OUT_WIRED_HEADPHONE, OUT_DEVICE_HEADPHONES },
+    { AUDIO_DEVICE_OUT_ALL_SCO, OUT_DEVICE_BT_SCO },
+};
 
-    if (popcount(device) == 2) {
-        if ((device == (AUDIO_DEVICE_OUT_SPEAKER |
-                        AUDIO_DEVICE_OUT_WIRED_HEADSET)) ||
-                (device == (AUDIO_DEVICE_OUT_SPEAKER |
-                        AUDIO_DEVICE_OUT_WIRED_HEADPHONE)))
-            return OUT_DEVICE_SPEAKER_AND_HEADSET;
-        else if (device == (AUDIO_DEVICE_OUT_SPEAKER |
-                        AUDIO_DEVICE_OUT_EARPIECE))
-            return OUT_DEVICE_SPEAKER_AND_EARPIECE;
-        else
-            return OUT_DEVICE_NONE;
-    }
-
-    if (popcount(device) != 1)
-        return OUT_DEVICE_NONE;
-
-    switch (device) {
-    case AUDIO_DEVICE_OUT_SPEAKER:
-        return OUT_DEVICE_SPEAKER;
-    case AUDIO_DEVICE_OUT_EARPIECE:
-        return OUT_DEVICE_EARPIECE;
-    case AUDIO_DEVICE_OUT_WIRED_HEADSET:
-        return OUT_DEVICE_HEADSET;
-    case AUDIO_DEVICE_OUT_WIRED_HEADPHONE:
-        return OUT_DEVICE_HEADPHONES;
-    case AUDIO_DEVICE_OUT_BLUETOOTH_SCO:
-    case AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET:
-    case AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT:
-        return OUT_DEVICE_BT_SCO;
-    default:
-        return OUT_DEVICE_NONE;
+/* mask of the output device IDs of devices, any combination is routed */
+static unsigned int get_output_device_ids(audio_devices_t device)
+{
+    unsigned int ids = 0;
+    audio_devices_t supported = 0;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(out_device_ids); i++) {
+        if (device & out_device_ids[i].devices)
+            ids |= 1 << out_device_ids[i].id;
+        supported |= out_device_ids[i].devices;
     }
+
+    if (device & ~supported)
+        ALOGV("%s: no route for devices %#x", __func__, device & ~supported);
+
+    return ids;
 }
 
 static int get_input_source_id(audio_source_t source)
@@ -289,107 +796,477 @@ static int get_input_source_id(audio_source_t source)
     }
 }
 
-static void adev_set_call_audio_path(struct audio_device *adev);
+static void adev_set_call_audio_path(struct audio_device *adev,
+                                     const struct route_request *route);
+static void playback_mixer_mute(struct playback_mixer *mixer, bool mute);
+
+/* lock the hw device mutex, recording how long callers wait for it */
+static void adev_lock(struct audio_device *adev)
+{
+    int64_t start;
+
+    if (pthread_mutex_trylock(&adev->lock) == 0) {
+        android_atomic_inc(&adev->lock_uncontended);
+        return;
+    }
+
+    start = stats_now_ns();
+    pthread_mutex_lock(&adev->lock);
+    stats_histogram_add(&adev->lock_wait, stats_now_ns() - start);
+}
+
+/*
+ * Lock an output stream mutex with the hw device mutex held, recording how
+ * long the routing and standby calls wait for the stream. A writer must not
+ * sleep with its stream mutex held or every hw device caller waits too.
+ */
+static void adev_lock_output(struct audio_device *adev, struct stream_out *out)
+{
+    int64_t start;
+
+    if (pthread_mutex_trylock(&out->lock) == 0)
+        return;
+
+    start = stats_now_ns();
+    pthread_mutex_lock(&out->lock);
+    stats_histogram_add(&adev->out_lock_wait, stats_now_ns() - start);
+}
+
+/*
+ * Locking. The device state is split in domains, each with its mutex:
+ * - lock, taken with adev_lock(): routing state, i.e. devices, input
+ *   source, mode, eS325 preset and pre-warm, and select_devices();
+ * - out->lock and in->lock: the stream state;
+ * - mixer.lock: the playback mixer inputs and pcm;
+ * - capture.lock: the capture pcm users and config;
+ * - streams_lock: the outputs[] registry, changed with lock and
+ *   streams_lock held and read with either;
+ * - call_lock: the voice call pcms and the wide band AMR setting;
+ * - sco_lock: the bluetooth SCO pcms;
+ * - route_lock: the routing thread queue.
+ *
+ * When several mutexes are needed, take lock first, then the stream
+ * mutexes, then mixer.lock or capture.lock. streams_lock, call_lock,
+ * sco_lock and route_lock are leaves: never take another mutex while
+ * holding one.
+ *
+ * out_write() and in_read() only take lock to leave standby. Otherwise
+ * they read the routing state from the snapshot published by
+ * select_devices(), which never blocks.
+ */
+
+/* publish the routing state, must be called with hw device mutex locked */
+static void route_snapshot_publish(struct audio_device *adev)
+{
+    int32_t gen = adev->route_gen + 1;
+    struct route_snapshot_slot *slot =
+            &adev->route_snapshots[(uint32_t)gen % ROUTE_SNAPSHOTS];
+
+    android_atomic_inc(&slot->seq);
+    android_memory_barrier();
+    slot->snapshot.gen = gen;
+    slot->snapshot.out_device = adev->out_device;
+    slot->snapshot.in_device = adev->in_device;
+    slot->snapshot.input_source = adev->input_source;
+    slot->snapshot.es325_preset = adev->es325_preset;
+    slot->snapshot.input_channel = adev->input_channel;
+    android_atomic_inc(&slot->seq);
+
+    android_atomic_release_store(gen, &adev->route_gen);
+}
+
+/*
+ * Copy of the last routing state published, from any thread without
+ * locking. A slot rewritten while it is copied is read again; the copy may
+ * then be of a newer state than route_gen when the call started.
+ */
+static void route_snapshot_get(struct audio_device *adev,
+                               struct route_snapshot *snapshot)
+{
+    const struct route_snapshot_slot *slot;
+    int32_t seq;
+
+    do {
+        slot = &adev->route_snapshots[
+                (uint32_t)android_atomic_acquire_load(&adev->route_gen) %
+                ROUTE_SNAPSHOTS];
+        seq = android_atomic_acquire_load(&slot->seq);
+        *snapshot = slot->snapshot;
+        android_memory_barrier();
+    } while ((seq & 1) || seq != slot->seq);
+}
+
+static bool route_path_equal(const char *a, const char *b)
+{
+    if (a == NULL || b == NULL)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static bool output_route_equal(const struct output_route *a,
+                               const struct output_route *b)
+{
+    unsigned int i;
+
+    if (a == NULL || b == NULL)
+        return a == b;
+    if (a->num_paths != b->num_paths)
+        return false;
+    for (i = 0; i < a->num_paths; i++) {
+        if (!route_path_equal(a->paths[i].name, b->paths[i].name))
+            return false;
+    }
+    return true;
+}
+
+static void apply_route_path(struct audio_device *adev,
+                             const struct route_path *path, bool input)
+{
+    if (adev->route_table)
+        route_table_apply_path(adev->route_table,
+                               route_table_get_path(adev->route_table,
+                                                    path->in_source_id,
+                                                    path->out_device_id,
+                                                    input));
+    else
+        audio_route_apply_path(adev->ar, path->name);
+}
+
+/*
+ * Many route IDs share their mixer paths, so the mixer is only touched when
+ * the paths change. The mixer state is then rebuilt from its initial values
+ * in memory; audio_route_update_mixer() only writes the controls whose value
+ * differs from what the codec holds, so controls common to the old and new
+ * paths cost no I2C transaction.
+ *
+ * The stages run in the order of stats_route_change: when the output paths
+ * change the output is muted before the eS325 preset and the mixer controls
+ * change, and unmuted once both are done. The preset only processes the
+ * voice paths, playback does not pause for it alone.
+ *
+ * Runs on the routing thread, without the hw device mutex.
+ */
+static void apply_route(struct audio_device *adev,
+                        const struct route_request *route)
+{
+    bool output_changed;
+    bool update_mixer;
+    bool set_preset;
+    struct stats_route_change change;
+    int64_t start = stats_now_ns();
+    int64_t stage = start;
+    int64_t now;
+    unsigned int i;
+    bool ramp;
+
+    memset(&change, 0, sizeof(change));
+    change.queued_us = (int32_t)((start - route->queued_ns) / 1000);
+    change.ctl_writes = adev->route_table ? 0 : -1;
+
+    output_changed = !output_route_equal(route->output, adev->cur_output);
+    update_mixer = output_changed ||
+            !route_path_equal(route->input.name, adev->cur_input.name);
+    set_preset = route->es325_preset != adev->applied_es325_preset;
+    /* the playing output is silenced while its paths change */
+    ramp = output_changed;
+    if (update_mixer) {
+        if (adev->route_table)
+            route_table_reset(adev->route_table);
+        else
+            audio_route_reset(adev->ar);
+        /* a control set by several devices keeps the value of the last */
+        for (i = 0; route->output && i < route->output->num_paths; i++)
+            apply_route_path(adev, &route->output->paths[i], false);
+        if (route->input.name)
+            apply_route_path(adev, &route->input, true);
+        adev->cur_output = route->output;
+        adev->cur_input = route->input;
+    }
+    now = stats_now_ns();
+    change.paths_us = (int32_t)((now - stage) / 1000);
+    stage = now;
+
+    if (ramp) {
+        playback_mixer_mute(&adev->mixer, true);
+        now = stats_now_ns();
+        change.mute_us = (int32_t)((now - stage) / 1000);
+        stage = now;
+    }
+
+    if (set_preset) {
+        HAL_TRACE(adev, TRACE_ES325_PRESET, adev->applied_es325_preset,
+                  route->es325_preset);
+
+        /* on failure the next route retries */
+        if (eS325_UsePreset(route->es325_preset) == 0) {
+            adev->applied_es325_preset = route->es325_preset;
+        }
+    }
+    now = stats_now_ns();
+    change.es325_us = (int32_t)((now - stage) / 1000);
+    stage = now;
+
+    if (update_mixer) {
+        if (adev->route_table)
+            change.ctl_writes = route_table_update_mixer(adev->route_table);
+        else
+            audio_route_update_mixer(adev->ar);
+    }
+    if (ramp)
+        playback_mixer_mute(&adev->mixer, false);
+    now = stats_now_ns();
+    change.mixer_us = (int32_t)((now - stage) / 1000);
+    stage = now;
+
+    adev_set_call_audio_path(adev, route);
+
+    change.time_ns = stats_now_ns();
+    change.ril_us = (int32_t)((change.time_ns - stage) / 1000);
+    change.duration_us = (int32_t)((change.time_ns - start) / 1000);
+    change.route_id = route->route_id;
+    change.out_device = route->out_device;
+    change.in_device = route->in_device;
+    change.input_source = route->input_source;
+    change.es325_preset = adev->applied_es325_preset;
+    change.mixer_updated = update_mixer;
+    stats_route_history_add(&adev->route_history, &change);
+
+    HAL_TRACE(adev, TRACE_ROUTE_APPLIED, change.route_id, change.duration_us);
+}
+
+static void *route_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct route_request route;
+    uint32_t seq;
+
+    pthread_mutex_lock(&adev->route_lock);
+    while (!adev->route_exit) {
+        if (!adev->route_queued) {
+            pthread_cond_wait(&adev->route_cond, &adev->route_lock);
+            continue;
+        }
+        route = adev->route_pending;
+        seq = adev->route_requested;
+        adev->route_queued = false;
+        pthread_mutex_unlock(&adev->route_lock);
+
+        apply_route(adev, &route);
+
+        pthread_mutex_lock(&adev->route_lock);
+        adev->route_applied = seq;
+        pthread_cond_broadcast(&adev->route_done_cond);
+    }
+    pthread_mutex_unlock(&adev->route_lock);
+
+    return NULL;
+}
+
+/*
+ * Wait until the routes queued so far are live. Only needed before the audio
+ * path is used, e.g. the first write after a device change. The routing
+ * thread takes no other mutex, so callers may hold any of them.
+ */
+static void route_wait(struct audio_device *adev)
+{
+    uint32_t seq;
+
+    pthread_mutex_lock(&adev->route_lock);
+    seq = adev->route_requested;
+    while ((int32_t)(adev->route_applied - seq) < 0 && !adev->route_exit)
+        pthread_cond_wait(&adev->route_done_cond, &adev->route_lock);
+    pthread_mutex_unlock(&adev->route_lock);
+}
+
+static int route_start(struct audio_device *adev)
+{
+    pthread_mutex_init(&adev->route_lock, NULL);
+    pthread_cond_init(&adev->route_cond, NULL);
+    pthread_cond_init(&adev->route_done_cond, NULL);
+
+    if (pthread_create(&adev->route_thread, NULL, route_thread, adev) != 0) {
+        ALOGE("%s: cannot create routing thread", __func__);
+        pthread_cond_destroy(&adev->route_done_cond);
+        pthread_cond_destroy(&adev->route_cond);
+        pthread_mutex_destroy(&adev->route_lock);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void route_stop(struct audio_device *adev)
+{
+    pthread_mutex_lock(&adev->route_lock);
+    adev->route_exit = true;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_cond_broadcast(&adev->route_done_cond);
+    pthread_mutex_unlock(&adev->route_lock);
+
+    pthread_join(adev->route_thread, NULL);
+    pthread_cond_destroy(&adev->route_done_cond);
+    pthread_cond_destroy(&adev->route_cond);
+    pthread_mutex_destroy(&adev->route_lock);
+}
 
 /*
- * NOTE: when multiple mutexes have to be acquired, always take the
- * audio_device mutex first, followed by the stream_in and/or
- * stream_out mutexes.
+ * Output paths of the output device IDs in ids for an input source, one per
+ * device from its route_configs[][] entry. Each combination is built on first
+ * use and kept until the device is closed. Returns NULL for no device.
+ *
+ * must be called with hw device mutex locked
  */
+static const struct output_route *get_output_route(struct audio_device *adev,
+                                                   int in_source_id,
+                                                   unsigned int ids)
+{
+    struct output_route *output = adev->output_routes[in_source_id][ids];
+    struct route_path *path;
+    const char *name;
+    unsigned int i;
+    int id;
+
+    if (output || ids == 0)
+        return output;
+
+    output = calloc(1, sizeof(struct output_route));
+    if (!output)
+        return NULL;
+
+    for (id = 0; id < OUT_DEVICE_TAB_SIZE; id++) {
+        if (!(ids & (1 << id)))
+            continue;
+
+        /* e.g. headset and headphones share their output path */
+        name = route_configs[in_source_id][id]->output_route;
+        for (i = 0; i < output->num_paths; i++) {
+            if (route_path_equal(name, output->paths[i].name))
+                break;
+        }
+        if (i < output->num_paths)
+            continue;
+
+        path = &output->paths[output->num_paths++];
+        path->name = name;
+        path->in_source_id = in_source_id;
+        path->out_device_id = id;
+    }
+
+    ALOGV("%s: input source %d devices %#x: %u paths", __func__,
+          in_source_id, ids, output->num_paths);
+    adev->output_routes[in_source_id][ids] = output;
+    return output;
+}
+
+/* device of a combination giving the input route, see out_device_priority */
+static int get_input_device_id(unsigned int ids)
+{
+    unsigned int i;
 
+    for (i = 0; i < ARRAY_SIZE(out_device_priority); i++) {
+        if (ids & (1 << out_device_priority[i]))
+            return out_device_priority[i];
+    }
+    return OUT_DEVICE_NONE;
+}
+
+/*
+ * Decide the route and queue it for the routing thread, so the I2C writes
+ * to the codec and the eS325 and the RIL round trip are not made with the
+ * hw device mutex held. A route queued before the previous one was picked
+ * up replaces it.
+ *
+ * must be called with hw device mutex locked
+ */
 static void select_devices(struct audio_device *adev)
 {
-    int output_device_id = get_output_device_id(adev->out_device);
+    unsigned int output_device_ids = get_output_device_ids(adev->out_device);
     int input_source_id = get_input_source_id(adev->input_source);
-    const char *output_route = NULL;
-    const char *input_route = NULL;
+    int input_device_id;
+    const struct route_config *input_config;
+    struct route_request route;
     int new_route_id;
     int new_es325_preset = -1;
 
-    audio_route_reset(adev->ar);
-
-    new_route_id = (1 << (input_source_id + OUT_DEVICE_CNT)) + (1 << output_device_id);
+    new_route_id = (1 << (input_source_id + OUT_DEVICE_CNT)) | output_device_ids;
     if ((new_route_id == adev->cur_route_id) && (adev->es325_mode == adev->es325_new_mode))
         return;
     adev->cur_route_id = new_route_id;
     adev->es325_mode = adev->es325_new_mode;
 
+    memset(&route, 0, sizeof(route));
     if (input_source_id != IN_SOURCE_NONE) {
-        if (output_device_id != OUT_DEVICE_NONE) {
-            input_route =
-                route_configs[input_source_id][output_device_id]->input_route;
-            output_route =
-                route_configs[input_source_id][output_device_id]->output_route;
-            new_es325_preset =
-                route_configs[input_source_id][output_device_id]->es325_preset[adev->es325_mode];
-        } else {
+        input_device_id = get_input_device_id(output_device_ids);
+        if (input_device_id == OUT_DEVICE_NONE) {
             switch(adev->in_device) {
             case AUDIO_DEVICE_IN_WIRED_HEADSET & ~AUDIO_DEVICE_BIT_IN:
-                output_device_id = OUT_DEVICE_HEADSET;
+                input_device_id = OUT_DEVICE_HEADSET;
                 break;
             case AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET & ~AUDIO_DEVICE_BIT_IN:
-                output_device_id = OUT_DEVICE_BT_SCO;
+                input_device_id = OUT_DEVICE_BT_SCO;
                 break;
             default:
-                output_device_id = OUT_DEVICE_SPEAKER;
+                input_device_id = OUT_DEVICE_SPEAKER;
                 break;
             }
-            input_route =
-                route_configs[input_source_id][output_device_id]->input_route;
-            new_es325_preset =
-                route_configs[input_source_id][output_device_id]->es325_preset[adev->es325_mode];
         }
+        input_config = route_configs[input_source_id][input_device_id];
+        route.input.name = input_config->input_route;
+        route.input.in_source_id = input_source_id;
+        route.input.out_device_id = input_device_id;
+        new_es325_preset = input_config->es325_preset[adev->es325_mode];
+        adev->input_channel = input_config->input_channel;
+        route.output = get_output_route(adev, input_source_id, output_device_ids);
     } else {
-        if (output_device_id != OUT_DEVICE_NONE) {
-            output_route =
-                route_configs[IN_SOURCE_MIC][output_device_id]->output_route;
-        }
-    }
-    ALOGV("select_devices() devices %#x input src %d output route %s input route %s",
-          adev->out_device, adev->input_source,
-          output_route ? output_route : "none",
-          input_route ? input_route : "none");
-
-    if (output_route)
-        audio_route_apply_path(adev->ar, output_route);
-    if (input_route)
-        audio_route_apply_path(adev->ar, input_route);
-
-    if ((new_es325_preset != ES325_PRESET_CURRENT) &&
-            (new_es325_preset != adev->es325_preset)) {
-        ALOGV("  select_devices() changing es325 preset from %d to %d",
-              adev->es325_preset, new_es325_preset);
-
-        if (eS325_UsePreset(new_es325_preset) == 0) {
-            adev->es325_preset = new_es325_preset;
-        }
-
+        route.output = get_output_route(adev, IN_SOURCE_MIC, output_device_ids);
     }
-
-    audio_route_update_mixer(adev->ar);
-
-    adev_set_call_audio_path(adev);
+    if (new_es325_preset != ES325_PRESET_CURRENT)
+        adev->es325_preset = new_es325_preset;
+
+    route.route_id = new_route_id;
+    HAL_TRACE(adev, TRACE_SELECT_DEVICES, new_route_id, adev->out_device);
+    route.queued_ns = stats_now_ns();
+    route.es325_preset = adev->es325_preset;
+    route.out_device = adev->out_device;
+    route.in_device = adev->in_device;
+    route.input_source = adev->input_source;
+    route.bluetooth_nrec = adev->bluetooth_nrec;
+
+    route_snapshot_publish(adev);
+
+    pthread_mutex_lock(&adev->route_lock);
+    if (adev->route_queued)
+        android_atomic_inc(&adev->routes_coalesced);
+    adev->route_pending = route;
+    adev->route_queued = true;
+    adev->route_requested++;
+    pthread_cond_signal(&adev->route_cond);
+    pthread_mutex_unlock(&adev->route_lock);
 }
 
 /* BT SCO functions */
 
-/* must be called with hw device mutex locked, OK to hold other mutexes */
+/* must not be called with call_lock or sco_lock held */
 static void start_bt_sco(struct audio_device *adev)
 {
     struct pcm_config *sco_config;
 
+    pthread_mutex_lock(&adev->call_lock);
+    if (adev->wb_amr)
+        sco_config = &pcm_config_sco_wide;
+    else
+        sco_config = &pcm_config_sco;
+    pthread_mutex_unlock(&adev->call_lock);
+
+    pthread_mutex_lock(&adev->sco_lock);
     if (adev->pcm_sco_rx || adev->pcm_sco_tx) {
         ALOGW("%s: SCO PCMs already open!\n", __func__);
+        pthread_mutex_unlock(&adev->sco_lock);
         return;
     }
 
     ALOGV("%s: Opening SCO PCMs", __func__);
 
-    if (adev->wb_amr)
-        sco_config = &pcm_config_sco_wide;
-    else
-        sco_config = &pcm_config_sco;
-
     adev->pcm_sco_rx = pcm_open(PCM_CARD, PCM_DEVICE_SCO, PCM_OUT,
             sco_config);
     if (adev->pcm_sco_rx && !pcm_is_ready(adev->pcm_sco_rx)) {
@@ -409,19 +1286,24 @@ static void start_bt_sco(struct audio_device *adev)
     pcm_start(adev->pcm_sco_rx);
     pcm_start(adev->pcm_sco_tx);
 
+    pthread_mutex_unlock(&adev->sco_lock);
     return;
 
 err_sco_tx:
     pcm_close(adev->pcm_sco_tx);
+    adev->pcm_sco_tx = NULL;
 err_sco_rx:
     pcm_close(adev->pcm_sco_rx);
+    adev->pcm_sco_rx = NULL;
+    pthread_mutex_unlock(&adev->sco_lock);
 }
 
-/* must be called with hw device mutex locked, OK to hold other mutexes */
+/* must not be called with sco_lock held */
 static void end_bt_sco(struct audio_device *adev)
 {
     ALOGV("%s: Closing SCO PCMs", __func__);
 
+    pthread_mutex_lock(&adev->sco_lock);
     if (adev->pcm_sco_rx) {
         pcm_stop(adev->pcm_sco_rx);
         pcm_close(adev->pcm_sco_rx);
@@ -433,17 +1315,20 @@ static void end_bt_sco(struct audio_device *adev)
         pcm_close(adev->pcm_sco_tx);
         adev->pcm_sco_tx = NULL;
     }
+    pthread_mutex_unlock(&adev->sco_lock);
 }
 
 /* Samsung RIL functions */
 
-/* must be called with hw device mutex locked, OK to hold other mutexes */
+/* must not be called with call_lock held */
 static int start_voice_call(struct audio_device *adev)
 {
     struct pcm_config *voice_config;
 
+    pthread_mutex_lock(&adev->call_lock);
     if (adev->pcm_voice_rx || adev->pcm_voice_tx) {
         ALOGW("%s: Voice PCMs already open!\n", __func__);
+        pthread_mutex_unlock(&adev->call_lock);
         return 0;
     }
 
@@ -474,6 +1359,7 @@ static int start_voice_call(struct audio_device *adev)
     pcm_start(adev->pcm_voice_rx);
     pcm_start(adev->pcm_voice_tx);
 
+    pthread_mutex_unlock(&adev->call_lock);
     return 0;
 
 err_voice_tx:
@@ -482,15 +1368,17 @@ err_voice_tx:
 err_voice_rx:
     pcm_close(adev->pcm_voice_rx);
     adev->pcm_voice_rx = NULL;
+    pthread_mutex_unlock(&adev->call_lock);
 
     return -ENOMEM;
 }
 
-/* must be called with hw device mutex locked, OK to hold other mutexes */
+/* must not be called with call_lock held */
 static void end_voice_call(struct audio_device *adev)
 {
     ALOGV("%s: Closing voice PCMs", __func__);
 
+    pthread_mutex_lock(&adev->call_lock);
     if (adev->pcm_voice_rx) {
         pcm_stop(adev->pcm_voice_rx);
         pcm_close(adev->pcm_voice_rx);
@@ -502,6 +1390,7 @@ static void end_voice_call(struct audio_device *adev)
         pcm_close(adev->pcm_voice_tx);
         adev->pcm_voice_tx = NULL;
     }
+    pthread_mutex_unlock(&adev->call_lock);
 }
 
 static void adev_set_wb_amr_callback(void *data, int enable)
@@ -510,28 +1399,30 @@ static void adev_set_wb_amr_callback(void *data, int enable)
 
     ALOGV("%s: setting to: %d", __func__, enable);
 
-    pthread_mutex_lock(&adev->lock);
+    pthread_mutex_lock(&adev->call_lock);
     if (adev->wb_amr != enable) {
         adev->wb_amr = enable;
 
         /* reopen the modem PCMs at the new rate */
-        if (adev->in_call) {
 #if 0
-            /* TODO: set rate properly */
+        /* TODO: set rate properly, with lock held and call_lock released */
+        if (adev->in_call) {
             end_voice_call(adev);
             select_devices(adev);
             start_voice_call(adev);
-#endif
         }
+#endif
     }
-    pthread_mutex_unlock(&adev->lock);
+    pthread_mutex_unlock(&adev->call_lock);
 }
 
-static void adev_set_call_audio_path(struct audio_device *adev)
+/* called by the routing thread */
+static void adev_set_call_audio_path(struct audio_device *adev,
+                                     const struct route_request *route)
 {
     enum ril_audio_path device_type;
 
-    switch(adev->out_device) {
+    switch(route->out_device) {
         case AUDIO_DEVICE_OUT_SPEAKER:
             device_type = SOUND_AUDIO_PATH_SPEAKER;
             break;
@@ -547,7 +1438,7 @@ static void adev_set_call_audio_path(struct audio_device *adev)
         case AUDIO_DEVICE_OUT_BLUETOOTH_SCO:
         case AUDIO_DEVICE_OUT_BLUETOOTH_SCO_HEADSET:
         case AUDIO_DEVICE_OUT_BLUETOOTH_SCO_CARKIT:
-            if (adev->bluetooth_nrec) {
+            if (route->bluetooth_nrec) {
                 device_type = SOUND_AUDIO_PATH_BLUETOOTH;
             } else {
                 device_type = SOUND_AUDIO_PATH_BLUETOOTH_NO_NR;
@@ -559,73 +1450,1787 @@ static void adev_set_call_audio_path(struct audio_device *adev)
             break;
     }
 
-    ALOGV("%s: ril_set_call_audio_path(%d)", __func__, device_type);
+    HAL_TRACE(adev, TRACE_CALL_AUDIO_PATH, device_type, 0);
 
     /* TODO: Figure out which devices need EXTRA_VOLUME_PATH set */
     ril_set_call_audio_path(&adev->ril, device_type, ORIGINAL_PATH);
 }
 
-/* Helper functions */
+/* Playback mixer functions */
 
-static int start_output_stream(struct stream_out *out)
+/* left and right q15 gains are packed so that they are updated atomically */
+static inline int32_t pack_gain(int16_t left, int16_t right)
 {
-    struct audio_device *adev = out->dev;
+    return (int32_t)(((uint32_t)(uint16_t)right << 16) | (uint16_t)left);
+}
 
-    ALOGV("%s: starting stream", __func__);
+static inline void unpack_gain(int32_t packed, int16_t gain[2])
+{
+    gain[0] = (int16_t)(packed & 0xffff);
+    gain[1] = (int16_t)((uint32_t)packed >> 16);
+}
 
-    out->pcm[PCM_CARD] = pcm_open(PCM_CARD, out->pcm_device,
-                                  PCM_OUT, &out->config);
-    if (out->pcm[PCM_CARD] && !pcm_is_ready(out->pcm[PCM_CARD])) {
-        ALOGE("pcm_open(PCM_CARD) failed: %s",
-                pcm_get_error(out->pcm[PCM_CARD]));
-        pcm_close(out->pcm[PCM_CARD]);
-        return -ENOMEM;
+static inline struct audio_device *playback_mixer_to_adev(struct playback_mixer *mixer)
+{
+    return (struct audio_device *)((char *)mixer -
+                                   offsetof(struct audio_device, mixer));
+}
+
+/*
+ * Scale a mixed period of out by its volume and the master volume. Gain
+ * changes are ramped over the period to avoid zipper noise. Called from the
+ * mixer thread.
+ */
+static void playback_mixer_apply_gain(struct playback_mixer *mixer,
+                                      struct stream_out *out,
+                                      int16_t *buffer, size_t frames)
+{
+    int16_t volume[2];
+    int16_t master[2];
+    int16_t target[2];
+
+    unpack_gain(android_atomic_acquire_load(&out->volume), volume);
+    unpack_gain(android_atomic_acquire_load(&out->dev->master_gain), master);
+    target[0] = gain_q15_combine(volume[0], master[0]);
+    target[1] = gain_q15_combine(volume[1], master[1]);
+
+    gain_ramp_stereo_q15(buffer, frames, out->gain, target);
+    out->gain[0] = target[0];
+    out->gain[1] = target[1];
+}
+
+/*
+ * Config of the pcm for the lowest latency active input. Must be called with
+ * mixer mutex locked.
+ */
+static struct pcm_config *playback_mixer_get_config(struct playback_mixer *mixer)
+{
+    if (mixer->inputs[OUTPUT_ULTRA_LOW_LATENCY])
+        return android_atomic_acquire_load(&mixer->rt_refused) ?
+                &pcm_config_mmap_fallback : &pcm_config_mmap;
+    if (mixer->inputs[OUTPUT_LOW_LATENCY])
+        return &pcm_config_fast;
+    if (mixer->inputs[OUTPUT_DEEP_BUF])
+        return &pcm_config_deep;
+    return NULL;
+}
+
+/*
+ * Derive the presentation position of every input from the frames it had
+ * mixed and the frames still queued in the hardware buffer. When hw_queued
+ * is false the hardware buffer is known to be empty (closed pcm or xrun).
+ * Must be called with mixer mutex locked, from the mixer thread.
+ */
+static void playback_mixer_update_position(struct playback_mixer *mixer,
+                                           bool hw_queued)
+{
+    enum output_type type;
+    struct stream_out *out;
+    struct timespec ts;
+    unsigned int avail;
+    unsigned int buffer_size;
+    uint64_t queued = 0;
+    uint64_t presented;
+
+    if (hw_queued) {
+        if (!mixer->pcm || pcm_get_htimestamp(mixer->pcm, &avail, &ts) != 0)
+            return;
+        buffer_size = pcm_get_buffer_size(mixer->pcm);
+        queued = (avail < buffer_size) ? buffer_size - avail : 0;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, &ts);
     }
 
-    /* in call routing must go through set_parameters */
-    if (!adev->in_call) {
-        adev->out_device |= out->device;
-        select_devices(adev);
+    for (type = 0; type < OUTPUT_TOTAL; type++) {
+        out = mixer->inputs[type];
+        if (!out)
+            continue;
+        /* queued frames may include silence or other streams, so only
+         * ever move forward */
+        presented = (out->frames_mixed > queued) ? out->frames_mixed - queued : 0;
+        if (presented > out->frames_presented)
+            out->frames_presented = presented;
+        out->presented_ts = ts;
     }
+}
 
-    if (out->device & AUDIO_DEVICE_OUT_ALL_SCO)
-        start_bt_sco(adev);
+/*
+ * Run the mixer thread SCHED_FIFO while a FAST output is active. When that is
+ * refused the ultra low latency output falls back to
+ * pcm_config_mmap_fallback, and is no longer opened for new FAST outputs.
+ */
+static bool playback_mixer_set_rt(struct playback_mixer *mixer, bool rt)
+{
+    struct sched_param param;
+
+    if (rt == mixer->rt)
+        return true;
+    if (rt && android_atomic_acquire_load(&mixer->rt_refused))
+        return false;
+
+    param.sched_priority = rt ? MIXER_RT_PRIORITY : 0;
+    if (pthread_setschedparam(pthread_self(), rt ? SCHED_FIFO : SCHED_OTHER,
+                              &param) != 0) {
+        ALOGW("%s: cannot change mixer thread scheduling policy", __func__);
+        if (rt)
+            android_atomic_release_store(1, &mixer->rt_refused);
+        return false;
+    }
+    mixer->rt = rt;
+    return true;
+}
+
+/*
+ * Whether the mixer thread may run SCHED_FIFO, tried on the thread and
+ * undone. Must be called before any output is opened.
+ */
+static bool playback_mixer_can_rt(struct playback_mixer *mixer)
+{
+    struct sched_param param;
+
+    param.sched_priority = MIXER_RT_PRIORITY;
+    if (pthread_setschedparam(mixer->thread, SCHED_FIFO, &param) != 0)
+        return false;
+    param.sched_priority = 0;
+    pthread_setschedparam(mixer->thread, SCHED_OTHER, &param);
+    return true;
+}
+
+/* must be called with mixer mutex locked, from the mixer thread */
+static void playback_mixer_open_pcm(struct playback_mixer *mixer,
+                                    struct pcm_config *config)
+{
+    unsigned int flags = PCM_OUT | PCM_MONOTONIC | PCM_NORESTART;
+
+    /* short periods are fed on time only by a SCHED_FIFO thread */
+    if (!playback_mixer_set_rt(mixer, config && config != &pcm_config_deep) &&
+            config == &pcm_config_mmap)
+        config = &pcm_config_mmap_fallback;
+
+    if (mixer->pcm) {
+        pcm_close(mixer->pcm);
+        mixer->pcm = NULL;
+    }
+    mixer->config = config;
+
+    /* whatever was queued in the hardware buffer is gone */
+    playback_mixer_update_position(mixer, false);
+
+    if (config == NULL)
+        return;
+
+    HAL_TRACE(playback_mixer_to_adev(mixer), TRACE_MIXER_PCM_OPEN,
+              config->period_size, config->period_count);
+
+    if (config == &pcm_config_mmap)
+        flags |= PCM_MMAP | PCM_NOIRQ;
+
+    mixer->pcm = pcm_open(PCM_CARD, PCM_DEVICE, flags, config);
+    if (mixer->pcm && !pcm_is_ready(mixer->pcm)) {
+        ALOGE("pcm_open(PCM_DEVICE) failed: %s", pcm_get_error(mixer->pcm));
+        pcm_close(mixer->pcm);
+        mixer->pcm = NULL;
+        return;
+    }
+
+    mixer->mmap_running = false;
+    if ((flags & PCM_MMAP) && pcm_prepare(mixer->pcm) != 0) {
+        ALOGE("%s: cannot prepare mmap pcm: %s", __func__,
+              pcm_get_error(mixer->pcm));
+        pcm_close(mixer->pcm);
+        mixer->pcm = NULL;
+    }
+}
+
+/*
+ * Reopen the pcm with config. The deep buffer frames still queued in the old
+ * pcm are mixed again on the new one, ahead of its fifo, so that a low
+ * latency output starting does not wait for them to play out and they are
+ * not lost either. Must be called with mixer mutex locked, from the mixer
+ * thread.
+ */
+static void playback_mixer_switch(struct playback_mixer *mixer,
+                                  struct pcm_config *config)
+{
+    struct stream_out *out = mixer->inputs[OUTPUT_DEEP_BUF];
+    struct timespec ts;
+    unsigned int avail;
+    unsigned int buffer_size;
+    int64_t queued = 0;
+
+    if (out && out == mixer->history_out && mixer->pcm &&
+            pcm_get_htimestamp(mixer->pcm, &avail, &ts) == 0) {
+        buffer_size = pcm_get_buffer_size(mixer->pcm);
+        queued = (avail < buffer_size) ? buffer_size - avail : 0;
+    }
+
+    if (queued > 0) {
+        /* what was replayed since the last switch is a copy of the frames
+         * before replay_pos, the frames not played are contiguous there */
+        if (mixer->replay_pos == mixer->replay_end) {
+            mixer->replay_pos = mixer->history_pos;
+            mixer->replay_end = mixer->history_pos;
+        }
+        if (queued > mixer->replay_pos -
+                (mixer->history_pos - (int64_t)mixer->history_frames))
+            queued = mixer->replay_pos -
+                    (mixer->history_pos - (int64_t)mixer->history_frames);
+        if (queued > mixer->replay_pos)
+            queued = mixer->replay_pos;
+        mixer->replay_pos -= queued;
+        out->frames_mixed -= queued;
+    }
+
+    playback_mixer_open_pcm(mixer, config);
+}
+
+/* must be called with mixer mutex locked, from the mixer thread */
+static void playback_mixer_account_input(struct stream_out *out,
+                                         size_t read, size_t frames)
+{
+    out->frames_mixed += read;
+
+    if (read == frames) {
+        out->mixer_primed = true;
+    } else if (out->mixer_primed && !out->mixer_idle) {
+        /* count each starvation once, the client may just have stopped */
+        android_atomic_inc(&out->underruns);
+        out->mixer_primed = false;
+    }
+}
+
+/*
+ * Ramp the mixed period towards silence while route_mute is set and back to
+ * unity afterwards, over ROUTE_RAMP_FRAMES frames. Must be called with mixer
+ * mutex locked, from the mixer thread.
+ */
+static void playback_mixer_apply_route_gain(struct playback_mixer *mixer,
+                                            size_t frames)
+{
+    int16_t target = mixer->route_mute ? 0 : GAIN_Q15_UNITY;
+    int16_t start[2] = { mixer->route_gain, mixer->route_gain };
+    int16_t end[2];
+    size_t ramp_frames;
+    size_t ramp;
+
+    mixer->period_silent = (mixer->route_gain == 0 && target == 0);
+
+    if (mixer->route_gain != target) {
+        /* frames left to reach the target at the full ramp slope */
+        ramp_frames = (abs(target - mixer->route_gain) * ROUTE_RAMP_FRAMES +
+                       GAIN_Q15_UNITY - 1) / GAIN_Q15_UNITY;
+        ramp = (frames < ramp_frames) ? frames : ramp_frames;
+        if (ramp == ramp_frames)
+            end[0] = target;
+        else
+            end[0] = mixer->route_gain +
+                    (int32_t)(target - mixer->route_gain) * (int32_t)ramp /
+                    (int32_t)ramp_frames;
+        end[1] = end[0];
+
+        gain_ramp_stereo_q15(mixer->mix_buffer, ramp, start, end);
+        mixer->route_gain = end[0];
+        frames -= ramp;
+        if (mixer->route_gain == 0)
+            memset(mixer->mix_buffer + ramp * 2, 0, frames * 2 * sizeof(int16_t));
+    } else if (mixer->route_gain == 0) {
+        memset(mixer->mix_buffer, 0, frames * 2 * sizeof(int16_t));
+    }
+}
+
+/*
+ * Read up to frames from the fifo of out and wake its writer once the space
+ * it waits for is free. Must be called with mixer mutex locked, from the
+ * mixer thread.
+ */
+static size_t playback_mixer_read_fifo(struct stream_out *out, int16_t *buffer,
+                                       size_t frames)
+{
+    ssize_t ret = audio_utils_fifo_read(&out->fifo, buffer, frames);
+
+    if (ret <= 0)
+        return 0;
+    out->fifo_read += ret;
+    if (out->space_wanted && out->fifo_read >= out->space_wanted)
+        pthread_cond_signal(&out->space_cond);
+    return ret;
+}
+
+/*
+ * Read a period of out, zero padded. The deep buffer input first replays
+ * what playback_mixer_switch() took back and is recorded as it is mixed.
+ * Returns the frames read. Must be called with mixer mutex locked, from the
+ * mixer thread.
+ */
+static size_t playback_mixer_read(struct playback_mixer *mixer,
+                                  struct stream_out *out, int16_t *buffer,
+                                  size_t frames)
+{
+    size_t read = 0;
+    size_t done;
+    size_t offset;
+    size_t count;
+
+    if (out->type != OUTPUT_DEEP_BUF) {
+        read = playback_mixer_read_fifo(out, buffer, frames);
+        memset(buffer + read * 2, 0, (frames - read) * 2 * sizeof(int16_t));
+        return read;
+    }
+
+    if (out != mixer->history_out) {
+        mixer->history_out = out;
+        mixer->history_pos = 0;
+        mixer->replay_pos = 0;
+        mixer->replay_end = 0;
+    }
+
+    while (read < frames && mixer->replay_pos < mixer->replay_end) {
+        offset = mixer->replay_pos % mixer->history_frames;
+        count = mixer->history_frames - offset;
+        if (count > frames - read)
+            count = frames - read;
+        if ((int64_t)count > mixer->replay_end - mixer->replay_pos)
+            count = mixer->replay_end - mixer->replay_pos;
+        memcpy(buffer + read * 2, mixer->history + offset * 2,
+               count * 2 * sizeof(int16_t));
+        mixer->replay_pos += count;
+        read += count;
+    }
+
+    read += playback_mixer_read_fifo(out, buffer + read * 2, frames - read);
+    memset(buffer + read * 2, 0, (frames - read) * 2 * sizeof(int16_t));
+
+    for (done = 0; done < frames; done += count) {
+        offset = mixer->history_pos % mixer->history_frames;
+        count = mixer->history_frames - offset;
+        if (count > frames - done)
+            count = frames - done;
+        memcpy(mixer->history + offset * 2, buffer + done * 2,
+               count * 2 * sizeof(int16_t));
+        mixer->history_pos += count;
+    }
+
+    return read;
+}
+
+/*
+ * Mix one period of every active input into mix_buffer. Inputs that did not
+ * queue enough frames are padded with silence. Must be called with mixer
+ * mutex locked, from the mixer thread.
+ */
+static void playback_mixer_mix(struct playback_mixer *mixer, size_t frames)
+{
+    enum output_type type;
+    struct stream_out *single = NULL;
+    unsigned int active = 0;
+    size_t samples = frames * 2;
+    size_t i;
+    size_t read;
+
+    /* muted: hold the streams until the route switched, the pcm then only
+     * plays silence the deep buffer history does not cover */
+    if (mixer->route_mute && mixer->route_gain == 0) {
+        memset(mixer->mix_buffer, 0, samples * sizeof(int16_t));
+        mixer->period_silent = true;
+        mixer->history_out = NULL;
+        return;
+    }
+
+    for (type = 0; type < OUTPUT_TOTAL; type++) {
+        if (mixer->inputs[type]) {
+            single = mixer->inputs[type];
+            active++;
+        }
+    }
+
+    /* a single active stream is copied as is */
+    if (active == 1) {
+        read = playback_mixer_read(mixer, single, mixer->mix_buffer, frames);
+        playback_mixer_account_input(single, read, frames);
+        playback_mixer_apply_gain(mixer, single, mixer->mix_buffer, frames);
+        playback_mixer_apply_route_gain(mixer, frames);
+        return;
+    }
+
+    memset(mixer->sum_buffer, 0, samples * sizeof(int32_t));
+    for (type = 0; type < OUTPUT_TOTAL; type++) {
+        if (!mixer->inputs[type])
+            continue;
+        read = playback_mixer_read(mixer, mixer->inputs[type],
+                                   mixer->in_buffer, frames);
+        playback_mixer_account_input(mixer->inputs[type], read, frames);
+        if (read == 0)
+            continue;
+        playback_mixer_apply_gain(mixer, mixer->inputs[type],
+                                  mixer->in_buffer, read);
+        for (i = 0; i < read * 2; i++)
+            mixer->sum_buffer[i] += mixer->in_buffer[i];
+    }
+    for (i = 0; i < samples; i++)
+        mixer->mix_buffer[i] = clamp16(mixer->sum_buffer[i]);
+    playback_mixer_apply_route_gain(mixer, frames);
+}
+
+/*
+ * Copy frames to the mmap buffer of the pcm. With PCM_NOIRQ the driver
+ * raises no period interrupts, so the thread sleeps for the time the DMA
+ * needs to free the space that is missing. The pcm is started once its
+ * buffer is full. Returns -EPIPE when the DMA overtook the application
+ * pointer. Called from the mixer thread without the mixer mutex.
+ */
+static int playback_mixer_mmap_write(struct playback_mixer *mixer,
+                                     const int16_t *buffer, size_t frames)
+{
+    struct pcm *pcm = mixer->pcm;
+    unsigned int buffer_size = pcm_get_buffer_size(pcm);
+    struct timespec ts;
+    void *areas;
+    unsigned int offset;
+    unsigned int count;
+    int avail;
+    int ret;
+
+    while (frames > 0) {
+        avail = pcm_avail_update(pcm);
+        if (avail < 0)
+            return avail;
+        if (mixer->mmap_running && ((unsigned int)avail > buffer_size))
+            return -EPIPE;
+
+        if (avail == 0) {
+            if (!mixer->mmap_running) {
+                ret = pcm_start(pcm);
+                if (ret != 0)
+                    return ret;
+                mixer->mmap_running = true;
+                continue;
+            }
+            count = (frames < pcm_config_mmap.period_size) ?
+                    frames : pcm_config_mmap.period_size;
+            ts.tv_sec = 0;
+            ts.tv_nsec = (long)count * 1000000000LL / pcm_config_mmap.rate;
+            clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+            continue;
+        }
+
+        count = ((size_t)avail < frames) ? (unsigned int)avail : frames;
+        ret = pcm_mmap_begin(pcm, &areas, &offset, &count);
+        if (ret < 0)
+            return ret;
+        memcpy((char *)areas + pcm_frames_to_bytes(pcm, offset), buffer,
+               pcm_frames_to_bytes(pcm, count));
+        ret = pcm_mmap_commit(pcm, offset, count);
+        if (ret < 0)
+            return ret;
+
+        buffer += count * pcm_config_mmap.channels;
+        frames -= count;
+    }
+
+    if (!mixer->mmap_running && pcm_avail_update(pcm) == 0) {
+        ret = pcm_start(pcm);
+        if (ret != 0)
+            return ret;
+        mixer->mmap_running = true;
+    }
+
+    return 0;
+}
+
+/* called from the mixer thread without the mixer mutex */
+static int playback_mixer_write_period(struct playback_mixer *mixer,
+                                       const int16_t *buffer, size_t frames)
+{
+    if (mixer->config == &pcm_config_mmap)
+        return playback_mixer_mmap_write(mixer, buffer, frames);
+    return pcm_write(mixer->pcm, buffer, pcm_frames_to_bytes(mixer->pcm, frames));
+}
+
+/*
+ * Write the mixed period to the pcm. After an underrun the pcm is prepared
+ * again (pcm_write() does it on its own) and primed with
+ * XRUN_SILENCE_PERIODS of silence before the period is written. Any other
+ * failure is returned so that the caller reopens the pcm. Called from the
+ * mixer thread without the mixer mutex.
+ */
+static int playback_mixer_pcm_write(struct playback_mixer *mixer, size_t frames)
+{
+    int64_t now_ns;
+    int32_t xruns;
+    int ret;
+    int i;
+
+    if (!mixer->pcm)
+        return -ENODEV;
+
+    ret = playback_mixer_write_period(mixer, mixer->mix_buffer, frames);
+    if (ret != -EPIPE)
+        goto done;
+
+    xruns = android_atomic_inc(&mixer->xruns) + 1;
+    HAL_TRACE(playback_mixer_to_adev(mixer), TRACE_MIXER_UNDERRUN, xruns, 0);
+    now_ns = stats_now_ns();
+    if (now_ns - mixer->xrun_log_ns >= XRUN_LOG_INTERVAL_NS) {
+        ALOGW("%s: underrun, restarting pcm (%d since the last warning)",
+              __func__, xruns - mixer->xruns_logged);
+        mixer->xrun_log_ns = now_ns;
+        mixer->xruns_logged = xruns;
+    }
+
+    if (mixer->config == &pcm_config_mmap) {
+        mixer->mmap_running = false;
+        ret = pcm_prepare(mixer->pcm);
+        if (ret != 0)
+            goto done;
+    }
+
+    /* in_buffer is only used while mixing, on this thread */
+    memset(mixer->in_buffer, 0, pcm_frames_to_bytes(mixer->pcm, frames));
+    for (i = 0; i < XRUN_SILENCE_PERIODS; i++) {
+        ret = playback_mixer_write_period(mixer, mixer->in_buffer, frames);
+        if (ret != 0)
+            goto done;
+    }
+    ret = playback_mixer_write_period(mixer, mixer->mix_buffer, frames);
+
+done:
+    if (ret != 0) {
+        android_atomic_inc(&mixer->errors);
+        ALOGE("%s: pcm_write() failed: %s", __func__, pcm_get_error(mixer->pcm));
+    }
+    return ret;
+}
+
+/*
+ * Hand the period just written to the capture stream AEC along with the
+ * time the frame after it will be presented. Must be called with mixer
+ * mutex locked, from the mixer thread.
+ */
+static void playback_mixer_write_echo_ref(struct playback_mixer *mixer,
+                                          size_t frames)
+{
+    struct timespec ts;
+    unsigned int avail;
+    unsigned int buffer_size;
+    int64_t next_ns;
+
+    if (!mixer->echo_ref || !mixer->pcm ||
+            pcm_get_htimestamp(mixer->pcm, &avail, &ts) != 0)
+        return;
+
+    buffer_size = pcm_get_buffer_size(mixer->pcm);
+    next_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    if (avail < buffer_size)
+        next_ns += (int64_t)(buffer_size - avail) * 1000000000LL /
+                mixer->config->rate;
+
+    echo_ref_write(mixer->echo_ref, mixer->mix_buffer, frames, next_ns);
+}
+
+static void *playback_mixer_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct playback_mixer *mixer = &adev->mixer;
+    struct pcm_config *config;
+    size_t frames;
+    int ret;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_URGENT_AUDIO);
+
+    pthread_mutex_lock(&mixer->lock);
+    while (!mixer->exit) {
+        config = playback_mixer_get_config(mixer);
+        if (config != mixer->config) {
+            playback_mixer_switch(mixer, config);
+            /* changes when SCHED_FIFO was refused for the mmap pcm */
+            config = mixer->config;
+        }
+
+        if (config == NULL) {
+            pthread_cond_wait(&mixer->cond, &mixer->lock);
+            continue;
+        }
+
+        frames = config->period_size;
+        playback_mixer_mix(mixer, frames);
+        pthread_mutex_unlock(&mixer->lock);
+
+        /* pcm_write() blocks until a period is free and paces the thread */
+        ret = playback_mixer_pcm_write(mixer, frames);
+        if (ret != 0)
+            usleep(frames * 1000000 / config->rate);
+
+        pthread_mutex_lock(&mixer->lock);
+        if (ret != 0) {
+            /* do not keep feeding a wedged pcm */
+            playback_mixer_open_pcm(mixer, config);
+            android_atomic_inc(&mixer->reopens);
+        }
+        playback_mixer_update_position(mixer, ret == 0);
+        if (ret == 0)
+            playback_mixer_write_echo_ref(mixer, frames);
+
+        mixer->silent_frames = (ret == 0 && mixer->period_silent) ?
+                mixer->silent_frames + frames : 0;
+        if (mixer->silent_frames >= config->period_size * config->period_count)
+            pthread_cond_broadcast(&mixer->mute_cond);
+    }
+    playback_mixer_open_pcm(mixer, NULL);
+    pthread_mutex_unlock(&mixer->lock);
 
-    ALOGV("%s: stream out device: %d, actual: %d",
-          __func__, out->device, adev->out_device);
+    return NULL;
+}
+
+static int playback_mixer_init(struct audio_device *adev)
+{
+    struct playback_mixer *mixer = &adev->mixer;
+    /* deep buffer periods are the largest the mixer handles */
+    size_t samples = pcm_config_deep.period_size * pcm_config_deep.channels;
+
+    mixer->in_buffer = malloc(samples * sizeof(int16_t));
+    mixer->sum_buffer = malloc(samples * sizeof(int32_t));
+    mixer->mix_buffer = malloc(samples * sizeof(int16_t));
+    /* the deep buffer pcm holds at most its buffer, replayed while the
+     * period after it is recorded */
+    mixer->history_frames = pcm_config_deep.period_size *
+            (pcm_config_deep.period_count + 1);
+    mixer->history = malloc(mixer->history_frames * 2 * sizeof(int16_t));
+    if (!mixer->in_buffer || !mixer->sum_buffer || !mixer->mix_buffer ||
+            !mixer->history)
+        goto err_alloc;
+
+    mixer->route_gain = GAIN_Q15_UNITY;
+
+    pthread_mutex_init(&mixer->lock, NULL);
+    pthread_cond_init(&mixer->cond, NULL);
+    pthread_cond_init(&mixer->mute_cond, NULL);
+
+    if (pthread_create(&mixer->thread, NULL, playback_mixer_thread, adev) != 0) {
+        ALOGE("%s: cannot create mixer thread", __func__);
+        pthread_cond_destroy(&mixer->mute_cond);
+        pthread_cond_destroy(&mixer->cond);
+        pthread_mutex_destroy(&mixer->lock);
+        goto err_alloc;
+    }
+
+    return 0;
+
+err_alloc:
+    free(mixer->in_buffer);
+    free(mixer->sum_buffer);
+    free(mixer->mix_buffer);
+    free(mixer->history);
+    return -ENOMEM;
+}
+
+static void playback_mixer_release(struct audio_device *adev)
+{
+    struct playback_mixer *mixer = &adev->mixer;
+
+    pthread_mutex_lock(&mixer->lock);
+    mixer->exit = true;
+    pthread_cond_signal(&mixer->cond);
+    pthread_mutex_unlock(&mixer->lock);
+    pthread_join(mixer->thread, NULL);
+
+    pthread_cond_destroy(&mixer->mute_cond);
+    pthread_cond_destroy(&mixer->cond);
+    pthread_mutex_destroy(&mixer->lock);
+    free(mixer->in_buffer);
+    free(mixer->sum_buffer);
+    free(mixer->mix_buffer);
+    free(mixer->history);
+}
+
+/*
+ * Mute the mixer output with a short ramp and wait until the hardware buffer
+ * only holds silence, so that the output route can be switched without a
+ * pop and without putting the streams in standby. Unmuting ramps back up.
+ * Once muted the streams are not consumed, their frames play after the
+ * switch. Called from the routing thread.
+ */
+static void playback_mixer_mute(struct playback_mixer *mixer, bool mute)
+{
+    pthread_mutex_lock(&mixer->lock);
+    mixer->route_mute = mute;
+    mixer->silent_frames = 0;
+    /* with no pcm open nothing is playing; config only changes with the
+     * mixer mutex held */
+    while (mute && mixer->config && mixer->silent_frames <
+           mixer->config->period_size * mixer->config->period_count) {
+        if (pthread_cond_timeout_np(&mixer->mute_cond, &mixer->lock,
+                                    ROUTE_MUTE_TIMEOUT_MS) != 0) {
+            ALOGW("%s: output still playing, switching anyway", __func__);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+/* must be called with output stream mutex locked */
+static void playback_mixer_add_input(struct stream_out *out)
+{
+    struct playback_mixer *mixer = &out->dev->mixer;
+
+    pthread_mutex_lock(&mixer->lock);
+    mixer->inputs[out->type] = out;
+    out->mixer_primed = false;
+    out->mixer_idle = false;
+    pthread_cond_signal(&mixer->cond);
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+/* must be called with output stream mutex locked, drops queued frames */
+static void playback_mixer_remove_input(struct stream_out *out)
+{
+    struct playback_mixer *mixer = &out->dev->mixer;
+
+    pthread_mutex_lock(&mixer->lock);
+    mixer->inputs[out->type] = NULL;
+    if (mixer->history_out == out)
+        mixer->history_out = NULL;
+    audio_utils_fifo_init(&out->fifo, out->fifo_frames,
+                          audio_stream_frame_size(&out->stream.common),
+                          out->fifo_buffer);
+    out->frames_mixed = out->frames_written;
+    out->frames_presented = out->frames_written;
+    clock_gettime(CLOCK_MONOTONIC, &out->presented_ts);
+    pthread_cond_signal(&mixer->cond);
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+/*
+ * An idle input stays mixed but running out of frames is not an underrun.
+ * Must be called with output stream mutex locked.
+ */
+static void playback_mixer_set_idle(struct stream_out *out, bool idle)
+{
+    struct playback_mixer *mixer = &out->dev->mixer;
+
+    pthread_mutex_lock(&mixer->lock);
+    out->mixer_idle = idle;
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+/* account for frames that will never be played */
+static void playback_mixer_drop_frames(struct stream_out *out, size_t frames)
+{
+    struct playback_mixer *mixer = &out->dev->mixer;
+
+    pthread_mutex_lock(&mixer->lock);
+    out->frames_mixed += frames;
+    out->frames_presented += frames;
+    pthread_mutex_unlock(&mixer->lock);
+}
+
+/*
+ * Queue frames for the playback mixer, sleeping while the stream fifo is
+ * full until the mixer read up to a period from it. Must be called with
+ * output stream mutex locked. The mutex is released while sleeping, so that
+ * routing and standby do not wait for the mixer with the hw device mutex
+ * held; a stream put in standby meanwhile drops the frames, its fifo was
+ * flushed.
+ */
+static int playback_mixer_write(struct stream_out *out, const void *buffer,
+                                size_t frames)
+{
+    struct playback_mixer *mixer = &out->dev->mixer;
+    const char *data = (const char *)buffer;
+    size_t frame_size = audio_stream_frame_size(&out->stream.common);
+    size_t total = frames;
+    int64_t stall_ns = 0;
+    int64_t start_ns;
+    size_t wanted;
+    ssize_t written;
+
+    written = audio_utils_fifo_write(&out->fifo, data, frames);
+    if (written > 0) {
+        data += written * frame_size;
+        frames -= written;
+    }
+    if (frames == 0)
+        return 0;
+
+    pthread_mutex_lock(&mixer->lock);
+    for (;;) {
+        written = audio_utils_fifo_write(&out->fifo, data, frames);
+        if (written > 0) {
+            data += written * frame_size;
+            frames -= written;
+            stall_ns = 0;
+        }
+        if (frames == 0)
+            break;
+
+        if (stall_ns >= MIXER_STALL_TIMEOUT_US * 1000LL) {
+            pthread_mutex_unlock(&mixer->lock);
+            ALOGE("%s: playback mixer stalled, dropping %zu frames",
+                  __func__, frames);
+            playback_mixer_drop_frames(out, frames);
+            return -EIO;
+        }
+
+        /* the fifo is full, free space is what the mixer reads from now */
+        wanted = (frames < out->config.period_size) ?
+                frames : out->config.period_size;
+        out->space_wanted = out->fifo_read + wanted;
+        start_ns = stats_now_ns();
+        pthread_mutex_unlock(&out->lock);
+        pthread_cond_timeout_np(&out->space_cond, &mixer->lock,
+                                (MIXER_STALL_TIMEOUT_US / 1000) -
+                                (unsigned int)(stall_ns / 1000000));
+        out->space_wanted = 0;
+
+        /* respect the stream -> mixer mutex acquisition order */
+        pthread_mutex_unlock(&mixer->lock);
+        pthread_mutex_lock(&out->lock);
+        if (android_atomic_acquire_load(&out->state) != STREAM_RUNNING) {
+            playback_mixer_drop_frames(out, total);
+            return 0;
+        }
+        pthread_mutex_lock(&mixer->lock);
+        stall_ns += stats_now_ns() - start_ns;
+    }
+    pthread_mutex_unlock(&mixer->lock);
+
+    return 0;
+}
+
+static inline struct audio_device *capture_mux_to_adev(struct capture_mux *mux)
+{
+    return (struct audio_device *)((char *)mux -
+                                   offsetof(struct audio_device, capture));
+}
+
+/* the pcm config of a capture at rate, with periods as long as pcm_config_in */
+static void capture_mux_config(struct pcm_config *config, unsigned int rate)
+{
+    *config = pcm_config_in;
+    config->rate = rate;
+    config->period_size = pcm_config_in.period_size * rate / pcm_config_in.rate;
+}
+
+/* must be called with capture mutex locked, from the capture thread */
+static void capture_mux_open_pcm(struct capture_mux *mux)
+{
+    HAL_TRACE(capture_mux_to_adev(mux), TRACE_CAPTURE_PCM_OPEN,
+              mux->config.rate, mux->config.period_size);
+
+    mux->pcm = pcm_open(PCM_CARD, PCM_DEVICE_IN, PCM_IN, &mux->config);
+    if (mux->pcm && !pcm_is_ready(mux->pcm)) {
+        ALOGE("pcm_open(PCM_DEVICE_IN) failed: %s", pcm_get_error(mux->pcm));
+        pcm_close(mux->pcm);
+        mux->pcm = NULL;
+    }
+    mux->pcm_running = false;
+}
+
+/* publish the writer position, from the capture thread */
+static void capture_mux_set_position(struct capture_mux *mux, int64_t written,
+                                     int64_t next_ns)
+{
+    android_atomic_inc(&mux->seq);
+    android_memory_barrier();
+    mux->written = written;
+    mux->next_ns = next_ns;
+    android_atomic_inc(&mux->seq);
+}
+
+static void capture_mux_get_position(struct capture_mux *mux, int64_t *written,
+                                     int64_t *next_ns)
+{
+    int32_t seq;
+
+    do {
+        seq = android_atomic_acquire_load(&mux->seq);
+        *written = mux->written;
+        *next_ns = mux->next_ns;
+        android_memory_barrier();
+    } while ((seq & 1) || seq != mux->seq);
+}
+
+/*
+ * Open the pcm for the config wanted. A client rate the codec does not
+ * capture at falls back to pcm_config_in. Must be called with
+ * capture mutex locked, from the capture thread.
+ */
+static void capture_mux_apply_config(struct capture_mux *mux)
+{
+    if (mux->pcm) {
+        pcm_close(mux->pcm);
+        mux->pcm = NULL;
+    }
+
+    mux->config = mux->wanted;
+    capture_mux_open_pcm(mux);
+    if (!mux->pcm && mux->config.rate != pcm_config_in.rate) {
+        ALOGW("%s: cannot capture at %u Hz, resampling from %u Hz",
+              __func__, mux->config.rate, pcm_config_in.rate);
+        mux->config = pcm_config_in;
+        capture_mux_open_pcm(mux);
+    }
+
+    mux->ring_frames = mux->config.period_size * CAPTURE_RING_PERIODS;
+    capture_mux_set_position(mux, 0, stats_now_ns());
+
+    mux->open_gen = mux->config_gen;
+    mux->open_status = mux->pcm ? 0 : -ENODEV;
+    pthread_cond_broadcast(&mux->cond);
+}
+
+/*
+ * Count an overrun when the hardware buffer is full, or when the pcm has
+ * stopped running since the last read. pcm_read() restarts the pcm on its
+ * own. Called from the capture thread.
+ */
+static void capture_mux_check_overrun(struct capture_mux *mux)
+{
+    unsigned int avail;
+    struct timespec ts;
+
+    if (pcm_get_htimestamp(mux->pcm, &avail, &ts) != 0) {
+        if (!mux->pcm_running)
+            return;
+    } else if (avail < pcm_get_buffer_size(mux->pcm)) {
+        return;
+    }
+
+    android_atomic_inc(&mux->overruns);
+    HAL_TRACE(capture_mux_to_adev(mux), TRACE_CAPTURE_OVERRUN,
+              android_atomic_acquire_load(&mux->overruns), 0);
+}
+
+/*
+ * Read a period into the ring and publish it with the capture time of the
+ * frame following it. Called from the capture thread, without the capture
+ * mutex: the streams only read the ring behind the published position.
+ */
+static int capture_mux_read_period(struct capture_mux *mux)
+{
+    size_t frames = mux->config.period_size;
+    int64_t written = mux->written;
+    int64_t next_ns;
+    int64_t gap_ns;
+    unsigned int avail;
+    struct timespec ts;
+    int ret;
+
+    capture_mux_check_overrun(mux);
+
+    ret = pcm_read(mux->pcm,
+                   mux->ring + (written % mux->ring_frames) * mux->config.channels,
+                   pcm_frames_to_bytes(mux->pcm, frames));
+    if (ret != 0)
+        return ret;
+    mux->pcm_running = true;
+
+    if (pcm_get_htimestamp(mux->pcm, &avail, &ts) == 0)
+        next_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec -
+                (int64_t)avail * 1000000000LL / mux->config.rate;
+    else
+        next_ns = stats_now_ns();
+
+    /*
+     * The period should start where the previous one ended. It starts later
+     * when the pcm was restarted after an overrun or an error, the frames of
+     * the gap were never captured.
+     */
+    gap_ns = next_ns - mux->next_ns -
+            (int64_t)frames * 1000000000LL / mux->config.rate;
+    if (written > 0 &&
+            gap_ns > (int64_t)frames * 500000000LL / mux->config.rate)
+        android_atomic_add((int32_t)(gap_ns * mux->config.rate / 1000000000LL),
+                           &mux->frames_lost);
+
+    capture_mux_set_position(mux, written + frames, next_ns);
+
+    return 0;
+}
+
+/*
+ * Prepare the pcm again after a read error, reopen it when that fails. Must
+ * be called with capture mutex locked, from the capture thread.
+ */
+static void capture_mux_recover_pcm(struct capture_mux *mux)
+{
+    mux->pcm_running = false;
+    if (pcm_prepare(mux->pcm) == 0)
+        return;
+
+    ALOGW("%s: reopening capture pcm", __func__);
+    pcm_close(mux->pcm);
+    mux->pcm = NULL;
+    capture_mux_open_pcm(mux);
+    android_atomic_inc(&mux->reopens);
+}
+
+static void *capture_mux_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct capture_mux *mux = &adev->capture;
+    int ret;
+
+    setpriority(PRIO_PROCESS, 0, ANDROID_PRIORITY_URGENT_AUDIO);
+
+    pthread_mutex_lock(&mux->lock);
+    while (!mux->exit) {
+        if (mux->open_gen != mux->config_gen)
+            capture_mux_apply_config(mux);
+
+        if (mux->users == 0) {
+            if (mux->pcm) {
+                pcm_close(mux->pcm);
+                mux->pcm = NULL;
+            }
+            pthread_cond_wait(&mux->cond, &mux->lock);
+            continue;
+        }
+
+        if (!mux->pcm) {
+            /* the pcm could not be reopened after an error, retry */
+            pthread_cond_timeout_np(&mux->cond, &mux->lock,
+                                    CAPTURE_READ_TIMEOUT_MS);
+            if (!mux->exit && mux->users > 0 && !mux->pcm &&
+                    mux->open_gen == mux->config_gen) {
+                capture_mux_open_pcm(mux);
+                android_atomic_inc(&mux->reopens);
+            }
+            continue;
+        }
+
+        pthread_mutex_unlock(&mux->lock);
+        /* pcm_read() blocks until a period was captured and paces the thread */
+        ret = capture_mux_read_period(mux);
+        if (ret != 0) {
+            ALOGE("%s: pcm_read error %d", __func__, ret);
+            android_atomic_inc(&mux->errors);
+            usleep(mux->config.period_size * 1000000 / mux->config.rate);
+        }
+
+        pthread_mutex_lock(&mux->lock);
+        if (ret != 0)
+            capture_mux_recover_pcm(mux);
+        pthread_cond_broadcast(&mux->data_cond);
+    }
+    if (mux->pcm)
+        pcm_close(mux->pcm);
+    pthread_mutex_unlock(&mux->lock);
+
+    return NULL;
+}
+
+static int capture_mux_init(struct audio_device *adev)
+{
+    struct capture_mux *mux = &adev->capture;
+
+    /* periods at pcm_config_in are the largest the ring holds */
+    mux->ring = malloc(pcm_config_in.period_size * CAPTURE_RING_PERIODS *
+                       pcm_config_in.channels * sizeof(int16_t));
+    if (!mux->ring)
+        return -ENOMEM;
+
+    pthread_mutex_init(&mux->lock, NULL);
+    pthread_cond_init(&mux->cond, NULL);
+    pthread_cond_init(&mux->data_cond, NULL);
+
+    if (pthread_create(&mux->thread, NULL, capture_mux_thread, adev) != 0) {
+        ALOGE("%s: cannot create capture thread", __func__);
+        pthread_cond_destroy(&mux->data_cond);
+        pthread_cond_destroy(&mux->cond);
+        pthread_mutex_destroy(&mux->lock);
+        free(mux->ring);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void capture_mux_release(struct audio_device *adev)
+{
+    struct capture_mux *mux = &adev->capture;
+
+    pthread_mutex_lock(&mux->lock);
+    mux->exit = true;
+    pthread_cond_signal(&mux->cond);
+    pthread_mutex_unlock(&mux->lock);
+    pthread_join(mux->thread, NULL);
+
+    pthread_cond_destroy(&mux->data_cond);
+    pthread_cond_destroy(&mux->cond);
+    pthread_mutex_destroy(&mux->lock);
+    free(mux->ring);
+}
+
+/*
+ * Start capturing for one more user. The first one asks for *config, a later
+ * one asking for a higher rate reopens the pcm at it. All get the config the
+ * pcm runs with back in *config. Must be called with hw device mutex locked.
+ */
+static int capture_mux_attach(struct capture_mux *mux, struct pcm_config *config)
+{
+    int ret;
+
+    pthread_mutex_lock(&mux->lock);
+    if (mux->users == 0 || config->rate > mux->config.rate) {
+        mux->wanted = *config;
+        mux->config_gen++;
+    }
+    mux->users++;
+    pthread_cond_broadcast(&mux->cond);
+
+    while (mux->open_gen != mux->config_gen)
+        pthread_cond_wait(&mux->cond, &mux->lock);
+
+    ret = mux->open_status;
+    if (ret == 0)
+        *config = mux->config;
+    else
+        mux->users--;
+    pthread_mutex_unlock(&mux->lock);
+
+    return ret;
+}
+
+/* must be called with hw device mutex locked, the last user stops the pcm */
+static void capture_mux_detach(struct capture_mux *mux)
+{
+    pthread_mutex_lock(&mux->lock);
+    mux->users--;
+    pthread_cond_broadcast(&mux->cond);
+    pthread_mutex_unlock(&mux->lock);
+}
+
+/* must be called with input stream mutex locked */
+static void in_add_frames_lost(struct stream_in *in, int64_t frames)
+{
+    in->frames_lost += (uint32_t)frames;
+    in->frames_lost_count += frames;
+}
+
+/*
+ * Count frames of the capture timeline, at the pcm rate, that in will never
+ * read, less the ones a failed read already counted. Must be called with
+ * input stream mutex locked.
+ */
+static void capture_mux_add_lost(struct capture_mux *mux, struct stream_in *in,
+                                 int64_t frames)
+{
+    int64_t filled = (frames < in->mux_filled) ? frames : in->mux_filled;
+
+    in->mux_filled -= filled;
+    in_add_frames_lost(in, (frames - filled) * in->requested_rate /
+                       mux->config.rate);
+}
+
+/*
+ * Copy the next frames captured for in, waiting for the capture thread when
+ * they are not there yet. A stream more than the ring behind skips to the
+ * oldest period the thread is not overwriting and counts an overrun, so does
+ * a stream overtaken while copying. Must be called with input stream mutex
+ * locked, while the stream is attached.
+ */
+static int capture_mux_read(struct capture_mux *mux, struct stream_in *in,
+                            int16_t *buffer, size_t frames)
+{
+    size_t channels = mux->config.channels;
+    int64_t max_lag = mux->ring_frames - mux->config.period_size;
+    int64_t written;
+    int64_t next_ns;
+    size_t offset;
+    size_t chunk;
+    int32_t count;
+    int ret;
+
+    /* the pcm statistics count for every stream attached */
+    count = android_atomic_acquire_load(&mux->overruns);
+    android_atomic_add(count - in->mux_overruns, &in->overruns);
+    in->mux_overruns = count;
+    count = android_atomic_acquire_load(&mux->errors);
+    android_atomic_add(count - in->mux_errors, &in->read_errors);
+    in->mux_errors = count;
+
+    for (;;) {
+        /* a gap is counted before the position after it is published */
+        capture_mux_get_position(mux, &written, &next_ns);
+        count = android_atomic_acquire_load(&mux->frames_lost);
+        capture_mux_add_lost(mux, in, count - in->mux_frames_lost);
+        in->mux_frames_lost = count;
+
+        if (written - in->mux_read > max_lag) {
+            android_atomic_inc(&in->overruns);
+            capture_mux_add_lost(mux, in, written - max_lag - in->mux_read);
+            in->mux_read = written - max_lag;
+        }
+
+        if (in->mux_filled > 0) {
+            chunk = (written - in->mux_read < in->mux_filled) ?
+                    written - in->mux_read : in->mux_filled;
+            in->mux_read += chunk;
+            in->mux_filled -= chunk;
+        }
+
+        if (written - in->mux_read < (int64_t)frames) {
+            ret = 0;
+            pthread_mutex_lock(&mux->lock);
+            if (mux->written == written)
+                ret = pthread_cond_timeout_np(&mux->data_cond, &mux->lock,
+                                              CAPTURE_READ_TIMEOUT_MS);
+            pthread_mutex_unlock(&mux->lock);
+            if (ret != 0)
+                return -ETIMEDOUT;
+            continue;
+        }
+
+        offset = in->mux_read % mux->ring_frames;
+        chunk = mux->ring_frames - offset;
+        if (chunk > frames)
+            chunk = frames;
+        memcpy(buffer, mux->ring + offset * channels,
+               chunk * channels * sizeof(int16_t));
+        memcpy(buffer + chunk * channels, mux->ring,
+               (frames - chunk) * channels * sizeof(int16_t));
+
+        capture_mux_get_position(mux, &written, &next_ns);
+        if (written - in->mux_read <= max_lag)
+            break;
+    }
+    in->mux_read += frames;
+
+    return 0;
+}
+
+/* CLOCK_MONOTONIC time the frame at the position of in was captured */
+static int64_t capture_mux_get_time(struct capture_mux *mux,
+                                    struct stream_in *in)
+{
+    int64_t written;
+    int64_t next_ns;
+
+    capture_mux_get_position(mux, &written, &next_ns);
+    return next_ns - (written - in->mux_read) * 1000000000LL / mux->config.rate;
+}
+
+/* Helper functions */
+
+static int start_output_stream(struct stream_out *out)
+{
+    struct audio_device *adev = out->dev;
+
+    playback_mixer_add_input(out);
+
+    /* in call routing must go through set_parameters */
+    if (!adev->in_call) {
+        adev->out_device |= out->device;
+        select_devices(adev);
+    }
+
+    if (out->device & AUDIO_DEVICE_OUT_ALL_SCO)
+        start_bt_sco(adev);
+
+    HAL_TRACE(adev, TRACE_OUT_START, out->device, adev->out_device);
+
+    return 0;
+}
+
+/* the AEC gets the reference at the capture rate, in mono */
+static void in_configure_reverse(struct stream_in *in)
+{
+    effect_config_t config;
+    uint32_t size = sizeof(int);
+    int status = 0;
+
+    memset(&config, 0, sizeof(config));
+    config.inputCfg.accessMode = EFFECT_BUFFER_ACCESS_READ;
+    config.inputCfg.format = AUDIO_FORMAT_PCM_16_BIT;
+    config.inputCfg.samplingRate = in->requested_rate;
+    config.inputCfg.channels = AUDIO_CHANNEL_IN_MONO;
+    config.inputCfg.mask = EFFECT_CONFIG_SMP_RATE | EFFECT_CONFIG_CHANNELS |
+            EFFECT_CONFIG_FORMAT;
+    config.outputCfg = config.inputCfg;
+    config.outputCfg.accessMode = EFFECT_BUFFER_ACCESS_WRITE;
+
+    if ((*in->aec)->command(in->aec, EFFECT_CMD_SET_CONFIG_REVERSE,
+                            sizeof(effect_config_t), &config,
+                            &size, &status) != 0 || status != 0)
+        ALOGW("%s: AEC rejected reverse config: %d", __func__, status);
+}
+
+/* must be called with input stream mutex locked */
+static void in_start_echo_ref(struct stream_in *in)
+{
+    struct playback_mixer *mixer = &in->dev->mixer;
+    struct echo_ref *ref;
+    bool registered = false;
+
+    ref = echo_ref_create(pcm_config_in.rate, 2, ECHO_REF_FRAMES);
+    if (!ref)
+        return;
+
+    /* the mixer feeds a single capture stream */
+    pthread_mutex_lock(&mixer->lock);
+    if (!mixer->echo_ref) {
+        mixer->echo_ref = ref;
+        registered = true;
+    }
+    pthread_mutex_unlock(&mixer->lock);
+    if (!registered) {
+        ALOGW("%s: echo reference already in use", __func__);
+        echo_ref_release(ref);
+        return;
+    }
+
+    if (in->requested_rate != pcm_config_in.rate &&
+            create_resampler(pcm_config_in.rate, in->requested_rate, 1,
+                             RESAMPLER_QUALITY_VOIP, NULL,
+                             &in->ref_resampler) != 0)
+        in->ref_resampler = NULL;
+
+    in->echo_ref = ref;
+    ALOGV("%s: echo reference started", __func__);
+}
+
+/* must be called with input stream mutex locked */
+static void in_stop_echo_ref(struct stream_in *in)
+{
+    struct playback_mixer *mixer = &in->dev->mixer;
+
+    if (!in->echo_ref)
+        return;
+
+    pthread_mutex_lock(&mixer->lock);
+    mixer->echo_ref = NULL;
+    pthread_mutex_unlock(&mixer->lock);
+
+    echo_ref_release(in->echo_ref);
+    in->echo_ref = NULL;
+    if (in->ref_resampler) {
+        release_resampler(in->ref_resampler);
+        in->ref_resampler = NULL;
+    }
+    ALOGV("%s: echo reference stopped", __func__);
+}
+
+/*
+ * Follow the routing snapshot: keep the mic of the input route in a mono
+ * capture, pick the preprocessing the eS325 leaves to the HAL and start or
+ * stop the echo reference as the AEC, the eS325 preset and the measurement
+ * mode require. Must be called with input stream mutex locked, while the
+ * stream is active.
+ */
+static void in_update_route(struct stream_in *in)
+{
+    struct route_snapshot route;
+    bool es325_bypassed;
+    bool aec_reverse;
+
+    route_snapshot_get(in->dev, &route);
+    in->route_gen = route.gen;
+
+    switch (route.input_channel) {
+    case INPUT_CHANNEL_RIGHT:
+        in->to_mono = stereo_to_mono_right;
+        break;
+    case INPUT_CHANNEL_MIX:
+        in->to_mono = stereo_to_mono_mix;
+        break;
+    default:
+        in->to_mono = stereo_to_mono_left;
+        break;
+    }
+
+    es325_bypassed = route.es325_preset == ES325_PRESET_OFF ||
+                     route.es325_preset == ES325_PRESET_INIT;
+    in->fx_allowed = es325_bypassed ? CAPTURE_FX_ALL : CAPTURE_FX_GAIN;
+
+    aec_reverse = in->aec && es325_bypassed;
+    if (aec_reverse && !in->aec_reverse)
+        in_configure_reverse(in);
+    in->aec_reverse = aec_reverse;
+
+    if (in->aec_reverse || in->echo_delay) {
+        if (!in->echo_ref)
+            in_start_echo_ref(in);
+    } else {
+        in_stop_echo_ref(in);
+    }
+}
+
+/*
+ * CLOCK_MONOTONIC time the next frame returned by in_read() was captured.
+ * Must be called with input stream mutex locked.
+ */
+static int64_t in_get_capture_time(struct stream_in *in)
+{
+    int64_t ns;
+
+    ns = capture_mux_get_time(&in->dev->capture, in);
+    ns -= (int64_t)in->frames_in * 1000000000LL / in->config.rate;
+    if (in->resampler)
+        ns -= in->resampler->delay_ns(in->resampler);
+
+    return ns;
+}
+
+/*
+ * Read the reference for frames captured from capture_ns on, pass it to the
+ * AEC and to the delay measurement. Must be called with input stream mutex
+ * locked.
+ */
+static void in_process_echo_ref(struct stream_in *in, const int16_t *buffer,
+                                size_t frames, int64_t capture_ns)
+{
+    size_t ref_frames;
+    size_t out_frames = frames;
+    audio_buffer_t buf;
+
+    ref_frames = (frames * pcm_config_in.rate + in->requested_rate - 1) /
+            in->requested_rate;
+
+    if (frames > in->ref_frames) {
+        free(in->ref_buffer);
+        free(in->ref_mono);
+        in->ref_buffer = malloc(ref_frames * 2 * sizeof(int16_t));
+        in->ref_mono = malloc(frames * sizeof(int16_t));
+        if (!in->ref_buffer || !in->ref_mono) {
+            free(in->ref_buffer);
+            free(in->ref_mono);
+            in->ref_buffer = NULL;
+            in->ref_mono = NULL;
+            in->ref_frames = 0;
+            return;
+        }
+        in->ref_frames = frames;
+    }
+
+    echo_ref_read(in->echo_ref, in->ref_buffer, ref_frames, capture_ns);
+    downmix_to_mono_i16_from_stereo_i16(in->ref_buffer, in->ref_buffer,
+                                        ref_frames);
+    if (in->ref_resampler) {
+        in->ref_resampler->resample_from_input(in->ref_resampler,
+                                               in->ref_buffer, &ref_frames,
+                                               in->ref_mono, &out_frames);
+        if (out_frames < frames)
+            memset(in->ref_mono + out_frames, 0,
+                   (frames - out_frames) * sizeof(int16_t));
+    } else {
+        memcpy(in->ref_mono, in->ref_buffer, frames * sizeof(int16_t));
+    }
+
+    if (in->aec_reverse) {
+        buf.frameCount = frames;
+        buf.s16 = in->ref_mono;
+        (*in->aec)->process_reverse(in->aec, &buf, NULL);
+    }
+
+    if (in->echo_delay)
+        android_atomic_release_store(
+                echo_delay_update(in->echo_delay, buffer,
+                                  popcount(in->channel_mask), in->ref_mono,
+                                  frames, in->requested_rate),
+                &in->echo_delay_us);
+}
+
+/* rate the stream asks the capture pcm for, see in_attach_capture() */
+static unsigned int in_preferred_rate(const struct stream_in *in)
+{
+    size_t i;
+
+    if (!in->dev->native_capture)
+        return pcm_config_in.rate;
+
+    for (i = 0; i < ARRAY_SIZE(capture_native_rates); i++)
+        if (capture_native_rates[i] == in->requested_rate)
+            return in->requested_rate;
+    return pcm_config_in.rate;
+}
+
+/*
+ * Read the capture ring at rate, through a resampler when it is not the
+ * client rate. Must be called with input stream mutex locked, or before the
+ * stream is returned to the client.
+ */
+static int in_set_capture_rate(struct stream_in *in, unsigned int rate)
+{
+    int ret;
+
+    if (rate == in->config.rate &&
+            (in->resampler != NULL) == (rate != in->requested_rate))
+        return 0;
+
+    if (in->resampler) {
+        release_resampler(in->resampler);
+        in->resampler = NULL;
+    }
+    capture_mux_config(&in->config, rate);
+    if (rate == in->requested_rate)
+        return 0;
+
+    ret = create_resampler(rate,
+                           in->requested_rate,
+                           popcount(in->channel_mask),
+                           RESAMPLER_QUALITY_DEFAULT,
+                           &in->buf_provider,
+                           &in->resampler);
+    if (ret != 0)
+        return -EINVAL;
+
+    ALOGV("%s: Created resampler converting %d -> %d\n",
+          __func__, rate, in->requested_rate);
+    return 0;
+}
+
+/*
+ * Read the capture ring again from the current position after the pcm was
+ * reopened under the stream, at its new rate. The frames between capture_ns
+ * and the new pcm start were never captured for the stream. Must be called
+ * with input stream mutex locked.
+ */
+static void in_follow_capture(struct stream_in *in, int64_t capture_ns)
+{
+    struct capture_mux *mux = &in->dev->capture;
+    int64_t next_ns;
+
+    if (in_set_capture_rate(in, mux->config.rate) != 0)
+        ALOGE("%s: cannot resample from %u Hz", __func__, mux->config.rate);
+    if (in->resampler)
+        in->resampler->reset(in->resampler);
+    in->frames_in = 0;
+
+    capture_mux_get_position(mux, &in->mux_read, &next_ns);
+    in->mux_overruns = android_atomic_acquire_load(&mux->overruns);
+    in->mux_errors = android_atomic_acquire_load(&mux->errors);
+    in->mux_frames_lost = android_atomic_acquire_load(&mux->frames_lost);
+    in->mux_filled = 0;
+
+    if (next_ns > capture_ns)
+        in_add_frames_lost(in, (next_ns - capture_ns) * in->requested_rate /
+                           1000000000LL);
+}
+
+/*
+ * Start capturing for in at its preferred rate. When that is higher than the
+ * rate of the running captures the pcm is reopened at it: they are held
+ * while it happens and then resample from the new rate. Returns the config
+ * the pcm runs with in *config. Must be called with hw device mutex locked,
+ * in not being an active input.
+ */
+static int in_attach_capture(struct stream_in *in, struct pcm_config *config)
+{
+    struct audio_device *adev = in->dev;
+    int64_t capture_ns[CAPTURE_MUX_INPUTS];
+    unsigned int reopen = 0;
+    unsigned int i;
+    int ret;
+
+    capture_mux_config(config, in_preferred_rate(in));
+
+    /* the config is stable while captures run, they are attached */
+    if (adev->num_active_inputs > 0 &&
+            config->rate > adev->capture.config.rate)
+        reopen = adev->num_active_inputs;
+
+    for (i = 0; i < reopen; i++) {
+        pthread_mutex_lock(&adev->active_inputs[i]->lock);
+        capture_ns[i] = in_get_capture_time(adev->active_inputs[i]);
+    }
+
+    ret = capture_mux_attach(&adev->capture, config);
+
+    for (i = 0; i < reopen; i++) {
+        in_follow_capture(adev->active_inputs[i], capture_ns[i]);
+        pthread_mutex_unlock(&adev->active_inputs[i]->lock);
+    }
+    if (reopen > 0)
+        ALOGI("%s: capturing at %u Hz for %u Hz", __func__,
+              adev->capture.config.rate, in->requested_rate);
+
+    return ret;
+}
+
+/*
+ * Concurrent captures share the input route, it follows the active input
+ * with the highest priority: a background hotword listener gives way to any
+ * other capture, voice communication wins over everything.
+ */
+static int input_source_priority(audio_source_t source)
+{
+    switch (source) {
+    case AUDIO_SOURCE_HOTWORD:
+        return 0;
+    case AUDIO_SOURCE_CAMCORDER:
+    case AUDIO_SOURCE_VOICE_RECOGNITION:
+        return 2;
+    case AUDIO_SOURCE_VOICE_COMMUNICATION:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+/*
+ * Route the input of the active input with the highest priority, the one
+ * that started last among equals, or no input at all. Must be called with hw
+ * device mutex locked.
+ */
+static void select_input(struct audio_device *adev)
+{
+    struct stream_in *in = NULL;
+    unsigned int i;
+
+    for (i = 0; i < adev->num_active_inputs; i++) {
+        if (!in || input_source_priority(adev->active_inputs[i]->input_source) >=
+                input_source_priority(in->input_source))
+            in = adev->active_inputs[i];
+    }
+
+    eS325_SetActiveIoHandle(in ? in->io_handle : ES325_IO_HANDLE_NONE);
+
+    /* in call routing must go through set_parameters */
+    if (adev->in_call)
+        return;
+
+    if (in) {
+        adev->input_source = in->input_source;
+        adev->in_device = in->device;
+        adev->in_channel_mask = in->channel_mask;
+    } else {
+        adev->input_source = AUDIO_SOURCE_DEFAULT;
+        adev->in_device = AUDIO_DEVICE_NONE;
+        adev->in_channel_mask = 0;
+    }
+    select_devices(adev);
+}
+
+/* must be called with hw device mutex locked */
+static void in_request_prewarm(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (!adev->prewarm || !in->standby)
+        return;
+
+    adev->prewarm_input = in;
+    adev->prewarm_queued = true;
+    pthread_cond_signal(&adev->housekeeping_cond);
+}
+
+/*
+ * Called by the housekeeping thread with the hw device mutex locked, which is
+ * enough to read the routing of the stream.
+ */
+static void in_prewarm(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+    struct pcm_config config;
+
+    if (!in->standby || adev->in_call)
+        return;
+
+    if (!adev->prewarm_capture) {
+        if (in_attach_capture(in, &config) == 0)
+            adev->prewarm_capture = true;
+        else
+            ALOGW("%s: cannot start capture", __func__);
+    }
+
+    /* do not steal the route of a running input */
+    if (adev->in_device != AUDIO_DEVICE_NONE && !adev->prewarm_routed)
+        return;
+
+    adev->input_source = in->input_source;
+    adev->in_device = in->device;
+    adev->in_channel_mask = in->channel_mask;
+    select_devices(adev);
+    adev->prewarm_routed = true;
+}
+
+/* must be called with hw device mutex locked */
+static void in_release_prewarm(struct stream_in *in)
+{
+    struct audio_device *adev = in->dev;
+
+    if (adev->prewarm_input != in)
+        return;
+
+    if (adev->prewarm_capture) {
+        capture_mux_detach(&adev->capture);
+        adev->prewarm_capture = false;
+    }
+    adev->prewarm_input = NULL;
+    adev->prewarm_queued = false;
+    if (adev->prewarm_routed) {
+        adev->prewarm_routed = false;
+        select_input(adev);
+    }
+}
+
+/* must be called with hw device mutex locked */
+static bool sco_input_active(struct audio_device *adev)
+{
+    unsigned int i;
 
-    return 0;
+    for (i = 0; i < adev->num_active_inputs; i++)
+        if (adev->active_inputs[i]->device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET)
+            return true;
+    return false;
 }
 
 /* must be called with hw device and input stream mutexes locked */
 static int start_input_stream(struct stream_in *in)
 {
     struct audio_device *adev = in->dev;
+    struct pcm_config config;
+    int64_t next_ns;
+    bool sco;
+    int ret;
+
+    if (adev->num_active_inputs == CAPTURE_MUX_INPUTS) {
+        ALOGE("%s: %d captures running already", __func__, CAPTURE_MUX_INPUTS);
+        return -EBUSY;
+    }
 
-    in->pcm = pcm_open(PCM_CARD, PCM_DEVICE_IN, PCM_IN, &pcm_config_in);
+    /* joins the pcm of the running captures or of the pre-warm */
+    ret = in_attach_capture(in, &config);
+    /* the pre-warm of another stream is kept for its own first read */
+    if (adev->prewarm_input == in) {
+        if (adev->prewarm_capture) {
+            capture_mux_detach(&adev->capture);
+            adev->prewarm_capture = false;
+        }
+        adev->prewarm_input = NULL;
+        adev->prewarm_queued = false;
+        adev->prewarm_routed = false;
+    }
+    if (ret != 0)
+        return ret;
 
-    if (in->pcm && !pcm_is_ready(in->pcm)) {
-        ALOGE("pcm_open() failed: %s", pcm_get_error(in->pcm));
-        pcm_close(in->pcm);
-        return -ENOMEM;
+    ret = in_set_capture_rate(in, config.rate);
+    if (ret != 0) {
+        capture_mux_detach(&adev->capture);
+        return ret;
     }
 
+    /* the stream reads what is captured from now on */
+    capture_mux_get_position(&adev->capture, &in->mux_read, &next_ns);
+    in->mux_overruns = android_atomic_acquire_load(&adev->capture.overruns);
+    in->mux_errors = android_atomic_acquire_load(&adev->capture.errors);
+    in->mux_frames_lost = android_atomic_acquire_load(&adev->capture.frames_lost);
+    in->mux_filled = 0;
+    in->session_frames = 0;
+    in->session_resample_ns = 0;
+
     /* if no supported sample rate is available, use the resampler */
     if (in->resampler)
         in->resampler->reset(in->resampler);
 
     in->frames_in = 0;
-    /* in call routing must go through set_parameters */
-    if (!adev->in_call) {
-        adev->input_source = in->input_source;
-        adev->in_device = in->device;
-        adev->in_channel_mask = in->channel_mask;
-
-        eS325_SetActiveIoHandle(in->io_handle);
-        select_devices(adev);
-    }
+    sco = sco_input_active(adev);
+    adev->active_inputs[adev->num_active_inputs++] = in;
+    /* the running inputs own the input route from now on */
+    adev->prewarm_routed = false;
+    select_input(adev);
 
-    if (in->device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET)
+    if ((in->device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) && !sco)
         start_bt_sco(adev);
 
     /* initialize volume ramp */
@@ -657,7 +3262,6 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
                                    struct resampler_buffer* buffer)
 {
     struct stream_in *in;
-    size_t i;
 
     if (buffer_provider == NULL || buffer == NULL)
         return -EINVAL;
@@ -665,36 +3269,34 @@ static int get_next_buffer(struct resampler_buffer_provider *buffer_provider,
     in = (struct stream_in *)((char *)buffer_provider -
                                    offsetof(struct stream_in, buf_provider));
 
-    if (in->pcm == NULL) {
-        buffer->raw = NULL;
-        buffer->frame_count = 0;
-        in->read_status = -ENODEV;
-        return -ENODEV;
-    }
-
     if (in->frames_in == 0) {
-        in->read_status = pcm_read(in->pcm,
-                                   (void*)in->buffer,
-                                   pcm_frames_to_bytes(in->pcm, pcm_config_in.period_size));
+        int64_t start = 0;
+
+        if (in->resampler)
+            start = stats_now_ns();
+        in->read_status = capture_mux_read(&in->dev->capture, in, in->buffer,
+                                           in->config.period_size);
+        if (in->resampler)
+            in->ring_read_ns += stats_now_ns() - start;
         if (in->read_status != 0) {
-            ALOGE("get_next_buffer() pcm_read error %d", in->read_status);
+            ALOGE("get_next_buffer() capture read error %d", in->read_status);
+            android_atomic_inc(&in->read_errors);
             buffer->raw = NULL;
             buffer->frame_count = 0;
             return in->read_status;
         }
 
-        in->frames_in = pcm_config_in.period_size;
+        in->frames_in = in->config.period_size;
 
-        /* Do stereo to mono conversion in place by discarding right channel */
+        /* keep the mic of the input route, in place */
         if (in->channel_mask == AUDIO_CHANNEL_IN_MONO)
-            for (i = 1; i < in->frames_in; i++)
-                in->buffer[i] = in->buffer[i * 2];
+            in->to_mono(in->buffer, in->buffer, in->frames_in);
     }
 
     buffer->frame_count = (buffer->frame_count > in->frames_in) ?
                                 in->frames_in : buffer->frame_count;
     buffer->i16 = in->buffer +
-            (pcm_config_in.period_size - in->frames_in) * popcount(in->channel_mask);
+            (in->config.period_size - in->frames_in) * popcount(in->channel_mask);
 
     return in->read_status;
 
@@ -724,10 +3326,14 @@ static ssize_t read_frames(struct stream_in *in, void *buffer, ssize_t frames)
     while (frames_wr < frames) {
         size_t frames_rd = frames - frames_wr;
         if (in->resampler != NULL) {
+            int64_t start = stats_now_ns();
+
+            in->ring_read_ns = 0;
             in->resampler->resample_from_provider(in->resampler,
                     (int16_t *)((char *)buffer +
                             frames_wr * frame_size),
                     &frames_rd);
+            in->session_resample_ns += stats_now_ns() - start - in->ring_read_ns;
         } else {
             struct resampler_buffer buf = {
                     { raw : NULL, },
@@ -803,10 +3409,11 @@ static audio_devices_t output_devices(struct stream_out *out)
 
     for (type = 0; type < OUTPUT_TOTAL; ++type) {
         struct stream_out *other = dev->outputs[type];
-        if (other && (other != out) && !other->standby) {
+        if (other && (other != out) && (other->state != STREAM_STANDBY)) {
             /* safe to access other stream without a mutex,
              * because we hold the dev lock,
              * which prevents the other stream from being closed
+             * and its state from changing
              */
             devices |= other->device;
         }
@@ -818,18 +3425,13 @@ static audio_devices_t output_devices(struct stream_out *out)
 static int do_out_standby(struct stream_out *out)
 {
     struct audio_device *adev = out->dev;
-    int i;
 
-    ALOGV("%s: output standby: %d", __func__, out->standby);
+    out->standby_pending = false;
 
-    if (!out->standby) {
-        for (i = 0; i < PCM_TOTAL; i++) {
-            if (out->pcm[i]) {
-                pcm_close(out->pcm[i]);
-                out->pcm[i] = NULL;
-            }
-        }
-        out->standby = true;
+    if (out->state != STREAM_STANDBY) {
+        HAL_TRACE(adev, TRACE_OUT_STANDBY, out->device, 0);
+        playback_mixer_remove_input(out);
+        android_atomic_release_store(STREAM_STANDBY, &out->state);
 
 #if 0
         if (out == adev->outputs[OUTPUT_HDMI]) {
@@ -852,23 +3454,99 @@ static int do_out_standby(struct stream_out *out)
     return 0;
 }
 
+/*
+ * Short sounds put the stream in standby and start it again many times a
+ * minute. Keep the stream mixed and routed for standby_delay_ms so that
+ * the next write does not reopen the pcm and apply the route again.
+ */
 static int out_standby(struct audio_stream *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    int ret;
-
-    pthread_mutex_lock(&out->dev->lock);
-    pthread_mutex_lock(&out->lock);
+    struct audio_device *adev = out->dev;
+    int ret = 0;
 
-    ret = do_out_standby(out);
+    adev_lock(adev);
+    adev_lock_output(adev, out);
+
+    if (adev->standby_delay_ms == 0 || out->state == STREAM_STANDBY) {
+        ret = do_out_standby(out);
+    } else if (!out->standby_pending) {
+        out->standby_pending = true;
+        out->standby_deadline_ns = stats_now_ns() +
+                adev->standby_delay_ms * 1000000LL;
+        playback_mixer_set_idle(out, true);
+        pthread_cond_signal(&adev->housekeeping_cond);
+    }
 
     pthread_mutex_unlock(&out->lock);
-    pthread_mutex_unlock(&out->dev->lock);
+    pthread_mutex_unlock(&adev->lock);
     return ret;
 }
 
+static void *housekeeping_thread(void *context)
+{
+    struct audio_device *adev = (struct audio_device *)context;
+    struct stream_out *out;
+    enum output_type type;
+    int64_t now;
+    int64_t next;
+
+    adev_lock(adev);
+    while (!adev->housekeeping_exit) {
+        now = stats_now_ns();
+        next = 0;
+        for (type = 0; type < OUTPUT_TOTAL; type++) {
+            out = adev->outputs[type];
+            if (!out)
+                continue;
+            adev_lock_output(adev, out);
+            if (out->standby_pending) {
+                if (out->standby_deadline_ns <= now) {
+                    HAL_TRACE(adev, TRACE_OUT_DELAYED_STANDBY, type, 0);
+                    do_out_standby(out);
+                } else if (next == 0 || out->standby_deadline_ns < next) {
+                    next = out->standby_deadline_ns;
+                }
+            }
+            pthread_mutex_unlock(&out->lock);
+        }
+
+        if (adev->prewarm_queued) {
+            adev->prewarm_queued = false;
+            in_prewarm(adev->prewarm_input);
+        }
+
+        if (next == 0)
+            pthread_cond_wait(&adev->housekeeping_cond, &adev->lock);
+        else
+            pthread_cond_timeout_np(&adev->housekeeping_cond, &adev->lock,
+                                    (unsigned)((next - now) / 1000000) + 1);
+    }
+    pthread_mutex_unlock(&adev->lock);
+
+    return NULL;
+}
+
 static int out_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_out *out = (struct stream_out *)stream;
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer),
+             "  Output stream %p (type %d):\n"
+             "    state: %s\n"
+             "    device: %#x\n"
+             "    underruns: %d\n"
+             "    standby avoided: %d\n",
+             out, out->type,
+             (android_atomic_acquire_load(&out->state) == STREAM_RUNNING) ?
+                    "running" : "standby",
+             out->device,
+             android_atomic_acquire_load(&out->underruns),
+             android_atomic_acquire_load(&out->standby_avoided));
+    write(fd, buffer, strlen(buffer));
+    stats_histogram_dump(&out->write_time, fd, "write time");
+
     return 0;
 }
 
@@ -876,22 +3554,22 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
-    struct str_parms *parms;
-    char value[32];
+    struct kvpairs parms;
     int ret;
+    int value;
     unsigned int val;
 
     ALOGV("%s: key value pairs: %s", __func__, kvpairs);
 
-    parms = str_parms_create_str(kvpairs);
+    kvpairs_parse(&parms, kvpairs, set_keys, SET_KEY_CNT);
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
-                            value, sizeof(value));
+    ret = kvpairs_get_int(&parms, SET_KEY_ROUTING, &value);
     if (ret >= 0) {
-        val = atoi(value);
-        pthread_mutex_lock(&adev->lock);
-        pthread_mutex_lock(&out->lock);
+        val = value;
+        adev_lock(adev);
+        adev_lock_output(adev, out);
         if (((adev->out_device) != val) && (val != 0)) {
+            HAL_TRACE(adev, TRACE_OUT_ROUTING, adev->out_device, val);
             /* force output standby to stop SCO pcm stream if needed */
             if ((val & AUDIO_DEVICE_OUT_ALL_SCO) ^
                     (out->device & AUDIO_DEVICE_OUT_ALL_SCO)) {
@@ -910,96 +3588,201 @@ static int out_set_parameters(struct audio_stream *stream, const char *kvpairs)
         pthread_mutex_unlock(&adev->lock);
     }
 
-    str_parms_destroy(parms);
     return ret;
 }
 
+/* add the playback mixer pcm counters requested in query to reply */
+static void playback_mixer_get_parameters(struct playback_mixer *mixer,
+                                          const struct kvpairs *query,
+                                          struct kvpairs_reply *reply)
+{
+    if (kvpairs_has(query, GET_KEY_HW_XRUNS))
+        kvpairs_reply_add_int(reply, AUDIO_PARAMETER_KEY_HW_XRUNS,
+                              android_atomic_acquire_load(&mixer->xruns));
+    if (kvpairs_has(query, GET_KEY_HW_ERRORS))
+        kvpairs_reply_add_int(reply, AUDIO_PARAMETER_KEY_HW_ERRORS,
+                              android_atomic_acquire_load(&mixer->errors));
+    if (kvpairs_has(query, GET_KEY_HW_REOPENS))
+        kvpairs_reply_add_int(reply, AUDIO_PARAMETER_KEY_HW_REOPENS,
+                              android_atomic_acquire_load(&mixer->reopens));
+}
+
 static char * out_get_parameters(const struct audio_stream *stream, const char *keys)
 {
     struct stream_out *out = (struct stream_out *)stream;
-    struct str_parms *query = str_parms_create_str(keys);
-    char *str;
+    struct kvpairs query;
+    struct kvpairs_reply reply;
     char value[256];
-    struct str_parms *reply = str_parms_create();
+    size_t len = 0;
     size_t i, j;
-    int ret;
-    bool first = true;
 
-    ret = str_parms_get_str(query, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value, sizeof(value));
-    if (ret >= 0) {
+    kvpairs_parse(&query, keys, get_keys, GET_KEY_CNT);
+    kvpairs_reply_init(&reply);
+
+    if (kvpairs_has(&query, GET_KEY_SUP_CHANNELS)) {
         value[0] = '\0';
         i = 0;
         /* the last entry in supported_channel_masks[] is always 0 */
         while (out->supported_channel_masks[i] != 0) {
             for (j = 0; j < ARRAY_SIZE(out_channels_name_to_enum_table); j++) {
                 if (out_channels_name_to_enum_table[j].value == out->supported_channel_masks[i]) {
-                    if (!first) {
-                        strcat(value, "|");
-                    }
-                    strcat(value, out_channels_name_to_enum_table[j].name);
-                    first = false;
+                    len += snprintf(value + len, sizeof(value) - len, "%s%s",
+                                    len ? "|" : "",
+                                    out_channels_name_to_enum_table[j].name);
+                    if (len >= sizeof(value))
+                        len = sizeof(value) - 1;
                     break;
                 }
             }
             i++;
         }
-        str_parms_add_str(reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value);
-        str = strdup(str_parms_to_str(reply));
-    } else {
-        str = strdup(keys);
+        kvpairs_reply_add_str(&reply, AUDIO_PARAMETER_STREAM_SUP_CHANNELS, value);
     }
-    str_parms_destroy(query);
-    str_parms_destroy(reply);
-    return str;
+
+    if (kvpairs_has(&query, GET_KEY_UNDERRUNS))
+        kvpairs_reply_add_int(&reply, AUDIO_PARAMETER_KEY_UNDERRUNS,
+                              android_atomic_acquire_load(&out->underruns));
+
+    if (kvpairs_has(&query, GET_KEY_STANDBY_AVOIDED))
+        kvpairs_reply_add_int(&reply, AUDIO_PARAMETER_KEY_STANDBY_AVOIDED,
+                              android_atomic_acquire_load(&out->standby_avoided));
+
+    playback_mixer_get_parameters(&out->dev->mixer, &query, &reply);
+
+    if (kvpairs_reply_empty(&reply))
+        return strdup(keys);
+    return kvpairs_reply_to_str(&reply);
 }
 
 static uint32_t out_get_latency(const struct audio_stream_out *stream)
 {
     struct stream_out *out = (struct stream_out *)stream;
+    struct pcm_config *hw_config;
+
+    /* worst case: the mixer pcm runs the config of the lowest latency
+     * stream that is active */
+    switch (out->type) {
+    case OUTPUT_ULTRA_LOW_LATENCY:
+        hw_config = android_atomic_acquire_load(&out->dev->mixer.rt_refused) ?
+                &pcm_config_mmap_fallback : &pcm_config_mmap;
+        break;
+    case OUTPUT_LOW_LATENCY:
+        hw_config = &pcm_config_fast;
+        break;
+    default:
+        hw_config = &pcm_config_deep;
+        break;
+    }
 
-    return (out->config.period_size * out->config.period_count * 1000) /
-            out->config.rate;
+    /* the mixer thread holds the period it mixed until the pcm takes it */
+    return ((out->fifo_frames +
+             hw_config->period_size * (hw_config->period_count + 1))
+            * 1000) / out->config.rate;
 }
 
 static int out_set_volume(struct audio_stream_out *stream, float left,
                           float right)
 {
-    return -ENOSYS;
+    struct stream_out *out = (struct stream_out *)stream;
+
+    /* applied by the playback mixer on its next period */
+    android_atomic_release_store(pack_gain(gain_q15_from_float(left),
+                                           gain_q15_from_float(right)),
+                                 &out->volume);
+    return 0;
+}
+
+/*
+ * Leave standby or pick up a routing change. Sets *rerouted when a route was
+ * queued for this stream's devices. Must be called with hw device and output
+ * stream mutexes locked.
+ */
+static int out_prepare_write(struct stream_out *out, bool *rerouted)
+{
+    struct audio_device *adev = out->dev;
+    int ret;
+
+    *rerouted = false;
+    if (out->state == STREAM_STANDBY) {
+        ret = start_output_stream(out);
+        if (ret != 0)
+            return ret;
+        android_atomic_release_store(STREAM_RUNNING, &out->state);
+        *rerouted = true;
+    } else if (!adev->in_call &&
+               ((adev->out_device & out->device) != out->device)) {
+        /* another stream or a call rewrote the active devices */
+        adev->out_device |= out->device;
+        select_devices(adev);
+        *rerouted = true;
+    }
+
+    out->route_gen = android_atomic_acquire_load(&adev->route_gen);
+    return 0;
 }
 
 static ssize_t out_write(struct audio_stream_out *stream, const void* buffer,
                          size_t bytes)
 {
-    int ret;
+    int ret = 0;
     struct stream_out *out = (struct stream_out *)stream;
     struct audio_device *adev = out->dev;
-    int i;
+    size_t frames = bytes / audio_stream_frame_size(&stream->common);
+    int64_t start = stats_now_ns();
+    int64_t duration;
+    bool first = false;
+    bool warm = false;
+    bool rerouted;
+    int32_t route_gen;
 
     /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the output stream mutex - e.g.
-     * executing out_set_parameters() while holding the hw device
-     * mutex
+     * Once the stream is running and no route was queued since it was
+     * last routed, only the stream mutex is needed. The hw device mutex is
+     * taken for the standby exit and to pick up routing changes, so a slow
+     * RIL call on another thread does not stall steady-state writes. Only a
+     * route queued for this stream is waited for, a route change of another
+     * stream does not hold up this write.
      */
-    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&out->lock);
-    if (out->standby) {
-        ret = start_output_stream(out);
+    if (out->standby_pending) {
+        /* still mixed and routed, nothing to restart */
+        out->standby_pending = false;
+        playback_mixer_set_idle(out, false);
+        android_atomic_inc(&out->standby_avoided);
+    }
+    if ((android_atomic_acquire_load(&out->state) != STREAM_RUNNING) ||
+            (out->route_gen != android_atomic_acquire_load(&adev->route_gen))) {
+        /* respect the hw device -> stream mutex acquisition order */
+        pthread_mutex_unlock(&out->lock);
+        adev_lock(adev);
+        pthread_mutex_lock(&out->lock);
+        first = (out->state == STREAM_STANDBY);
+        route_gen = android_atomic_acquire_load(&adev->route_gen);
+        ret = out_prepare_write(out, &rerouted);
+        /* warm: the stream was already routed, see PREWARM_PROPERTY */
+        warm = (route_gen == android_atomic_acquire_load(&adev->route_gen));
+        pthread_mutex_unlock(&adev->lock);
         if (ret != 0) {
-            pthread_mutex_unlock(&adev->lock);
+            playback_mixer_drop_frames(out, frames);
             goto exit;
         }
-        out->standby = false;
+        /* do not play the first buffer on the previous route, without
+         * holding up standby and routing calls on the stream meanwhile */
+        if (rerouted) {
+            pthread_mutex_unlock(&out->lock);
+            route_wait(adev);
+            pthread_mutex_lock(&out->lock);
+            if (android_atomic_acquire_load(&out->state) != STREAM_RUNNING) {
+                playback_mixer_drop_frames(out, frames);
+                goto exit;
+            }
+        }
     }
-    pthread_mutex_unlock(&adev->lock);
-
-    /* Write to all active PCMs */
-    for (i = 0; i < PCM_TOTAL; i++)
-        if (out->pcm[i])
-           pcm_write(out->pcm[i], (void *)buffer, bytes);
 
+    ret = playback_mixer_write(out, buffer, frames);
 
 exit:
+    out->frames_written += frames;
     pthread_mutex_unlock(&out->lock);
 
     if (ret != 0) {
@@ -1007,13 +3790,44 @@ exit:
                out_get_sample_rate(&stream->common));
     }
 
+    duration = stats_now_ns() - start;
+    stats_histogram_add(&out->write_time, duration);
+    if (first)
+        stats_histogram_add(&adev->first_write[warm], duration);
     return bytes;
 }
 
+static int out_get_presentation_position(const struct audio_stream_out *stream,
+                                         uint64_t *frames,
+                                         struct timespec *timestamp)
+{
+    struct stream_out *out = (struct stream_out *)stream;
+    struct playback_mixer *mixer = &out->dev->mixer;
+    int ret = -ENODATA;
+
+    pthread_mutex_lock(&mixer->lock);
+    if (out->presented_ts.tv_sec != 0 || out->presented_ts.tv_nsec != 0) {
+        *frames = out->frames_presented;
+        *timestamp = out->presented_ts;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&mixer->lock);
+
+    return ret;
+}
+
 static int out_get_render_position(const struct audio_stream_out *stream,
                                    uint32_t *dsp_frames)
 {
-    return -EINVAL;
+    uint64_t frames;
+    struct timespec timestamp;
+    int ret;
+
+    ret = out_get_presentation_position(stream, &frames, &timestamp);
+    if (ret == 0)
+        *dsp_frames = (uint32_t)frames;
+
+    return ret;
 }
 
 static int out_add_audio_effect(const struct audio_stream *stream, effect_handle_t effect)
@@ -1074,22 +3888,47 @@ static int in_set_format(struct audio_stream *stream, audio_format_t format)
 static int do_in_standby(struct stream_in *in)
 {
     struct audio_device *adev = in->dev;
+    unsigned int i;
 
     if (!in->standby) {
-        pcm_close(in->pcm);
-        in->pcm = NULL;
+        capture_mux_detach(&adev->capture);
+        if (in->session_frames > 0) {
+            ALOGI("%s: captured %lld frames at %u Hz, %lld us resampling%s",
+                  __func__, (long long)in->session_frames, in->requested_rate,
+                  (long long)(in->session_resample_ns / 1000),
+                  in->resampler ? "" : " (native rate)");
+            in->last_session_frames = in->session_frames;
+            in->last_session_resample_ns = in->session_resample_ns;
+            if (in->resampler) {
+                in->resampled_frames += in->session_frames;
+                in->resample_ns += in->session_resample_ns;
+            } else {
+                in->native_frames += in->session_frames;
+            }
+        }
+        in_stop_echo_ref(in);
+        in->aec_reverse = false;
+        capture_fx_reset(&in->fx);
+
+        for (i = 0; i < adev->num_active_inputs; i++) {
+            if (adev->active_inputs[i] == in) {
+                memmove(&adev->active_inputs[i], &adev->active_inputs[i + 1],
+                        (adev->num_active_inputs - i - 1) *
+                        sizeof(adev->active_inputs[0]));
+                adev->num_active_inputs--;
+                break;
+            }
+        }
 
-        if (in->device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET)
+        /* the SCO pcms stay up for the other SCO captures */
+        if ((in->device & AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET) &&
+                !sco_input_active(adev))
             end_bt_sco(adev);
 
-        in->dev->input_source = AUDIO_SOURCE_DEFAULT;
-        in->dev->in_device = AUDIO_DEVICE_NONE;
-        in->dev->in_channel_mask = 0;
-        select_devices(adev);
+        select_input(adev);
         in->standby = true;
     }
 
-    eS325_SetActiveIoHandle(ES325_IO_HANDLE_NONE);
     return 0;
 }
 
@@ -1098,7 +3937,7 @@ static int in_standby(struct audio_stream *stream)
     struct stream_in *in = (struct stream_in *)stream;
     int ret;
 
-    pthread_mutex_lock(&in->dev->lock);
+    adev_lock(in->dev);
     pthread_mutex_lock(&in->lock);
 
     ret = do_in_standby(in);
@@ -1109,8 +3948,106 @@ static int in_standby(struct audio_stream *stream)
     return ret;
 }
 
+/*
+ * Publish the capture position after a read. When the capture is running
+ * the time is the one of the next frame in_read() returns. After a failed
+ * read the frames returned were counted lost, and the time moves on by
+ * their duration. Must be called with input stream mutex locked.
+ */
+static void in_update_position(struct stream_in *in, bool running,
+                               size_t frames)
+{
+    int64_t ns = in->capture_ns;
+
+    if (running)
+        ns = in_get_capture_time(in);
+    else if (ns != 0)
+        ns += (int64_t)frames * 1000000000LL / in->requested_rate;
+
+    android_atomic_inc(&in->position_seq);
+    android_memory_barrier();
+    in->frames_captured = in->frames_read + in->frames_lost_count;
+    in->frames_lost_total = in->frames_lost_count;
+    in->capture_ns = ns;
+    android_atomic_inc(&in->position_seq);
+}
+
+/*
+ * Frames captured for the stream since it was opened, lost ones included,
+ * and the CLOCK_MONOTONIC time the next one was captured, for the alignment
+ * of an AEC with the playback position. Lock free, -ENODATA until a read
+ * succeeded.
+ */
+static int in_get_capture_position(struct stream_in *in, int64_t *frames,
+                                   int64_t *time_ns, int64_t *lost)
+{
+    int32_t seq;
+
+    do {
+        seq = android_atomic_acquire_load(&in->position_seq);
+        *frames = in->frames_captured;
+        *time_ns = in->capture_ns;
+        *lost = in->frames_lost_total;
+        android_memory_barrier();
+    } while ((seq & 1) || seq != in->position_seq);
+
+    return (*time_ns == 0) ? -ENODATA : 0;
+}
+
 static int in_dump(const struct audio_stream *stream, int fd)
 {
+    struct stream_in *in = (struct stream_in *)stream;
+    char buffer[256];
+    int64_t frames = in->last_session_frames;
+    int64_t resample_ns = in->last_session_resample_ns;
+    int64_t captured;
+    int64_t capture_ns;
+    int64_t lost;
+
+    snprintf(buffer, sizeof(buffer),
+             "  Input stream %p (source %d):\n"
+             "    overruns: %d\n"
+             "    read errors: %d\n"
+             "    echo delay: %d us\n"
+             "    capture: %u Hz, pcm %u Hz\n",
+             in, in->input_source,
+             android_atomic_acquire_load(&in->overruns),
+             android_atomic_acquire_load(&in->read_errors),
+             android_atomic_acquire_load(&in->echo_delay_us),
+             in->requested_rate, in->config.rate);
+    write(fd, buffer, strlen(buffer));
+    /* native rate sessions save the resampler cost reported otherwise */
+    if (!in->resampler)
+        snprintf(buffer, sizeof(buffer), "    resampler: none\n");
+    else if (frames > 0)
+        snprintf(buffer, sizeof(buffer),
+                 "    resampler: %lld us per second captured (last session)\n",
+                 (long long)(resample_ns / 1000 * in->requested_rate / frames));
+    else
+        snprintf(buffer, sizeof(buffer), "    resampler: no session yet\n");
+    write(fd, buffer, strlen(buffer));
+    snprintf(buffer, sizeof(buffer),
+             "    captured: %lld ms native, %lld ms resampled in %lld us\n",
+             (long long)(in->native_frames * 1000 / in->requested_rate),
+             (long long)(in->resampled_frames * 1000 / in->requested_rate),
+             (long long)(in->resample_ns / 1000));
+    write(fd, buffer, strlen(buffer));
+    if (in_get_capture_position(in, &captured, &capture_ns, &lost) == 0) {
+        snprintf(buffer, sizeof(buffer),
+                 "    position: %lld frames at %lld.%06lld ms, %lld lost\n",
+                 (long long)captured, (long long)(capture_ns / 1000000),
+                 (long long)(capture_ns % 1000000), (long long)lost);
+        write(fd, buffer, strlen(buffer));
+    }
+    snprintf(buffer, sizeof(buffer),
+             "    preprocessing: hpf %s, gain %d dB, gate %s (opened %u times)%s\n",
+             (in->fx.enabled & CAPTURE_FX_HPF) ? "on" : "off", in->fx.gain_db,
+             (in->fx.enabled & CAPTURE_FX_GATE) ? "on" : "off",
+             in->fx.gate_opened,
+             (in->fx_allowed & CAPTURE_FX_HPF) ? "" : ", gain only on eS325 route");
+    write(fd, buffer, strlen(buffer));
+    stats_histogram_dump(&in->read_time, fd, "read time");
+
     return 0;
 }
 
@@ -1118,32 +4055,32 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
 {
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
-    struct str_parms *parms;
-    char value[32];
+    struct kvpairs parms;
     int ret;
+    int value;
     unsigned int val;
     bool apply_now = false;
+    bool rerouted = false;
 
-    parms = str_parms_create_str(kvpairs);
+    kvpairs_parse(&parms, kvpairs, set_keys, SET_KEY_CNT);
 
-    pthread_mutex_lock(&adev->lock);
+    adev_lock(adev);
     pthread_mutex_lock(&in->lock);
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_INPUT_SOURCE,
-                            value, sizeof(value));
+    ret = kvpairs_get_int(&parms, SET_KEY_INPUT_SOURCE, &value);
     if (ret >= 0) {
-        val = atoi(value);
+        val = value;
         /* no audio source uses val == 0 */
         if ((in->input_source != val) && (val != 0)) {
             in->input_source = val;
             apply_now = !in->standby;
+            rerouted = true;
         }
     }
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_STREAM_ROUTING,
-                            value, sizeof(value));
+    ret = kvpairs_get_int(&parms, SET_KEY_ROUTING, &value);
     if (ret >= 0) {
         /* strip AUDIO_DEVICE_BIT_IN to allow bitwise comparisons */
-        val = atoi(value) & ~AUDIO_DEVICE_BIT_IN;
+        val = value & ~AUDIO_DEVICE_BIT_IN;
         /* no audio device uses val == 0 */
         if ((in->device != val) && (val != 0)) {
             /* force output standby to start or stop SCO pcm stream if needed */
@@ -1153,26 +4090,90 @@ static int in_set_parameters(struct audio_stream *stream, const char *kvpairs)
             }
             in->device = val;
             apply_now = !in->standby;
+            rerouted = true;
         }
     }
 
     if (apply_now) {
-        adev->input_source = in->input_source;
-        adev->in_device = in->device;
-        select_devices(adev);
+        select_input(adev);
+    } else if (rerouted) {
+        in_request_prewarm(in);
+    }
+
+    if (kvpairs_has(&parms, SET_KEY_ECHO_DELAY_MEASURE)) {
+        if (kvpairs_value_is(&parms, SET_KEY_ECHO_DELAY_MEASURE,
+                             AUDIO_PARAMETER_VALUE_ON)) {
+            if (!in->echo_delay) {
+                in->echo_delay = malloc(sizeof(struct echo_delay));
+                if (in->echo_delay)
+                    echo_delay_init(in->echo_delay);
+            }
+        } else {
+            free(in->echo_delay);
+            in->echo_delay = NULL;
+            android_atomic_release_store(-1, &in->echo_delay_us);
+        }
+        if (!in->standby)
+            in_update_route(in);
     }
 
+    if (kvpairs_has(&parms, SET_KEY_CAPTURE_HPF))
+        capture_fx_enable(&in->fx, CAPTURE_FX_HPF,
+                          kvpairs_value_is(&parms, SET_KEY_CAPTURE_HPF,
+                                           AUDIO_PARAMETER_VALUE_ON));
+    if (kvpairs_has(&parms, SET_KEY_CAPTURE_GATE))
+        capture_fx_enable(&in->fx, CAPTURE_FX_GATE,
+                          kvpairs_value_is(&parms, SET_KEY_CAPTURE_GATE,
+                                           AUDIO_PARAMETER_VALUE_ON));
+    if (kvpairs_get_int(&parms, SET_KEY_CAPTURE_GAIN, &value) >= 0)
+        capture_fx_set_gain_db(&in->fx, value);
+
     pthread_mutex_unlock(&in->lock);
     pthread_mutex_unlock(&adev->lock);
 
-    str_parms_destroy(parms);
     return ret;
 }
 
 static char * in_get_parameters(const struct audio_stream *stream,
                                 const char *keys)
 {
-    return strdup("");
+    struct stream_in *in = (struct stream_in *)stream;
+    struct kvpairs query;
+    struct kvpairs_reply reply;
+    char value[48];
+    int64_t frames;
+    int64_t time_ns;
+    int64_t lost;
+    int ret;
+
+    kvpairs_parse(&query, keys, get_keys, GET_KEY_CNT);
+    kvpairs_reply_init(&reply);
+
+    if (kvpairs_has(&query, GET_KEY_FRAMES_LOST) ||
+            kvpairs_has(&query, GET_KEY_CAPTURE_POSITION)) {
+        ret = in_get_capture_position(in, &frames, &time_ns, &lost);
+        if (kvpairs_has(&query, GET_KEY_FRAMES_LOST)) {
+            snprintf(value, sizeof(value), "%lld", (long long)lost);
+            kvpairs_reply_add_str(&reply, AUDIO_PARAMETER_KEY_FRAMES_LOST, value);
+        }
+        if (ret == 0 && kvpairs_has(&query, GET_KEY_CAPTURE_POSITION)) {
+            snprintf(value, sizeof(value), "%lld,%lld",
+                     (long long)frames, (long long)time_ns);
+            kvpairs_reply_add_str(&reply, AUDIO_PARAMETER_KEY_CAPTURE_POSITION,
+                                  value);
+        }
+    }
+    if (kvpairs_has(&query, GET_KEY_OVERRUNS))
+        kvpairs_reply_add_int(&reply, AUDIO_PARAMETER_KEY_OVERRUNS,
+                              android_atomic_acquire_load(&in->overruns));
+    if (kvpairs_has(&query, GET_KEY_READ_ERRORS))
+        kvpairs_reply_add_int(&reply, AUDIO_PARAMETER_KEY_READ_ERRORS,
+                              android_atomic_acquire_load(&in->read_errors));
+    if (kvpairs_has(&query, GET_KEY_ECHO_DELAY))
+        kvpairs_reply_add_int(&reply, AUDIO_PARAMETER_KEY_ECHO_DELAY,
+                              android_atomic_acquire_load(&in->echo_delay_us));
+
+    return kvpairs_reply_to_str(&reply);
 }
 
 static int in_set_gain(struct audio_stream_in *stream, float gain)
@@ -1212,32 +4213,79 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
     struct stream_in *in = (struct stream_in *)stream;
     struct audio_device *adev = in->dev;
     size_t frames_rq = bytes / audio_stream_frame_size(&stream->common);
+    int64_t capture_ns = 0;
+    int64_t start = stats_now_ns();
+    int64_t duration;
+    int64_t mux_read;
+    int64_t filled;
+    size_t frames_in;
+    bool started = false;
+    bool warm = false;
+    int32_t route_gen;
 
     /*
-     * acquiring hw device mutex systematically is useful if a low
-     * priority thread is waiting on the input stream mutex - e.g.
-     * executing in_set_parameters() while holding the hw device
-     * mutex
+     * The hw device mutex is only taken to leave standby, a running stream
+     * follows the eS325 preset of the routing snapshot.
      */
-    pthread_mutex_lock(&adev->lock);
     pthread_mutex_lock(&in->lock);
     if (in->standby) {
-        ret = start_input_stream(in);
-        if (ret == 0)
-            in->standby = 0;
+        /* respect the hw device -> stream mutex acquisition order */
+        pthread_mutex_unlock(&in->lock);
+        adev_lock(adev);
+        pthread_mutex_lock(&in->lock);
+        if (in->standby) {
+            /* warm: pcm and route were ready, see PREWARM_PROPERTY */
+            warm = adev->prewarm_capture || adev->num_active_inputs > 0;
+            route_gen = android_atomic_acquire_load(&adev->route_gen);
+            ret = start_input_stream(in);
+            if (ret == 0) {
+                in->standby = 0;
+                started = true;
+                warm = warm && (route_gen ==
+                        android_atomic_acquire_load(&adev->route_gen));
+                in_update_route(in);
+            }
+        }
+        pthread_mutex_unlock(&adev->lock);
+    } else if (in->route_gen != android_atomic_acquire_load(&adev->route_gen)) {
+        in_update_route(in);
     }
-    pthread_mutex_unlock(&adev->lock);
 
     if (ret < 0)
         goto exit;
 
-    /*if (in->num_preprocessors != 0)
-        ret = process_frames(in, buffer, frames_rq);
-      else */
+    /* the first period must be captured from the new route */
+    if (started)
+        route_wait(adev);
+
+    if (in->echo_ref)
+        capture_ns = in_get_capture_time(in);
+
+    mux_read = in->mux_read;
+    frames_in = in->frames_in;
     ret = read_frames(in, buffer, frames_rq);
 
-    if (ret > 0)
+    /* the ring frames the failed read stands for, less the ones it used */
+    if (ret < 0) {
+        filled = (int64_t)frames_rq * adev->capture.config.rate /
+                in->requested_rate - (in->mux_read - mux_read) -
+                ((int64_t)frames_in - (int64_t)in->frames_in);
+        if (filled > 0)
+            in->mux_filled += filled;
+    }
+
+    if (ret > 0) {
+        in->session_frames += frames_rq;
+        in->frames_read += frames_rq;
         ret = 0;
+    }
+
+    /* the reference is aligned on the signal as captured */
+    if (ret == 0 && in->echo_ref)
+        in_process_echo_ref(in, buffer, frames_rq, capture_ns);
+
+    if (ret == 0)
+        capture_fx_process(&in->fx, buffer, frames_rq, in->fx_allowed);
 
     if (in->ramp_frames > 0)
         in_apply_ramp(in, buffer, frames_rq);
@@ -1250,17 +4298,32 @@ static ssize_t in_read(struct audio_stream_in *stream, void* buffer,
         memset(buffer, 0, bytes);
 
 exit:
-    if (ret < 0)
+    if (ret < 0) {
         usleep(bytes * 1000000 / audio_stream_frame_size(&stream->common) /
                in_get_sample_rate(&stream->common));
+        in_add_frames_lost(in, frames_rq);
+    }
+    in_update_position(in, ret == 0, frames_rq);
 
     pthread_mutex_unlock(&in->lock);
+    duration = stats_now_ns() - start;
+    stats_histogram_add(&in->read_time, duration);
+    if (started)
+        stats_histogram_add(&adev->first_read[warm], duration);
     return bytes;
 }
 
 static uint32_t in_get_input_frames_lost(struct audio_stream_in *stream)
 {
-    return 0;
+    struct stream_in *in = (struct stream_in *)stream;
+    uint32_t frames;
+
+    pthread_mutex_lock(&in->lock);
+    frames = in->frames_lost;
+    in->frames_lost = 0;
+    pthread_mutex_unlock(&in->lock);
+
+    return frames;
 }
 
 static int in_add_audio_effect(const struct audio_stream *stream,
@@ -1270,13 +4333,18 @@ static int in_add_audio_effect(const struct audio_stream *stream,
     effect_descriptor_t descr;
     if ((*effect)->get_descriptor(effect, &descr) == 0) {
 
-        pthread_mutex_lock(&in->dev->lock);
         pthread_mutex_lock(&in->lock);
 
         eS325_AddEffect(&descr, in->io_handle);
 
+        if (memcmp(&descr.type, FX_IID_AEC, sizeof(effect_uuid_t)) == 0) {
+            in->aec = effect;
+            in->aec_reverse = false;
+            if (!in->standby)
+                in_update_route(in);
+        }
+
         pthread_mutex_unlock(&in->lock);
-        pthread_mutex_unlock(&in->dev->lock);
     }
 
     return 0;
@@ -1289,13 +4357,18 @@ static int in_remove_audio_effect(const struct audio_stream *stream,
     effect_descriptor_t descr;
     if ((*effect)->get_descriptor(effect, &descr) == 0) {
 
-        pthread_mutex_lock(&in->dev->lock);
         pthread_mutex_lock(&in->lock);
 
         eS325_RemoveEffect(&descr, in->io_handle);
 
+        if (in->aec == effect) {
+            in->aec = NULL;
+            in->aec_reverse = false;
+            if (!in->standby)
+                in_update_route(in);
+        }
+
         pthread_mutex_unlock(&in->lock);
-        pthread_mutex_unlock(&in->dev->lock);
     }
 
     return 0;
@@ -1325,13 +4398,16 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
 
     if (flags & AUDIO_OUTPUT_FLAG_DEEP_BUFFER) {
         out->config = pcm_config_deep;
-        out->pcm_device = PCM_DEVICE;
         type = OUTPUT_DEEP_BUF;
+    } else if ((flags & AUDIO_OUTPUT_FLAG_FAST) && adev->mmap_output &&
+               !android_atomic_acquire_load(&adev->mixer.rt_refused)) {
+        out->config = pcm_config_mmap;
+        type = OUTPUT_ULTRA_LOW_LATENCY;
     } else {
         out->config = pcm_config_fast;
-        out->pcm_device = PCM_DEVICE;
         type = OUTPUT_LOW_LATENCY;
     }
+    out->type = type;
 
     out->stream.common.get_sample_rate = out_get_sample_rate;
     out->stream.common.set_sample_rate = out_set_sample_rate;
@@ -1350,6 +4426,7 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     out->stream.write = out_write;
     out->stream.get_render_position = out_get_render_position;
     out->stream.get_next_write_timestamp = out_get_next_write_timestamp;
+    out->stream.get_presentation_position = out_get_presentation_position;
 
     out->dev = adev;
 
@@ -1357,15 +4434,37 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     config->channel_mask = out_get_channels(&out->stream.common);
     config->sample_rate = out_get_sample_rate(&out->stream.common);
 
-    out->standby = true;
+    out->state = STREAM_STANDBY;
+    out->volume = pack_gain(GAIN_Q15_UNITY, GAIN_Q15_UNITY);
+    out->gain[0] = GAIN_Q15_UNITY;
+    out->gain[1] = GAIN_Q15_UNITY;
 
-    pthread_mutex_lock(&adev->lock);
+    pthread_cond_init(&out->space_cond, NULL);
+    out->fifo_frames = out->config.period_size * out->config.period_count;
+    out->fifo_buffer = malloc(out->fifo_frames *
+                              audio_stream_frame_size(&out->stream.common));
+    if (!out->fifo_buffer) {
+        ret = -ENOMEM;
+        goto err_open;
+    }
+    audio_utils_fifo_init(&out->fifo, out->fifo_frames,
+                          audio_stream_frame_size(&out->stream.common),
+                          out->fifo_buffer);
+
+    adev_lock(adev);
     if (adev->outputs[type]) {
         pthread_mutex_unlock(&adev->lock);
         ret = -EBUSY;
         goto err_open;
     }
+    pthread_mutex_lock(&adev->streams_lock);
     adev->outputs[type] = out;
+    pthread_mutex_unlock(&adev->streams_lock);
+    /* route ahead of the first write, see PREWARM_PROPERTY */
+    if (adev->prewarm && !adev->in_call) {
+        adev->out_device |= out->device;
+        select_devices(adev);
+    }
     pthread_mutex_unlock(&adev->lock);
 
     *stream_out = &out->stream;
@@ -1373,6 +4472,8 @@ static int adev_open_output_stream(struct audio_hw_device *dev,
     return 0;
 
 err_open:
+    pthread_cond_destroy(&out->space_cond);
+    free(out->fifo_buffer);
     free(out);
     *stream_out = NULL;
     return ret;
@@ -1381,31 +4482,36 @@ err_open:
 static void adev_close_output_stream(struct audio_hw_device *dev,
                                      struct audio_stream_out *stream)
 {
-    struct audio_device *adev;
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct stream_out *out = (struct stream_out *)stream;
     enum output_type type;
 
-    out_standby(&stream->common);
-    adev = (struct audio_device *)dev;
-    pthread_mutex_lock(&adev->lock);
+    /* no delayed standby, the stream is going away */
+    adev_lock(adev);
+    adev_lock_output(adev, out);
+    do_out_standby(out);
+    pthread_mutex_unlock(&out->lock);
+    pthread_mutex_lock(&adev->streams_lock);
     for (type = 0; type < OUTPUT_TOTAL; type++) {
         if (adev->outputs[type] == (struct stream_out *) stream) {
             adev->outputs[type] = NULL;
             break;
         }
     }
+    pthread_mutex_unlock(&adev->streams_lock);
     pthread_mutex_unlock(&adev->lock);
+    pthread_cond_destroy(&out->space_cond);
+    free(out->fifo_buffer);
     free(stream);
 }
 
 static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
 {
     struct audio_device *adev = (struct audio_device *)dev;
-    struct str_parms *parms;
-    char *str;
-    char value[32];
+    struct kvpairs parms;
     int ret;
 
-    parms = str_parms_create_str(kvpairs);
+    kvpairs_parse(&parms, kvpairs, set_keys, SET_KEY_CNT);
 #if 0
     ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_TTY_MODE, value, sizeof(value));
     if (ret >= 0) {
@@ -1422,7 +4528,7 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         else
             return -EINVAL;
 
-        pthread_mutex_lock(&adev->lock);
+        adev_lock(adev);
         if (tty_mode != adev->tty_mode) {
             adev->tty_mode = tty_mode;
             if (adev->mode == AUDIO_MODE_IN_CALL)
@@ -1432,17 +4538,18 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
     }
 #endif
 
-    ret = str_parms_get_str(parms, AUDIO_PARAMETER_KEY_BT_NREC, value, sizeof(value));
+    ret = kvpairs_has(&parms, SET_KEY_BT_NREC) ? 0 : -ENOENT;
     if (ret >= 0) {
-        if (strcmp(value, AUDIO_PARAMETER_VALUE_ON) == 0)
+        if (kvpairs_value_is(&parms, SET_KEY_BT_NREC, AUDIO_PARAMETER_VALUE_ON))
             adev->bluetooth_nrec = true;
         else
             adev->bluetooth_nrec = false;
     }
 
-    ret = str_parms_get_str(parms, "noise_suppression", value, sizeof(value));
+    ret = kvpairs_has(&parms, SET_KEY_NOISE_SUPPRESSION) ? 0 : -ENOENT;
     if (ret >= 0) {
-        if (strcmp(value, "on") == 0) {
+        if (kvpairs_value_is(&parms, SET_KEY_NOISE_SUPPRESSION,
+                             AUDIO_PARAMETER_VALUE_ON)) {
             ALOGV("%s: enabling two mic control", __func__);
             ril_set_two_mic_control(&adev->ril, AUDIENCE, TWO_MIC_SOLUTION_ON);
         } else {
@@ -1451,14 +4558,22 @@ static int adev_set_parameters(struct audio_hw_device *dev, const char *kvpairs)
         }
     }
 
-    str_parms_destroy(parms);
     return ret;
 }
 
 static char * adev_get_parameters(const struct audio_hw_device *dev,
                                   const char *keys)
 {
-    return strdup("");
+    struct audio_device *adev = (struct audio_device *)dev;
+    struct kvpairs query;
+    struct kvpairs_reply reply;
+
+    kvpairs_parse(&query, keys, get_keys, GET_KEY_CNT);
+    kvpairs_reply_init(&reply);
+
+    playback_mixer_get_parameters(&adev->mixer, &query, &reply);
+
+    return kvpairs_reply_to_str(&reply);
 }
 
 static int adev_init_check(const struct audio_hw_device *dev)
@@ -1469,13 +4584,15 @@ static int adev_init_check(const struct audio_hw_device *dev)
 static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
 {
     struct audio_device *adev = (struct audio_device *)dev;
+    struct route_snapshot route;
 
     adev->voice_volume = volume;
 
     if (adev->mode == AUDIO_MODE_IN_CALL) {
         enum ril_sound_type sound_type;
 
-        switch (adev->out_device) {
+        route_snapshot_get(adev, &route);
+        switch (route.out_device) {
             case AUDIO_DEVICE_OUT_SPEAKER:
                 sound_type = SOUND_TYPE_SPEAKER;
                 break;
@@ -1499,7 +4616,20 @@ static int adev_set_voice_volume(struct audio_hw_device *dev, float volume)
 
 static int adev_set_master_volume(struct audio_hw_device *dev, float volume)
 {
-    return -ENOSYS;
+    struct audio_device *adev = (struct audio_device *)dev;
+    int16_t gain = gain_q15_from_float(volume);
+
+    adev->master_volume = volume;
+    android_atomic_release_store(pack_gain(gain, gain), &adev->master_gain);
+    return 0;
+}
+
+static int adev_get_master_volume(struct audio_hw_device *dev, float *volume)
+{
+    struct audio_device *adev = (struct audio_device *)dev;
+
+    *volume = adev->master_volume;
+    return 0;
 }
 
 static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
@@ -1509,7 +4639,7 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
     if (adev->mode == mode)
         return 0;
 
-    pthread_mutex_lock(&adev->lock);
+    adev_lock(adev);
     adev->mode = mode;
 
     if (adev->mode == AUDIO_MODE_IN_CALL) {
@@ -1521,6 +4651,8 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
             }
             adev->input_source = AUDIO_SOURCE_VOICE_CALL;
             select_devices(adev);
+            /* the modem path must be set before the voice PCMs start */
+            route_wait(adev);
             start_voice_call(adev);
             ril_set_call_clock_sync(&adev->ril, SOUND_CLOCK_START);
             adev_set_voice_volume(&adev->hw_device, adev->voice_volume);
@@ -1534,8 +4666,8 @@ static int adev_set_mode(struct audio_hw_device *dev, audio_mode_t mode)
             ril_set_call_clock_sync(&adev->ril, SOUND_CLOCK_STOP);
             if (adev->out_device & AUDIO_DEVICE_OUT_ALL_SCO)
                 end_bt_sco(adev);
-            adev->input_source = AUDIO_SOURCE_DEFAULT;
-            select_devices(adev);
+            /* back to the route of the running captures */
+            select_input(adev);
         }
     }
     pthread_mutex_unlock(&adev->lock);
@@ -1587,7 +4719,8 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     *stream_in = NULL;
 
     /* Respond with a request for stereo if a different format is given. */
-    if (config->channel_mask != AUDIO_CHANNEL_IN_STEREO) {
+    if (config->channel_mask != AUDIO_CHANNEL_IN_STEREO &&
+            config->channel_mask != AUDIO_CHANNEL_IN_MONO) {
         config->channel_mask = AUDIO_CHANNEL_IN_STEREO;
         return -EINVAL;
     }
@@ -1620,6 +4753,9 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
     in->device = devices & ~AUDIO_DEVICE_BIT_IN;
     in->io_handle = handle;
     in->channel_mask = config->channel_mask;
+    in->to_mono = stereo_to_mono_left;
+    in->echo_delay_us = -1;
+    capture_fx_init(&in->fx, in->requested_rate, popcount(in->channel_mask));
 
     in->buffer = malloc(pcm_config_in.period_size * pcm_config_in.channels
                                                * audio_stream_frame_size(&in->stream.common));
@@ -1628,28 +4764,21 @@ static int adev_open_input_stream(struct audio_hw_device *dev,
         goto err_malloc;
     }
 
-    if (in->requested_rate != pcm_config_in.rate) {
-        in->buf_provider.get_next_buffer = get_next_buffer;
-        in->buf_provider.release_buffer = release_buffer;
+    in->buf_provider.get_next_buffer = get_next_buffer;
+    in->buf_provider.release_buffer = release_buffer;
 
-        ret = create_resampler(pcm_config_in.rate,
-                               in->requested_rate,
-                               popcount(in->channel_mask),
-                               RESAMPLER_QUALITY_DEFAULT,
-                               &in->buf_provider,
-                               &in->resampler);
-        if (ret != 0) {
-            ret = -EINVAL;
-            goto err_resampler;
-        }
-
-        ALOGV("%s: Created resampler converting %d -> %d\n",
-              __func__, pcm_config_in.rate, in->requested_rate);
-    }
+    /* the rate the capture pcm runs at is only known when the stream starts */
+    ret = in_set_capture_rate(in, in_preferred_rate(in));
+    if (ret != 0)
+        goto err_resampler;
 
     ALOGV("%s: Requesting input stream with rate: %d, channels: 0x%x\n",
           __func__, config->sample_rate, config->channel_mask);
 
+    adev_lock(adev);
+    in_request_prewarm(in);
+    pthread_mutex_unlock(&adev->lock);
+
     *stream_in = &in->stream;
     return 0;
 
@@ -1664,26 +4793,123 @@ static void adev_close_input_stream(struct audio_hw_device *dev,
                                    struct audio_stream_in *stream)
 {
     struct stream_in *in = (struct stream_in *)stream;
+    struct audio_device *adev = in->dev;
+
+    adev_lock(adev);
+    in_release_prewarm(in);
+    pthread_mutex_unlock(&adev->lock);
 
     in_standby(&stream->common);
     if (in->resampler) {
         release_resampler(in->resampler);
         in->resampler = NULL;
     }
+    free(in->echo_delay);
+    free(in->ref_buffer);
+    free(in->ref_mono);
     free(in->buffer);
     free(stream);
 }
 
 static int adev_dump(const audio_hw_device_t *device, int fd)
 {
+    struct audio_device *adev = (struct audio_device *)device;
+    struct playback_mixer *mixer = &adev->mixer;
+    struct capture_mux *capture = &adev->capture;
+    char buffer[256];
+
+    /* no locks, the dump must work while the HAL is stuck */
+    snprintf(buffer, sizeof(buffer),
+             "Audio HAL:\n"
+             "  mode: %d\n"
+             "  out device: %#x\n"
+             "  in device: %#x, source %d\n"
+             "  route id: %#x, es325 preset %d\n"
+             "  routes coalesced: %d\n"
+             "  standby delay: %u ms, pre-warm %s\n",
+             adev->mode, adev->out_device, adev->in_device,
+             adev->input_source, adev->cur_route_id, adev->es325_preset,
+             android_atomic_acquire_load(&adev->routes_coalesced),
+             adev->standby_delay_ms, adev->prewarm ? "on" : "off");
+    write(fd, buffer, strlen(buffer));
+
+    snprintf(buffer, sizeof(buffer),
+             "  hw device mutex: %d uncontended locks\n",
+             android_atomic_acquire_load(&adev->lock_uncontended));
+    write(fd, buffer, strlen(buffer));
+    stats_histogram_dump(&adev->lock_wait, fd, "wait time");
+    stats_histogram_dump(&adev->out_lock_wait, fd,
+                         "output mutex wait time");
+
+    snprintf(buffer, sizeof(buffer), "  first buffer after standby:\n");
+    write(fd, buffer, strlen(buffer));
+    stats_histogram_dump(&adev->first_write[0], fd, "write, cold");
+    stats_histogram_dump(&adev->first_write[1], fd, "write, warm");
+    stats_histogram_dump(&adev->first_read[0], fd, "read, cold");
+    stats_histogram_dump(&adev->first_read[1], fd, "read, warm");
+
+    stats_route_history_dump(&adev->route_history, fd);
+#ifdef AUDIO_TRACE
+    stats_trace_dump(&adev->trace, fd, trace_formats, TRACE_CNT);
+#endif
+
+    snprintf(buffer, sizeof(buffer),
+             "Playback mixer:\n"
+             "  xruns: %d\n"
+             "  write errors: %d\n"
+             "  pcm reopens: %d\n",
+             android_atomic_acquire_load(&mixer->xruns),
+             android_atomic_acquire_load(&mixer->errors),
+             android_atomic_acquire_load(&mixer->reopens));
+    write(fd, buffer, strlen(buffer));
+
+    snprintf(buffer, sizeof(buffer),
+             "Capture:\n"
+             "  users: %u, active inputs: %u\n"
+             "  pcm: %u Hz, %u frames periods\n"
+             "  overruns: %d, %d frames lost\n"
+             "  read errors: %d\n"
+             "  pcm reopens: %d\n",
+             capture->users, adev->num_active_inputs,
+             capture->config.rate, capture->config.period_size,
+             android_atomic_acquire_load(&capture->overruns),
+             android_atomic_acquire_load(&capture->frames_lost),
+             android_atomic_acquire_load(&capture->errors),
+             android_atomic_acquire_load(&capture->reopens));
+    write(fd, buffer, strlen(buffer));
+
     return 0;
 }
 
 static int adev_close(hw_device_t *device)
 {
     struct audio_device *adev = (struct audio_device *)device;
+    unsigned int i, j;
+
+    adev_lock(adev);
+    adev->housekeeping_exit = true;
+    pthread_cond_signal(&adev->housekeeping_cond);
+    pthread_mutex_unlock(&adev->lock);
+    pthread_join(adev->housekeeping_thread, NULL);
+    pthread_cond_destroy(&adev->housekeeping_cond);
+
+    if (adev->prewarm_capture)
+        capture_mux_detach(&adev->capture);
+    capture_mux_release(adev);
 
-    audio_route_free(adev->ar);
+    route_stop(adev);
+
+    for (i = 0; i < IN_SOURCE_TAB_SIZE; i++) {
+        for (j = 0; j < (1 << OUT_DEVICE_TAB_SIZE); j++)
+            free(adev->output_routes[i][j]);
+    }
+
+    playback_mixer_release(adev);
+
+    if (adev->route_table)
+        route_table_close(adev->route_table);
+    else
+        audio_route_free(adev->ar);
 
     eS325_Release();
 
@@ -1698,6 +4924,7 @@ static int adev_open(const hw_module_t* module, const char* name,
                      hw_device_t** device)
 {
     struct audio_device *adev;
+    char value[PROPERTY_VALUE_MAX];
     int ret;
 
     if (strcmp(name, AUDIO_HARDWARE_INTERFACE) != 0)
@@ -1715,6 +4942,7 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.init_check = adev_init_check;
     adev->hw_device.set_voice_volume = adev_set_voice_volume;
     adev->hw_device.set_master_volume = adev_set_master_volume;
+    adev->hw_device.get_master_volume = adev_get_master_volume;
     adev->hw_device.set_mode = adev_set_mode;
     adev->hw_device.set_mic_mute = adev_set_mic_mute;
     adev->hw_device.get_mic_mute = adev_get_mic_mute;
@@ -1729,7 +4957,86 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->hw_device.set_master_mute = NULL;
     adev->hw_device.get_master_mute = NULL;
 
-    adev->ar = audio_route_init(MIXER_CARD, NULL);
+    property_get(MMAP_OUTPUT_PROPERTY, value, "0");
+    adev->mmap_output = (atoi(value) == 1);
+
+    property_get(PREWARM_PROPERTY, value, "0");
+    adev->prewarm = (atoi(value) == 1);
+
+    property_get(NATIVE_CAPTURE_PROPERTY, value, "1");
+    adev->native_capture = (atoi(value) == 1);
+
+#ifdef AUDIO_TRACE
+    property_get(TRACE_PROPERTY, value, "0");
+    adev->trace_enabled = (atoi(value) == 1);
+#endif
+
+    property_get(STANDBY_DELAY_PROPERTY, value, "");
+    adev->standby_delay_ms = (value[0] != '\0') ?
+            (unsigned int)atoi(value) : DEFAULT_STANDBY_DELAY_MS;
+
+    pthread_mutex_init(&adev->lock, NULL);
+    pthread_mutex_init(&adev->streams_lock, NULL);
+    pthread_mutex_init(&adev->call_lock, NULL);
+    pthread_mutex_init(&adev->sco_lock, NULL);
+
+    ret = playback_mixer_init(adev);
+    if (ret != 0) {
+        free(adev);
+        return ret;
+    }
+
+    if (adev->mmap_output && !playback_mixer_can_rt(&adev->mixer)) {
+        ALOGW("%s: the mixer thread cannot run SCHED_FIFO, no ultra low "
+              "latency output", __func__);
+        adev->mmap_output = false;
+    }
+
+    ret = capture_mux_init(adev);
+    if (ret != 0) {
+        playback_mixer_release(adev);
+        free(adev);
+        return ret;
+    }
+
+    pthread_cond_init(&adev->housekeeping_cond, NULL);
+    if (pthread_create(&adev->housekeeping_thread, NULL,
+                       housekeeping_thread, adev) != 0) {
+        ALOGE("%s: cannot create housekeeping thread", __func__);
+        pthread_cond_destroy(&adev->housekeeping_cond);
+        capture_mux_release(adev);
+        playback_mixer_release(adev);
+        free(adev);
+        return -ENOMEM;
+    }
+
+    adev->route_table = route_table_open(ROUTE_TABLE_PATH, MIXER_CARD,
+                                         IN_SOURCE_TAB_SIZE, OUT_DEVICE_TAB_SIZE);
+    if (!adev->route_table) {
+        ALOGI("%s: no usable %s, parsing the mixer paths", __func__,
+              ROUTE_TABLE_PATH);
+        adev->ar = audio_route_init(MIXER_CARD, NULL);
+    }
+
+    adev->applied_es325_preset = ES325_PRESET_INIT;
+    ret = route_start(adev);
+    if (ret != 0) {
+        if (adev->route_table)
+            route_table_close(adev->route_table);
+        else
+            audio_route_free(adev->ar);
+        adev_lock(adev);
+        adev->housekeeping_exit = true;
+        pthread_cond_signal(&adev->housekeeping_cond);
+        pthread_mutex_unlock(&adev->lock);
+        pthread_join(adev->housekeeping_thread, NULL);
+        pthread_cond_destroy(&adev->housekeeping_cond);
+        capture_mux_release(adev);
+        playback_mixer_release(adev);
+        free(adev);
+        return ret;
+    }
+
     adev->input_source = AUDIO_SOURCE_DEFAULT;
     /* adev->cur_route_id initial value is 0 and such that first device
      * selection is always applied by select_devices() */
@@ -1738,8 +5045,14 @@ static int adev_open(const hw_module_t* module, const char* name,
     adev->es325_new_mode = ES325_MODE_LEVEL;
     adev->es325_mode = ES325_MODE_LEVEL;
 
+    adev_lock(adev);
+    route_snapshot_publish(adev);
+    pthread_mutex_unlock(&adev->lock);
+
     adev->mode = AUDIO_MODE_NORMAL;
     adev->voice_volume = 1.0f;
+    adev->master_volume = 1.0f;
+    adev->master_gain = pack_gain(GAIN_Q15_UNITY, GAIN_Q15_UNITY);
 
     /* RIL */
     ril_open(&adev->ril);
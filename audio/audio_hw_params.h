@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_HW_PARAMS_H
+#define AUDIO_HW_PARAMS_H
+
+#include <hardware/audio.h>
+
+#include "kvpairs.h"
+
+/*
+ * Keys of the set_parameters() and get_parameters() strings handled by
+ * audio_hw.c, as kvpairs tables. host/kvpairs_bench.c parses with the same
+ * tables.
+ */
+
+/* xrun counters, readable with get_parameters() */
+#define AUDIO_PARAMETER_KEY_UNDERRUNS "underruns"
+#define AUDIO_PARAMETER_KEY_OVERRUNS "overruns"
+#define AUDIO_PARAMETER_KEY_READ_ERRORS "read_errors"
+#define AUDIO_PARAMETER_KEY_HW_XRUNS "hw_xruns"
+#define AUDIO_PARAMETER_KEY_HW_ERRORS "hw_errors"
+#define AUDIO_PARAMETER_KEY_HW_REOPENS "hw_reopens"
+#define AUDIO_PARAMETER_KEY_STANDBY_AVOIDED "standby_avoided"
+#define AUDIO_PARAMETER_KEY_ECHO_DELAY_MEASURE "echo_delay_measure"
+#define AUDIO_PARAMETER_KEY_ECHO_DELAY "echo_delay_us"
+#define AUDIO_PARAMETER_KEY_NOISE_SUPPRESSION "noise_suppression"
+/* input frames lost since the stream was opened, and the capture position as
+ * "<frames>,<CLOCK_MONOTONIC ns>", see in_get_capture_position() */
+#define AUDIO_PARAMETER_KEY_FRAMES_LOST "frames_lost"
+#define AUDIO_PARAMETER_KEY_CAPTURE_POSITION "capture_position"
+/* in-HAL capture preprocessing, see capture_fx.h */
+#define AUDIO_PARAMETER_KEY_CAPTURE_HPF "capture_hpf"
+#define AUDIO_PARAMETER_KEY_CAPTURE_GAIN "capture_gain_db"
+#define AUDIO_PARAMETER_KEY_CAPTURE_GATE "capture_noise_gate"
+
+/* keys handled by the set_parameters() entry points */
+enum {
+    SET_KEY_ROUTING,
+    SET_KEY_INPUT_SOURCE,
+    SET_KEY_ECHO_DELAY_MEASURE,
+    SET_KEY_BT_NREC,
+    SET_KEY_NOISE_SUPPRESSION,
+    SET_KEY_CAPTURE_HPF,
+    SET_KEY_CAPTURE_GAIN,
+    SET_KEY_CAPTURE_GATE,
+    SET_KEY_CNT
+};
+
+static const struct kvpairs_key set_keys[SET_KEY_CNT] = {
+    [SET_KEY_ROUTING] = KVPAIRS_KEY(AUDIO_PARAMETER_STREAM_ROUTING),
+    [SET_KEY_INPUT_SOURCE] = KVPAIRS_KEY(AUDIO_PARAMETER_STREAM_INPUT_SOURCE),
+    [SET_KEY_ECHO_DELAY_MEASURE] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_ECHO_DELAY_MEASURE),
+    [SET_KEY_BT_NREC] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_BT_NREC),
+    [SET_KEY_NOISE_SUPPRESSION] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_NOISE_SUPPRESSION),
+    [SET_KEY_CAPTURE_HPF] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_CAPTURE_HPF),
+    [SET_KEY_CAPTURE_GAIN] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_CAPTURE_GAIN),
+    [SET_KEY_CAPTURE_GATE] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_CAPTURE_GATE),
+};
+
+/* keys answered by the get_parameters() entry points */
+enum {
+    GET_KEY_SUP_CHANNELS,
+    GET_KEY_UNDERRUNS,
+    GET_KEY_STANDBY_AVOIDED,
+    GET_KEY_OVERRUNS,
+    GET_KEY_READ_ERRORS,
+    GET_KEY_ECHO_DELAY,
+    GET_KEY_HW_XRUNS,
+    GET_KEY_HW_ERRORS,
+    GET_KEY_HW_REOPENS,
+    GET_KEY_FRAMES_LOST,
+    GET_KEY_CAPTURE_POSITION,
+    GET_KEY_CNT
+};
+
+static const struct kvpairs_key get_keys[GET_KEY_CNT] = {
+    [GET_KEY_SUP_CHANNELS] = KVPAIRS_KEY(AUDIO_PARAMETER_STREAM_SUP_CHANNELS),
+    [GET_KEY_UNDERRUNS] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_UNDERRUNS),
+    [GET_KEY_STANDBY_AVOIDED] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_STANDBY_AVOIDED),
+    [GET_KEY_OVERRUNS] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_OVERRUNS),
+    [GET_KEY_READ_ERRORS] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_READ_ERRORS),
+    [GET_KEY_ECHO_DELAY] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_ECHO_DELAY),
+    [GET_KEY_HW_XRUNS] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_HW_XRUNS),
+    [GET_KEY_HW_ERRORS] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_HW_ERRORS),
+    [GET_KEY_HW_REOPENS] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_HW_REOPENS),
+    [GET_KEY_FRAMES_LOST] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_FRAMES_LOST),
+    [GET_KEY_CAPTURE_POSITION] = KVPAIRS_KEY(AUDIO_PARAMETER_KEY_CAPTURE_POSITION),
+};
+
+#endif /* AUDIO_HW_PARAMS_H */
@@ -0,0 +1,433 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
+
+#include "audio_kernels.h"
+
+/*
+ * The gain of a ramp is kept in q30 and advanced once per frame, so both
+ * versions use exactly the same gain for every frame.
+ */
+static inline int32_t gain_ramp_step(int16_t start, int16_t end, size_t frames)
+{
+    return ((int32_t)end - start) * 32768 / (int32_t)frames;
+}
+
+void gain_ramp_stereo_q15_c(int16_t *buffer, size_t frames,
+                            const int16_t start[2], const int16_t end[2])
+{
+    int32_t acc_l, acc_r;
+    int32_t step_l, step_r;
+    size_t i;
+
+    if (frames == 0)
+        return;
+
+    acc_l = (int32_t)start[0] * 32768;
+    acc_r = (int32_t)start[1] * 32768;
+    step_l = gain_ramp_step(start[0], end[0], frames);
+    step_r = gain_ramp_step(start[1], end[1], frames);
+
+    for (i = 0; i < frames; i++) {
+        buffer[2 * i] = gain_q15_mul(buffer[2 * i], (int16_t)(acc_l >> 15));
+        buffer[2 * i + 1] = gain_q15_mul(buffer[2 * i + 1], (int16_t)(acc_r >> 15));
+        acc_l += step_l;
+        acc_r += step_r;
+    }
+}
+
+#ifdef __ARM_NEON__
+/* four frames per iteration, the remainder goes through the C loop */
+static void gain_ramp_stereo_q15_neon(int16_t *buffer, size_t frames,
+                                      const int16_t start[2], const int16_t end[2])
+{
+    const int32_t lanes[4] = { 0, 1, 2, 3 };
+    int32_t step_l = gain_ramp_step(start[0], end[0], frames);
+    int32_t step_r = gain_ramp_step(start[1], end[1], frames);
+    int32x4_t acc_l, acc_r;
+    int32x4_t inc_l, inc_r;
+    int16x4x2_t gains;
+    int16x8_t samples;
+    size_t blocks = frames / 4;
+    size_t i;
+
+    acc_l = vmlaq_n_s32(vdupq_n_s32((int32_t)start[0] * 32768), vld1q_s32(lanes), step_l);
+    acc_r = vmlaq_n_s32(vdupq_n_s32((int32_t)start[1] * 32768), vld1q_s32(lanes), step_r);
+    inc_l = vdupq_n_s32(step_l * 4);
+    inc_r = vdupq_n_s32(step_r * 4);
+
+    for (i = 0; i < blocks; i++) {
+        gains = vzip_s16(vshrn_n_s32(acc_l, 15), vshrn_n_s32(acc_r, 15));
+        samples = vld1q_s16(buffer);
+        samples = vqrdmulhq_s16(samples, vcombine_s16(gains.val[0], gains.val[1]));
+        vst1q_s16(buffer, samples);
+        buffer += 8;
+        acc_l = vaddq_s32(acc_l, inc_l);
+        acc_r = vaddq_s32(acc_r, inc_r);
+    }
+
+    /* finish the ramp exactly where the C version would be */
+    for (i = blocks * 4; i < frames; i++) {
+        int32_t gain_l = ((int32_t)start[0] * 32768) + step_l * (int32_t)i;
+        int32_t gain_r = ((int32_t)start[1] * 32768) + step_r * (int32_t)i;
+
+        buffer[0] = gain_q15_mul(buffer[0], (int16_t)(gain_l >> 15));
+        buffer[1] = gain_q15_mul(buffer[1], (int16_t)(gain_r >> 15));
+        buffer += 2;
+    }
+}
+#endif
+
+void stereo_to_mono_left_c(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = src[2 * i];
+}
+
+void stereo_to_mono_right_c(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    for (i = 0; i < frames; i++)
+        dst[i] = src[2 * i + 1];
+}
+
+void stereo_to_mono_mix_c(int16_t *dst, const int16_t *src, size_t frames)
+{
+    size_t i;
+
+    /* same as the NEON halving add vhadd */
+    for (i = 0; i < frames; i++)
+        dst[i] = (int16_t)(((int32_t)src[2 * i] + src[2 * i + 1]) >> 1);
+}
+
+void pcm_16_to_float_c(float *dst, const int16_t *src, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        dst[i] = src[i] * (1.0f / 32768.0f);
+}
+
+void gain_q12_c(int16_t *buffer, size_t samples, int16_t gain)
+{
+    int32_t sample;
+    size_t i;
+
+    /* same as the NEON rounding saturating narrow vqrshrn */
+    for (i = 0; i < samples; i++) {
+        sample = ((int32_t)buffer[i] * gain + (1 << 11)) >> 12;
+        if (sample > INT16_MAX)
+            sample = INT16_MAX;
+        else if (sample < INT16_MIN)
+            sample = INT16_MIN;
+        buffer[i] = (int16_t)sample;
+    }
+}
+
+void gain_ramp_mono_q15_c(int16_t *buffer, size_t frames, int16_t start,
+                          int16_t end)
+{
+    int32_t acc;
+    int32_t step;
+    size_t i;
+
+    if (frames == 0)
+        return;
+
+    acc = (int32_t)start * 32768;
+    step = gain_ramp_step(start, end, frames);
+
+    for (i = 0; i < frames; i++) {
+        buffer[i] = gain_q15_mul(buffer[i], (int16_t)(acc >> 15));
+        acc += step;
+    }
+}
+
+int16_t peak_abs_i16_c(const int16_t *buffer, size_t samples)
+{
+    int16_t peak = 0;
+    int16_t sample;
+    size_t i;
+
+    /* same as the NEON saturating absolute value vqabs */
+    for (i = 0; i < samples; i++) {
+        sample = buffer[i];
+        if (sample < 0)
+            sample = (sample == INT16_MIN) ? INT16_MAX : -sample;
+        if (sample > peak)
+            peak = sample;
+    }
+
+    return peak;
+}
+
+void biquad_i16(struct biquad *bq, int16_t *buffer, size_t frames,
+                unsigned int channels)
+{
+    float x, y;
+    size_t i;
+    unsigned int c;
+
+    for (c = 0; c < channels; c++) {
+        float z1 = bq->z1[c];
+        float z2 = bq->z2[c];
+
+        for (i = 0; i < frames; i++) {
+            x = buffer[i * channels + c];
+            y = bq->b0 * x + z1;
+            z1 = bq->b1 * x - bq->a1 * y + z2;
+            z2 = bq->b2 * x - bq->a2 * y;
+
+            y += (y >= 0.0f) ? 0.5f : -0.5f;
+            if (y > INT16_MAX)
+                y = INT16_MAX;
+            else if (y < INT16_MIN)
+                y = INT16_MIN;
+            buffer[i * channels + c] = (int16_t)y;
+        }
+
+        bq->z1[c] = z1;
+        bq->z2[c] = z2;
+    }
+}
+
+#ifdef __ARM_NEON__
+/*
+ * Eight frames per iteration, the remainder goes through the C loop. In
+ * place, a block is loaded before it is stored and stores never reach the
+ * frames not loaded yet.
+ */
+static void stereo_to_mono_left_neon(int16_t *dst, const int16_t *src,
+                                     size_t frames)
+{
+    size_t blocks = frames / 8;
+    size_t i;
+
+    for (i = 0; i < blocks; i++)
+        vst1q_s16(dst + i * 8, vld2q_s16(src + i * 16).val[0]);
+
+    stereo_to_mono_left_c(dst + blocks * 8, src + blocks * 16, frames % 8);
+}
+
+static void stereo_to_mono_right_neon(int16_t *dst, const int16_t *src,
+                                      size_t frames)
+{
+    size_t blocks = frames / 8;
+    size_t i;
+
+    for (i = 0; i < blocks; i++)
+        vst1q_s16(dst + i * 8, vld2q_s16(src + i * 16).val[1]);
+
+    stereo_to_mono_right_c(dst + blocks * 8, src + blocks * 16, frames % 8);
+}
+
+static void stereo_to_mono_mix_neon(int16_t *dst, const int16_t *src,
+                                    size_t frames)
+{
+    int16x8x2_t samples;
+    size_t blocks = frames / 8;
+    size_t i;
+
+    for (i = 0; i < blocks; i++) {
+        samples = vld2q_s16(src + i * 16);
+        vst1q_s16(dst + i * 8, vhaddq_s16(samples.val[0], samples.val[1]));
+    }
+
+    stereo_to_mono_mix_c(dst + blocks * 8, src + blocks * 16, frames % 8);
+}
+
+/* int16 to float is exact and so is the scaling by a power of two */
+static void pcm_16_to_float_neon(float *dst, const int16_t *src,
+                                 size_t samples)
+{
+    int16x8_t in;
+    size_t blocks = samples / 8;
+    size_t i;
+
+    for (i = 0; i < blocks; i++) {
+        in = vld1q_s16(src + i * 8);
+        vst1q_f32(dst + i * 8, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(in))),
+                                           1.0f / 32768.0f));
+        vst1q_f32(dst + i * 8 + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(in))),
+                                               1.0f / 32768.0f));
+    }
+
+    pcm_16_to_float_c(dst + blocks * 8, src + blocks * 8, samples % 8);
+}
+
+static void gain_q12_neon(int16_t *buffer, size_t samples, int16_t gain)
+{
+    int16x4_t g = vdup_n_s16(gain);
+    int16x8_t in;
+    size_t blocks = samples / 8;
+    size_t i;
+
+    for (i = 0; i < blocks; i++) {
+        in = vld1q_s16(buffer + i * 8);
+        vst1q_s16(buffer + i * 8,
+                  vcombine_s16(vqrshrn_n_s32(vmull_s16(vget_low_s16(in), g), 12),
+                               vqrshrn_n_s32(vmull_s16(vget_high_s16(in), g), 12)));
+    }
+
+    gain_q12_c(buffer + blocks * 8, samples % 8, gain);
+}
+
+/* eight frames per iteration, the remainder goes through the C loop */
+static void gain_ramp_mono_q15_neon(int16_t *buffer, size_t frames,
+                                    int16_t start, int16_t end)
+{
+    const int32_t lanes[4] = { 0, 1, 2, 3 };
+    int32_t step = gain_ramp_step(start, end, frames);
+    int32x4_t acc_lo, acc_hi;
+    int32x4_t inc;
+    int16x8_t gains;
+    size_t blocks = frames / 8;
+    size_t i;
+
+    acc_lo = vmlaq_n_s32(vdupq_n_s32((int32_t)start * 32768), vld1q_s32(lanes), step);
+    acc_hi = vaddq_s32(acc_lo, vdupq_n_s32(step * 4));
+    inc = vdupq_n_s32(step * 8);
+
+    for (i = 0; i < blocks; i++) {
+        gains = vcombine_s16(vshrn_n_s32(acc_lo, 15), vshrn_n_s32(acc_hi, 15));
+        vst1q_s16(buffer + i * 8, vqrdmulhq_s16(vld1q_s16(buffer + i * 8), gains));
+        acc_lo = vaddq_s32(acc_lo, inc);
+        acc_hi = vaddq_s32(acc_hi, inc);
+    }
+
+    /* finish the ramp exactly where the C version would be */
+    for (i = blocks * 8; i < frames; i++) {
+        int32_t gain = ((int32_t)start * 32768) + step * (int32_t)i;
+
+        buffer[i] = gain_q15_mul(buffer[i], (int16_t)(gain >> 15));
+    }
+}
+
+static int16_t peak_abs_i16_neon(const int16_t *buffer, size_t samples)
+{
+    int16x8_t peak = vdupq_n_s16(0);
+    int16x4_t folded;
+    int16_t tail;
+    size_t blocks = samples / 8;
+    size_t i;
+
+    for (i = 0; i < blocks; i++)
+        peak = vmaxq_s16(peak, vqabsq_s16(vld1q_s16(buffer + i * 8)));
+
+    folded = vmax_s16(vget_low_s16(peak), vget_high_s16(peak));
+    folded = vpmax_s16(folded, folded);
+    folded = vpmax_s16(folded, folded);
+
+    tail = peak_abs_i16_c(buffer + blocks * 8, samples % 8);
+    return (vget_lane_s16(folded, 0) > tail) ? vget_lane_s16(folded, 0) : tail;
+}
+#endif
+
+void stereo_to_mono_left(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef __ARM_NEON__
+    stereo_to_mono_left_neon(dst, src, frames);
+#else
+    stereo_to_mono_left_c(dst, src, frames);
+#endif
+}
+
+void stereo_to_mono_right(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef __ARM_NEON__
+    stereo_to_mono_right_neon(dst, src, frames);
+#else
+    stereo_to_mono_right_c(dst, src, frames);
+#endif
+}
+
+void stereo_to_mono_mix(int16_t *dst, const int16_t *src, size_t frames)
+{
+#ifdef __ARM_NEON__
+    stereo_to_mono_mix_neon(dst, src, frames);
+#else
+    stereo_to_mono_mix_c(dst, src, frames);
+#endif
+}
+
+void pcm_16_to_float(float *dst, const int16_t *src, size_t samples)
+{
+#ifdef __ARM_NEON__
+    pcm_16_to_float_neon(dst, src, samples);
+#else
+    pcm_16_to_float_c(dst, src, samples);
+#endif
+}
+
+void gain_ramp_stereo_q15(int16_t *buffer, size_t frames,
+                          const int16_t start[2], const int16_t end[2])
+{
+    if (start[0] == GAIN_Q15_UNITY && start[1] == GAIN_Q15_UNITY &&
+            end[0] == GAIN_Q15_UNITY && end[1] == GAIN_Q15_UNITY)
+        return;
+
+    if (frames == 0)
+        return;
+
+#ifdef __ARM_NEON__
+    gain_ramp_stereo_q15_neon(buffer, frames, start, end);
+#else
+    gain_ramp_stereo_q15_c(buffer, frames, start, end);
+#endif
+}
+
+void gain_q12(int16_t *buffer, size_t samples, int16_t gain)
+{
+    if (gain == GAIN_Q12_UNITY)
+        return;
+
+#ifdef __ARM_NEON__
+    gain_q12_neon(buffer, samples, gain);
+#else
+    gain_q12_c(buffer, samples, gain);
+#endif
+}
+
+void gain_ramp_mono_q15(int16_t *buffer, size_t frames, int16_t start,
+                        int16_t end)
+{
+    if (start == GAIN_Q15_UNITY && end == GAIN_Q15_UNITY)
+        return;
+
+    if (frames == 0)
+        return;
+
+#ifdef __ARM_NEON__
+    gain_ramp_mono_q15_neon(buffer, frames, start, end);
+#else
+    gain_ramp_mono_q15_c(buffer, frames, start, end);
+#endif
+}
+
+int16_t peak_abs_i16(const int16_t *buffer, size_t samples)
+{
+#ifdef __ARM_NEON__
+    return peak_abs_i16_neon(buffer, samples);
+#else
+    return peak_abs_i16_c(buffer, samples);
+#endif
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_KERNELS_H
+#define AUDIO_KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* 1.0 in q15, the gain kernels leave buffers untouched at unity */
+#define GAIN_Q15_UNITY 0x7fff
+
+static inline int16_t gain_q15_from_float(float gain)
+{
+    int32_t q15;
+
+    if (gain <= 0.0f)
+        return 0;
+    if (gain >= 1.0f)
+        return GAIN_Q15_UNITY;
+    /* gains just below 1.0 round up to 32768 */
+    q15 = (int32_t)(gain * 32768.0f + 0.5f);
+    return (q15 > GAIN_Q15_UNITY) ? GAIN_Q15_UNITY : (int16_t)q15;
+}
+
+/* rounding q15 product, same as the NEON vqrdmulh instruction */
+static inline int16_t gain_q15_mul(int16_t a, int16_t b)
+{
+    int32_t product = ((int32_t)a * b + (1 << 14)) >> 15;
+
+    return (product > INT16_MAX) ? INT16_MAX : (int16_t)product;
+}
+
+/*
+ * Product of two gains. Unity times a gain is that gain, where
+ * gain_q15_mul() would scale it by 0x7fff / 0x8000 and defeat the unity
+ * short-circuit of the kernels.
+ */
+static inline int16_t gain_q15_combine(int16_t a, int16_t b)
+{
+    if (a == GAIN_Q15_UNITY)
+        return b;
+    if (b == GAIN_Q15_UNITY)
+        return a;
+    return gain_q15_mul(a, b);
+}
+
+/* Gain kernels, the NEON and C versions give bit-exact results */
+
+/*
+ * Scale interleaved stereo 16 bit frames by q15 gains ramping linearly from
+ * start[] to end[] (left, right) over the buffer.
+ */
+void gain_ramp_stereo_q15(int16_t *buffer, size_t frames,
+                          const int16_t start[2], const int16_t end[2]);
+void gain_ramp_stereo_q15_c(int16_t *buffer, size_t frames,
+                            const int16_t start[2], const int16_t end[2]);
+
+/*
+ * Capture kernels, the NEON and C versions give bit-exact results.
+ *
+ * Convert interleaved stereo 16 bit frames to mono, keeping the left or the
+ * right channel or their average rounded towards minus infinity. dst may be
+ * src, the conversion is then done in place.
+ */
+void stereo_to_mono_left(int16_t *dst, const int16_t *src, size_t frames);
+void stereo_to_mono_left_c(int16_t *dst, const int16_t *src, size_t frames);
+void stereo_to_mono_right(int16_t *dst, const int16_t *src, size_t frames);
+void stereo_to_mono_right_c(int16_t *dst, const int16_t *src, size_t frames);
+void stereo_to_mono_mix(int16_t *dst, const int16_t *src, size_t frames);
+void stereo_to_mono_mix_c(int16_t *dst, const int16_t *src, size_t frames);
+
+/* 16 bit samples to floats in [-1.0, 1.0) */
+void pcm_16_to_float(float *dst, const int16_t *src, size_t samples);
+void pcm_16_to_float_c(float *dst, const int16_t *src, size_t samples);
+
+/*
+ * Capture preprocessing kernels, the NEON and C versions give bit-exact
+ * results.
+ */
+
+/* 1.0 in q12, the boost gain goes up to 8x, about +18 dB */
+#define GAIN_Q12_UNITY 0x1000
+
+/* scale 16 bit samples by a q12 gain, rounded and saturated */
+void gain_q12(int16_t *buffer, size_t samples, int16_t gain);
+void gain_q12_c(int16_t *buffer, size_t samples, int16_t gain);
+
+/* mono version of gain_ramp_stereo_q15() */
+void gain_ramp_mono_q15(int16_t *buffer, size_t frames, int16_t start,
+                        int16_t end);
+void gain_ramp_mono_q15_c(int16_t *buffer, size_t frames, int16_t start,
+                          int16_t end);
+
+/* largest absolute value of 16 bit samples, -32768 counts as 32767 */
+int16_t peak_abs_i16(const int16_t *buffer, size_t samples);
+int16_t peak_abs_i16_c(const int16_t *buffer, size_t samples);
+
+/*
+ * Second order IIR filter, transposed direct form II, on one or two
+ * interleaved channels. Every output depends on the previous one, so there
+ * is no NEON version.
+ */
+struct biquad {
+    float b0, b1, b2, a1, a2;   /* normalized, a0 is 1 */
+    float z1[2], z2[2];         /* state of each channel */
+};
+
+void biquad_i16(struct biquad *bq, int16_t *buffer, size_t frames,
+                unsigned int channels);
+
+#endif
@@ -0,0 +1,173 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cutils/atomic.h>
+
+#include "audio_stats.h"
+
+void stats_histogram_add(struct stats_histogram *histogram, int64_t ns)
+{
+    int64_t us = ns / 1000;
+    int32_t max;
+    int bucket = 0;
+
+    while (bucket < STATS_HISTOGRAM_BUCKETS - 1 &&
+            us >= ((int64_t)STATS_HISTOGRAM_MIN_US << bucket))
+        bucket++;
+    android_atomic_inc(&histogram->buckets[bucket]);
+
+    if (us > INT32_MAX)
+        us = INT32_MAX;
+    do {
+        max = android_atomic_acquire_load(&histogram->max_us);
+        if (us <= max)
+            break;
+    } while (android_atomic_release_cas(max, (int32_t)us,
+                                        &histogram->max_us) != 0);
+}
+
+void stats_histogram_dump(struct stats_histogram *histogram, int fd,
+                          const char *name)
+{
+    char buffer[512];
+    size_t len;
+    int32_t count;
+    int i;
+
+    len = snprintf(buffer, sizeof(buffer), "    %s (us):", name);
+    for (i = 0; i < STATS_HISTOGRAM_BUCKETS && len < sizeof(buffer); i++) {
+        count = android_atomic_acquire_load(&histogram->buckets[i]);
+        if (i < STATS_HISTOGRAM_BUCKETS - 1)
+            len += snprintf(buffer + len, sizeof(buffer) - len, " <%d:%d",
+                            STATS_HISTOGRAM_MIN_US << i, count);
+        else
+            len += snprintf(buffer + len, sizeof(buffer) - len, " >=%d:%d",
+                            STATS_HISTOGRAM_MIN_US << (i - 1), count);
+    }
+    if (len < sizeof(buffer))
+        snprintf(buffer + len, sizeof(buffer) - len, " max:%d\n",
+                 android_atomic_acquire_load(&histogram->max_us));
+    write(fd, buffer, strlen(buffer));
+}
+
+void stats_route_history_add(struct stats_route_history *history,
+                             const struct stats_route_change *change)
+{
+    int32_t count = android_atomic_acquire_load(&history->count);
+
+    history->changes[count % STATS_ROUTE_HISTORY] = *change;
+    if (count == 0 || change->duration_us > history->slowest.duration_us)
+        history->slowest = *change;
+    android_atomic_release_store(count + 1, &history->count);
+}
+
+static void stats_route_change_dump(const struct stats_route_change *change,
+                                    int64_t now, int fd)
+{
+    char buffer[256];
+
+    snprintf(buffer, sizeof(buffer),
+             "    %lld ms ago: route %#x out %#x in %#x source %d "
+             "es325 preset %d%s, took %d us\n"
+             "      queued %d us, paths %d us, mute %d us, es325 %d us, "
+             "mixer %d us (%d writes), ril %d us\n",
+             (long long)((now - change->time_ns) / 1000000),
+             change->route_id, change->out_device, change->in_device,
+             change->input_source, change->es325_preset,
+             change->mixer_updated ? "" : ", same paths",
+             change->duration_us, change->queued_us, change->paths_us,
+             change->mute_us, change->es325_us, change->mixer_us,
+             change->ctl_writes, change->ril_us);
+    write(fd, buffer, strlen(buffer));
+}
+
+void stats_trace_add(struct stats_trace *trace, int event, int32_t arg0,
+                     int32_t arg1)
+{
+    int32_t slot = android_atomic_inc(&trace->count);
+    struct stats_trace_event *e =
+            &trace->events[(uint32_t)slot % STATS_TRACE_EVENTS];
+
+    e->time_ns = stats_now_ns();
+    e->event = event;
+    e->arg[0] = arg0;
+    e->arg[1] = arg1;
+}
+
+void stats_trace_dump(struct stats_trace *trace, int fd,
+                      const char *const *formats, int num_formats)
+{
+    struct stats_trace_event e;
+    char buffer[128];
+    size_t len;
+    int64_t now = stats_now_ns();
+    int32_t count = android_atomic_acquire_load(&trace->count);
+    int32_t i;
+
+    snprintf(buffer, sizeof(buffer), "  Trace: %d events, last %d:\n",
+             count, count < STATS_TRACE_EVENTS ? count : STATS_TRACE_EVENTS);
+    write(fd, buffer, strlen(buffer));
+
+    i = (count > STATS_TRACE_EVENTS) ? count - STATS_TRACE_EVENTS : 0;
+    for (; i < count; i++) {
+        e = trace->events[(uint32_t)i % STATS_TRACE_EVENTS];
+        len = snprintf(buffer, sizeof(buffer), "    %lld.%03lld ms ago: ",
+                       (long long)((now - e.time_ns) / 1000000),
+                       (long long)((now - e.time_ns) / 1000 % 1000));
+        if (e.event >= 0 && e.event < num_formats)
+            snprintf(buffer + len, sizeof(buffer) - len, formats[e.event],
+                     e.arg[0], e.arg[1]);
+        else
+            snprintf(buffer + len, sizeof(buffer) - len, "event %d %d %d",
+                     e.event, e.arg[0], e.arg[1]);
+        len = strlen(buffer);
+        if (len < sizeof(buffer) - 1) {
+            buffer[len++] = '\n';
+            buffer[len] = '\0';
+        }
+        write(fd, buffer, len);
+    }
+}
+
+void stats_route_history_dump(struct stats_route_history *history, int fd)
+{
+    struct stats_route_change change;
+    char buffer[64];
+    int64_t now = stats_now_ns();
+    int32_t count = android_atomic_acquire_load(&history->count);
+    int32_t i;
+
+    snprintf(buffer, sizeof(buffer), "  Route changes: %d, last %d:\n",
+             count, count < STATS_ROUTE_HISTORY ? count : STATS_ROUTE_HISTORY);
+    write(fd, buffer, strlen(buffer));
+
+    i = (count > STATS_ROUTE_HISTORY) ? count - STATS_ROUTE_HISTORY : 0;
+    for (; i < count; i++) {
+        change = history->changes[i % STATS_ROUTE_HISTORY];
+        stats_route_change_dump(&change, now, fd);
+    }
+
+    if (count > 0) {
+        snprintf(buffer, sizeof(buffer), "  Slowest route change:\n");
+        write(fd, buffer, strlen(buffer));
+        change = history->slowest;
+        stats_route_change_dump(&change, now, fd);
+    }
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef AUDIO_STATS_H
+#define AUDIO_STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Instrumentation reported by the HAL dumps. Recording only uses atomic
+ * operations so that the audio threads never block on it, dumps read it
+ * without locks and may see a record that is being updated.
+ */
+
+static inline int64_t stats_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Durations in power of two buckets: the first one counts durations under
+ * STATS_HISTOGRAM_MIN_US, the last one everything from
+ * STATS_HISTOGRAM_MIN_US << (STATS_HISTOGRAM_BUCKETS - 2) on.
+ */
+#define STATS_HISTOGRAM_BUCKETS 12
+#define STATS_HISTOGRAM_MIN_US 64
+
+struct stats_histogram {
+    volatile int32_t buckets[STATS_HISTOGRAM_BUCKETS];
+    volatile int32_t max_us;
+};
+
+void stats_histogram_add(struct stats_histogram *histogram, int64_t ns);
+void stats_histogram_dump(struct stats_histogram *histogram, int fd,
+                          const char *name);
+
+/* last route changes applied by the HAL routing thread */
+#define STATS_ROUTE_HISTORY 16
+
+struct stats_route_change {
+    int64_t time_ns;            /* CLOCK_MONOTONIC time it was applied */
+    int32_t duration_us;
+    int32_t queued_us;          /* from the request to the start */
+    int32_t paths_us;           /* stages, in order: mixer paths built in
+                                 * memory, */
+    int32_t mute_us;            /* output ramped down and played out, */
+    int32_t es325_us;           /* eS325 preset set, */
+    int32_t mixer_us;           /* mixer controls written and output
+                                 * unmuted */
+    int32_t ril_us;             /* and modem call path set */
+    int32_t ctl_writes;         /* mixer controls written, -1 if unknown */
+    int route_id;
+    uint32_t out_device;
+    uint32_t in_device;
+    int input_source;
+    int es325_preset;
+    bool mixer_updated;         /* false when the mixer paths were unchanged */
+};
+
+struct stats_route_history {
+    struct stats_route_change changes[STATS_ROUTE_HISTORY];
+    volatile int32_t count;     /* changes recorded since startup */
+    struct stats_route_change slowest;
+};
+
+/* a single thread at a time may add changes */
+void stats_route_history_add(struct stats_route_history *history,
+                             const struct stats_route_change *change);
+void stats_route_history_dump(struct stats_route_history *history, int fd);
+
+/*
+ * Binary trace of hot path events, for the audio threads that must not
+ * format or send log messages. Any thread records an event id and two
+ * integers by claiming the next slot of the ring with an atomic increment;
+ * the dump formats the last STATS_TRACE_EVENTS events with one printf
+ * format per event id, taking the two integers as arguments.
+ */
+#define STATS_TRACE_EVENTS 256
+
+struct stats_trace_event {
+    int64_t time_ns;
+    int32_t event;
+    int32_t arg[2];
+};
+
+struct stats_trace {
+    struct stats_trace_event events[STATS_TRACE_EVENTS];
+    volatile int32_t count;     /* events recorded since startup */
+};
+
+void stats_trace_add(struct stats_trace *trace, int event, int32_t arg0,
+                     int32_t arg1);
+void stats_trace_dump(struct stats_trace *trace, int fd,
+                      const char *const *formats, int num_formats);
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_capture_fx"
+/*#define LOG_NDEBUG 0*/
+
+#include <math.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "capture_fx.h"
+
+/* the gate opens above about -48 dBFS and closes to about -30 dB */
+#define CAPTURE_FX_GATE_OPEN    130
+#define CAPTURE_FX_GATE_FLOOR   1036
+#define CAPTURE_FX_GATE_HOLD_MS 200
+
+/* second order Butterworth high pass, from the RBJ audio EQ cookbook */
+static void capture_fx_design_hpf(struct biquad *bq, uint32_t rate, uint32_t hz)
+{
+    float w0 = 2.0f * (float)M_PI * hz / rate;
+    float alpha = sinf(w0) / (2.0f * (float)M_SQRT1_2);
+    float cosw0 = cosf(w0);
+    float a0 = 1.0f + alpha;
+
+    bq->b0 = (1.0f + cosw0) / 2.0f / a0;
+    bq->b1 = -(1.0f + cosw0) / a0;
+    bq->b2 = bq->b0;
+    bq->a1 = -2.0f * cosw0 / a0;
+    bq->a2 = (1.0f - alpha) / a0;
+}
+
+void capture_fx_init(struct capture_fx *fx, uint32_t rate, uint32_t channels)
+{
+    memset(fx, 0, sizeof(*fx));
+    fx->rate = rate;
+    fx->channels = channels;
+    fx->gain = GAIN_Q12_UNITY;
+    fx->gate_hold_max = rate * CAPTURE_FX_GATE_HOLD_MS / 1000;
+    capture_fx_design_hpf(&fx->hpf, rate, CAPTURE_FX_HPF_HZ);
+    capture_fx_reset(fx);
+}
+
+void capture_fx_reset(struct capture_fx *fx)
+{
+    memset(fx->hpf.z1, 0, sizeof(fx->hpf.z1));
+    memset(fx->hpf.z2, 0, sizeof(fx->hpf.z2));
+    /* start closed so that noise before the first word is not let through */
+    fx->gate_gain = CAPTURE_FX_GATE_FLOOR;
+    fx->gate_hold = 0;
+}
+
+void capture_fx_set_gain_db(struct capture_fx *fx, int gain_db)
+{
+    if (gain_db < 0)
+        gain_db = 0;
+    else if (gain_db > CAPTURE_FX_MAX_GAIN_DB)
+        gain_db = CAPTURE_FX_MAX_GAIN_DB;
+
+    fx->gain_db = gain_db;
+    fx->gain = (int16_t)lrintf(GAIN_Q12_UNITY * powf(10.0f, gain_db / 20.0f));
+    capture_fx_enable(fx, CAPTURE_FX_GAIN, gain_db != 0);
+}
+
+void capture_fx_enable(struct capture_fx *fx, uint32_t effect, bool enable)
+{
+    if (enable == !!(fx->enabled & effect))
+        return;
+
+    if (enable)
+        fx->enabled |= effect;
+    else
+        fx->enabled &= ~effect;
+
+    /* no stale history when an effect comes back */
+    capture_fx_reset(fx);
+}
+
+static void capture_fx_gate(struct capture_fx *fx, int16_t *buffer, size_t frames)
+{
+    int16_t peak = peak_abs_i16(buffer, frames * fx->channels);
+    int16_t target;
+    int16_t start[2], end[2];
+
+    if (peak >= CAPTURE_FX_GATE_OPEN)
+        fx->gate_hold = fx->gate_hold_max;
+    else if (fx->gate_hold > frames)
+        fx->gate_hold -= frames;
+    else
+        fx->gate_hold = 0;
+
+    target = fx->gate_hold ? GAIN_Q15_UNITY : CAPTURE_FX_GATE_FLOOR;
+    if (target == GAIN_Q15_UNITY && fx->gate_gain != GAIN_Q15_UNITY)
+        fx->gate_opened++;
+
+    /* open and close over one buffer, a ramp instead of a click */
+    if (fx->channels == 2) {
+        start[0] = start[1] = fx->gate_gain;
+        end[0] = end[1] = target;
+        gain_ramp_stereo_q15(buffer, frames, start, end);
+    } else {
+        gain_ramp_mono_q15(buffer, frames, fx->gate_gain, target);
+    }
+    fx->gate_gain = target;
+}
+
+void capture_fx_process(struct capture_fx *fx, int16_t *buffer, size_t frames,
+                        uint32_t allowed)
+{
+    uint32_t active = fx->enabled & allowed;
+
+    if (!active || frames == 0)
+        return;
+
+    if (active & CAPTURE_FX_HPF)
+        biquad_i16(&fx->hpf, buffer, frames, fx->channels);
+    if (active & CAPTURE_FX_GAIN)
+        gain_q12(buffer, frames * fx->channels, fx->gain);
+    /* after the gain, the gate sees the level the client gets */
+    if (active & CAPTURE_FX_GATE)
+        capture_fx_gate(fx, buffer, frames);
+}
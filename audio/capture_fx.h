@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CAPTURE_FX_H
+#define CAPTURE_FX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "audio_kernels.h"
+
+/*
+ * Capture preprocessing run by in_read() in place on the client buffer, so
+ * it costs no copy and no thread hop unlike RecordThread effects, and it
+ * covers the routes the eS325 does not process.
+ */
+#define CAPTURE_FX_HPF      (1 << 0)    /* removes DC and rumble */
+#define CAPTURE_FX_GAIN     (1 << 1)
+#define CAPTURE_FX_GATE     (1 << 2)    /* attenuates the signal between words */
+#define CAPTURE_FX_ALL      (CAPTURE_FX_HPF | CAPTURE_FX_GAIN | CAPTURE_FX_GATE)
+
+#define CAPTURE_FX_HPF_HZ       100
+#define CAPTURE_FX_MAX_GAIN_DB  18
+
+struct capture_fx {
+    uint32_t enabled;           /* CAPTURE_FX_* */
+    uint32_t rate;
+    uint32_t channels;
+
+    struct biquad hpf;
+    int gain_db;
+    int16_t gain;               /* q12 */
+
+    int16_t gate_gain;          /* q15, at the end of the last buffer */
+    uint32_t gate_hold;         /* frames left before the gate closes */
+    uint32_t gate_hold_max;
+    uint32_t gate_opened;       /* closed to open transitions */
+};
+
+void capture_fx_init(struct capture_fx *fx, uint32_t rate, uint32_t channels);
+
+/* clamped to [0, CAPTURE_FX_MAX_GAIN_DB], 0 disables the gain */
+void capture_fx_set_gain_db(struct capture_fx *fx, int gain_db);
+void capture_fx_enable(struct capture_fx *fx, uint32_t effect, bool enable);
+
+/*
+ * Run the enabled effects that are also in 'allowed' on interleaved 16 bit
+ * frames. The filter and gate state is kept across calls; call
+ * capture_fx_reset() when the stream restarts.
+ */
+void capture_fx_process(struct capture_fx *fx, int16_t *buffer, size_t frames,
+                        uint32_t allowed);
+void capture_fx_reset(struct capture_fx *fx);
+
+#endif
@@ -16,6 +16,8 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define LOG_TAG "eS325VoiceProcessing"
 //#define LOG_NDEBUG 0
@@ -112,7 +114,9 @@ int Adnc_SleepInt_l();
 // eS325 control
 //------------------------------------------------------------------------------
 /* TODO: figure out how to use VEQ mode */
+#ifndef ES325_SYSFS_PATH
 #define ES325_SYSFS_PATH "/sys/class/2mic/es325/"
+#endif
 #define ES325_VOICE_PROCESSING_PATH ES325_SYSFS_PATH "voice_processing"
 #define ES325_VEQ_PATH              ES325_SYSFS_PATH "veq"
 #define ES325_PRESET_PATH           ES325_SYSFS_PATH "preset"
@@ -0,0 +1,227 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_echo_ref"
+/*#define LOG_NDEBUG 0*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/atomic.h>
+#include <cutils/log.h>
+
+#include "echo_ref.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+/* a stale writer position is not worth aligning on */
+#define ECHO_REF_MAX_SKEW_NS (10 * NSEC_PER_SEC)
+
+/* signal below about -50 dBFS is too weak to correlate */
+#define ECHO_DELAY_MIN_LEVEL 100
+
+struct echo_ref *echo_ref_create(uint32_t rate, uint32_t channels, size_t frames)
+{
+    struct echo_ref *ref;
+
+    ref = (struct echo_ref *)calloc(1, sizeof(struct echo_ref));
+    if (!ref)
+        return NULL;
+
+    ref->buffer = malloc(frames * channels * sizeof(int16_t));
+    if (!ref->buffer) {
+        free(ref);
+        return NULL;
+    }
+
+    ref->rate = rate;
+    ref->channels = channels;
+    audio_utils_fifo_init(&ref->fifo, frames, channels * sizeof(int16_t),
+                          ref->buffer);
+
+    return ref;
+}
+
+void echo_ref_release(struct echo_ref *ref)
+{
+    audio_utils_fifo_deinit(&ref->fifo);
+    free(ref->buffer);
+    free(ref);
+}
+
+void echo_ref_write(struct echo_ref *ref, const int16_t *buffer, size_t frames,
+                    int64_t next_ns)
+{
+    ssize_t written;
+
+    /* frames that do not fit are lost, the reader realigns on next_ns */
+    written = audio_utils_fifo_write(&ref->fifo, buffer, frames);
+    if (written < (ssize_t)frames)
+        android_atomic_inc(&ref->overflows);
+    if (written < 0)
+        written = 0;
+
+    android_atomic_inc(&ref->seq);
+    android_memory_barrier();
+    ref->written += written;
+    ref->next_ns = next_ns;
+    android_atomic_inc(&ref->seq);
+}
+
+static void echo_ref_get_position(struct echo_ref *ref, int64_t *written,
+                                  int64_t *next_ns)
+{
+    int32_t seq;
+
+    do {
+        seq = android_atomic_acquire_load(&ref->seq);
+        *written = ref->written;
+        *next_ns = ref->next_ns;
+        android_memory_barrier();
+    } while ((seq & 1) || seq != ref->seq);
+}
+
+size_t echo_ref_read(struct echo_ref *ref, int16_t *buffer, size_t frames,
+                     int64_t first_ns)
+{
+    size_t frame_size = ref->channels * sizeof(int16_t);
+    int64_t written;
+    int64_t next_ns;
+    int64_t skew;
+    int64_t target;
+    size_t pad = 0;
+    size_t chunk;
+    ssize_t ret;
+
+    echo_ref_get_position(ref, &written, &next_ns);
+
+    /* index of the frame that was playing when first_ns was captured */
+    skew = next_ns - first_ns;
+    if (skew > ECHO_REF_MAX_SKEW_NS)
+        skew = ECHO_REF_MAX_SKEW_NS;
+    else if (skew < -ECHO_REF_MAX_SKEW_NS)
+        skew = -ECHO_REF_MAX_SKEW_NS;
+    target = written - skew * ref->rate / NSEC_PER_SEC;
+
+    /* frames played before the capture cannot be in it, drop them */
+    while (ref->read < target) {
+        chunk = (target - ref->read > (int64_t)frames) ?
+                frames : (size_t)(target - ref->read);
+        ret = audio_utils_fifo_read(&ref->fifo, buffer, chunk);
+        if (ret <= 0)
+            break;
+        ref->read += ret;
+    }
+
+    /* the reference is ahead of the capture, delay it with silence */
+    if (ref->read > target) {
+        pad = (ref->read - target > (int64_t)frames) ?
+                frames : (size_t)(ref->read - target);
+        memset(buffer, 0, pad * frame_size);
+    }
+
+    ret = audio_utils_fifo_read(&ref->fifo,
+                                (char *)buffer + pad * frame_size,
+                                frames - pad);
+    if (ret < 0)
+        ret = 0;
+    ref->read += ret;
+
+    /* nothing was rendered for the end of the capture */
+    if (pad + (size_t)ret < frames)
+        memset((char *)buffer + (pad + ret) * frame_size, 0,
+               (frames - pad - ret) * frame_size);
+
+    return frames - ret;
+}
+
+void echo_delay_init(struct echo_delay *delay)
+{
+    memset(delay, 0, sizeof(struct echo_delay));
+    delay->delay_us = -1;
+}
+
+static void echo_delay_estimate(struct echo_delay *delay, uint32_t rate)
+{
+    const int16_t *ref = delay->ref + ECHO_DELAY_MAX_LAG;
+    int64_t ref_energy = 0;
+    int64_t cap_energy = 0;
+    int64_t min_energy;
+    int64_t corr;
+    int64_t best_corr = 0;
+    int best_lag = -1;
+    int32_t delay_us;
+    int lag;
+    int i;
+
+    for (i = 0; i < ECHO_DELAY_BLOCK; i++) {
+        ref_energy += (int32_t)ref[i] * ref[i];
+        cap_energy += (int32_t)delay->cap[i] * delay->cap[i];
+    }
+    min_energy = (int64_t)ECHO_DELAY_BLOCK * ECHO_DELAY_MIN_LEVEL *
+            ECHO_DELAY_MIN_LEVEL;
+    if (ref_energy < min_energy || cap_energy < min_energy)
+        return;
+
+    for (lag = 0; lag < ECHO_DELAY_MAX_LAG; lag++) {
+        corr = 0;
+        for (i = 0; i < ECHO_DELAY_BLOCK; i++)
+            corr += (int32_t)delay->cap[i] * ref[i - lag];
+        /* the speaker may invert the polarity */
+        if (corr < 0)
+            corr = -corr;
+        if (corr > best_corr) {
+            best_corr = corr;
+            best_lag = lag;
+        }
+    }
+    if (best_lag < 0)
+        return;
+
+    delay_us = (int32_t)((int64_t)best_lag * 1000000 / rate);
+    if (delay->delay_us < 0)
+        delay->delay_us = delay_us;
+    else
+        delay->delay_us = (delay->delay_us * 3 + delay_us) / 4;
+
+    ALOGV("%s: lag %d us, estimate %d us", __func__, delay_us, delay->delay_us);
+}
+
+int32_t echo_delay_update(struct echo_delay *delay, const int16_t *capture,
+                          uint32_t channels, const int16_t *reference,
+                          size_t frames, uint32_t rate)
+{
+    uint32_t step = (rate > ECHO_DELAY_RATE) ? rate / ECHO_DELAY_RATE : 1;
+    size_t i;
+
+    for (i = 0; i < frames; i++) {
+        if (++delay->phase < step)
+            continue;
+        delay->phase = 0;
+
+        delay->ref[ECHO_DELAY_MAX_LAG + delay->filled] = reference[i];
+        delay->cap[delay->filled] = capture[i * channels];
+        if (++delay->filled < ECHO_DELAY_BLOCK)
+            continue;
+
+        echo_delay_estimate(delay, rate / step);
+        memmove(delay->ref, delay->ref + ECHO_DELAY_BLOCK,
+                ECHO_DELAY_MAX_LAG * sizeof(int16_t));
+        delay->filled = 0;
+    }
+
+    return delay->delay_us;
+}
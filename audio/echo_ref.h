@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ECHO_REF_H
+#define ECHO_REF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <audio_utils/fifo.h>
+
+/*
+ * Echo reference for a software AEC.
+ *
+ * The playback mixer writes every period it renders together with the time
+ * the frame following it will be presented. A capture stream reads the
+ * frames that were presented when its own frames were sampled. There is one
+ * writer and one reader and neither ever blocks: frames go through a
+ * single-producer single-consumer fifo and the write position is published
+ * with a sequence counter.
+ */
+struct echo_ref {
+    struct audio_utils_fifo fifo;
+    int16_t *buffer;
+    uint32_t rate;
+    uint32_t channels;
+
+    /* writer position, odd seq while it is being updated */
+    volatile int32_t seq;
+    volatile int64_t written;   /* frames written to the fifo */
+    volatile int64_t next_ns;   /* CLOCK_MONOTONIC time frame 'written' plays */
+
+    int64_t read;               /* frames read from the fifo, reader only */
+    volatile int32_t overflows; /* writes that did not fit in the fifo */
+};
+
+struct echo_ref *echo_ref_create(uint32_t rate, uint32_t channels, size_t frames);
+void echo_ref_release(struct echo_ref *ref);
+
+/* writer side, next_ns is the presentation time of the frame after buffer */
+void echo_ref_write(struct echo_ref *ref, const int16_t *buffer, size_t frames,
+                    int64_t next_ns);
+
+/*
+ * Reader side, fills buffer with the frames presented from first_ns on.
+ * Frames that were not rendered, or that are not available yet, read as
+ * silence. Returns the number of frames filled with silence.
+ */
+size_t echo_ref_read(struct echo_ref *ref, int16_t *buffer, size_t frames,
+                     int64_t first_ns);
+
+/*
+ * Echo delay measurement: cross-correlates the captured signal with the
+ * aligned reference, both decimated to about ECHO_DELAY_RATE, and tracks the
+ * lag of the strongest echo. This is what is left once the reference has
+ * been aligned on timestamps: the acoustic path plus whatever the
+ * timestamps do not account for.
+ */
+#define ECHO_DELAY_RATE 8000
+#define ECHO_DELAY_MAX_MS 64
+#define ECHO_DELAY_MAX_LAG (ECHO_DELAY_RATE * ECHO_DELAY_MAX_MS / 1000)
+#define ECHO_DELAY_BLOCK 256
+
+struct echo_delay {
+    int16_t ref[ECHO_DELAY_MAX_LAG + ECHO_DELAY_BLOCK]; /* oldest first */
+    int16_t cap[ECHO_DELAY_BLOCK];
+    size_t filled;              /* decimated frames of the current block */
+    uint32_t phase;             /* decimation phase */
+    int32_t delay_us;           /* smoothed estimate, -1 until the first one */
+};
+
+void echo_delay_init(struct echo_delay *delay);
+
+/*
+ * Feed frames of capture (the first of 'channels' interleaved channels) and
+ * mono reference at 'rate'. Returns the current estimate in microseconds,
+ * or -1 while there has not been enough signal.
+ */
+int32_t echo_delay_update(struct echo_delay *delay, const int16_t *capture,
+                          uint32_t channels, const int16_t *reference,
+                          size_t frames, uint32_t rate);
+
+#endif
@@ -0,0 +1,1401 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host benchmark of audio_hw. The HAL runs on the stand-ins of fake_alsa.h,
+ * fake_audio_route.c and the fake libsecril-client, and is driven the way
+ * AudioFlinger drives it:
+ *
+ *   fast     a FAST output writing one period per call, like the FastMixer
+ *   routing  the FAST output and a capture while the routing of both
+ *            streams changes every 100 ms from another thread, like the
+ *            set_parameters() calls of the AudioPolicyService
+ *   call     the FAST output while a call is set up and torn down every
+ *            500 ms
+ *   mmap     the FAST output with audio.mmap_output set, which the HAL
+ *            plays through the mmap/no-irq pcm. Fails unless that pcm is
+ *            opened, underruns no more than -u times, the presentation
+ *            position advances and the queue stays within out_get_latency()
+ *   mmap_no_rt  the mmap test in a child process that may not use
+ *            SCHED_FIFO. Fails unless the FAST output is opened on the
+ *            low latency pcm instead and keeps up with real time
+ *   cadence  a deep buffer output joined by the FAST output after 1 s. Fails
+ *            unless the pcm runs deep buffer periods before and low latency
+ *            ones after, and the deep buffer position keeps in step with
+ *            its time across the switch
+ *   capture  a capture whose pcm fails to read for 300 ms every second.
+ *            Fails unless the frames lost are about the time the pcm
+ *            failed, and the capture position keeps in step with its time
+ *   capture_rates  a 16 kHz capture joined by a 48 kHz one after 1 s. Fails
+ *            unless the pcm runs at 16 kHz and then at 48 kHz, and the
+ *            position of the first capture keeps in step with its time
+ *   stress   a FAST and a deep buffer output and a capture, while other
+ *            threads change the routing and input source, set up and tear
+ *            down calls, put the streams in standby and query parameters,
+ *            positions and the dump, all as fast as they can. Fails, and
+ *            exits at once, if any thread makes no progress for 5 s. Fails
+ *            if routing or standby waits more than 20 ms for an output
+ *            stream with the hw device mutex held
+ *
+ * Each test opens the HAL again and reports the latency of the calls
+ * (median and tail), the playback throughput against real time, the
+ * underruns of the fake pcm, the mixer control writes and the contention
+ * of the hw device mutex from adev_dump().
+ *
+ * usage: audio_hw_bench [-d seconds] [-c ctl_write_us] [-r ril_delay_us]
+ *                       [-w wakeup_us] [-u underruns] [-t mixer_paths.bin]
+ *                       [-v] [test...]
+ *
+ * The mmap pcm keeps 4 ms queued, a host whose SCHED_FIFO wakeups run 2 ms
+ * late underruns it whatever the HAL does; -u allows for that.
+ *
+ * Without -t, or with a table that does not load, audio_hw falls back to
+ * audio_route, whose stand-in writes one control per path.
+ */
+
+#define LOG_TAG "audio_hw_bench"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/capability.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/properties.h>
+
+#include <hardware/audio.h>
+#include <hardware/hardware.h>
+
+#include <system/audio.h>
+
+#include "fake_alsa.h"
+
+#define PCM_DEVICE 0
+#define PCM_DEVICE_IN 3
+
+#define DEFAULT_DURATION_S 5
+#define DEFAULT_CTL_WRITE_US 100
+#define DEFAULT_RIL_DELAY_US 2000
+
+#define ROUTING_INTERVAL_MS 100
+#define CALL_INTERVAL_MS 500
+#define POSITION_INTERVAL_MS 10
+
+/* the cadence test plays the deep buffer output alone this long */
+#define CADENCE_DEEP_MS 1000
+/* largest difference between the time and the frames of two deep buffer
+ * positions across the switch, the frames it may skip */
+#define CADENCE_JUMP_US 10000
+/* most the pcm may hold while the FAST output plays */
+#define CADENCE_FAST_QUEUE_MS 10
+
+/* the capture test fails the pcm this long every second */
+#define CAPTURE_STALL_MS 300
+/* largest difference between the time and the frames of two capture
+ * positions, the rounding of the lost frames to the client rate */
+#define CAPTURE_DRIFT_US 1000
+
+/* the capture_rates test starts at this rate, then adds a 48 kHz capture */
+#define CAPTURE_LOW_RATE 16000
+
+/* a thread of the stress test blocked this long is taken as deadlocked */
+#define STRESS_STALL_MS 5000
+/* longest a routing or standby call of the stress test may wait for an
+ * output stream with the hw device mutex held: a writer sleeping on the
+ * mixer with its stream mutex held makes it a deep buffer period or more */
+#define STRESS_OUTPUT_WAIT_MS 20
+#define WATCHDOG_INTERVAL_MS 100
+
+#define MMAP_OUTPUT_PROPERTY "audio.mmap_output"
+
+/* es325 sysfs files eS325VoiceProcessing.cpp writes */
+static const char *es325_files[] = {
+    "voice_processing", "veq", "preset", "tx_ns_level", "tx_agc_enable",
+    "aec_enable", "sleep",
+};
+
+extern struct audio_module HAL_MODULE_INFO_SYM;
+
+struct latency {
+    int64_t *ns;
+    size_t count;
+    size_t size;
+};
+
+struct bench {
+    audio_hw_device_t *dev;
+    unsigned int duration_s;
+    unsigned int ctl_write_us;
+    unsigned int underruns;     /* allowed to the mmap pcm */
+    bool verbose;
+    volatile bool stop;
+};
+
+/* a stream driven by its own thread, the writer or reader of a test */
+struct bench_stream {
+    struct bench *bench;
+    struct audio_stream_out *out;
+    struct audio_stream_in *in;
+    pthread_t thread;
+    struct latency latency;
+    volatile uint64_t frames;   /* read by the mmap test while writing */
+    unsigned int rate;
+    unsigned int errors;
+};
+
+/* a control thread of the stress test */
+struct stress_thread {
+    struct bench *bench;
+    struct bench_stream *fast;
+    struct bench_stream *deep;
+    struct bench_stream *in;
+    const char *name;
+    pthread_t thread;
+    volatile uint64_t calls;
+};
+
+/* a counter the stress test watchdog expects to move */
+struct stress_progress {
+    const char *name;
+    volatile uint64_t *counter;
+    uint64_t last;
+    int64_t last_ns;
+};
+
+struct bench_test {
+    const char *name;
+    int (*run)(struct bench *bench);
+    bool mmap_output;           /* open the HAL with MMAP_OUTPUT_PROPERTY */
+    bool no_rt;                 /* run in a child refused SCHED_FIFO */
+};
+
+static int64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_ms(unsigned int ms)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+}
+
+static void latency_add(struct latency *latency, int64_t ns)
+{
+    int64_t *samples;
+
+    if (latency->count == latency->size) {
+        samples = realloc(latency->ns,
+                          (latency->size * 2 + 1024) * sizeof(int64_t));
+        if (!samples)
+            return;
+        latency->ns = samples;
+        latency->size = latency->size * 2 + 1024;
+    }
+    latency->ns[latency->count++] = ns;
+}
+
+static int compare_ns(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+static int64_t latency_percentile(const struct latency *latency,
+                                  unsigned int per_mille)
+{
+    return latency->ns[(latency->count - 1) * per_mille / 1000];
+}
+
+/* sorts the samples, what is one of them is named by unit */
+static void latency_report(struct latency *latency, const char *name,
+                           const char *unit)
+{
+    if (latency->count == 0) {
+        printf("  %s: no %s\n", name, unit);
+        return;
+    }
+
+    qsort(latency->ns, latency->count, sizeof(int64_t), compare_ns);
+    printf("  %s: %zu %s, us p50 %lld, p99 %lld, p99.9 %lld, max %lld\n",
+           name, latency->count, unit,
+           (long long)latency_percentile(latency, 500) / 1000,
+           (long long)latency_percentile(latency, 990) / 1000,
+           (long long)latency_percentile(latency, 999) / 1000,
+           (long long)latency->ns[latency->count - 1] / 1000);
+}
+
+static void latency_free(struct latency *latency)
+{
+    free(latency->ns);
+    memset(latency, 0, sizeof(*latency));
+}
+
+static int make_dirs(const char *path)
+{
+    char dir[PATH_MAX];
+    char *p;
+
+    strncpy(dir, path, sizeof(dir) - 1);
+    dir[sizeof(dir) - 1] = '\0';
+    for (p = dir + 1; *p; p++) {
+        if (*p != '/')
+            continue;
+        *p = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+            return -errno;
+        *p = '/';
+    }
+    return 0;
+}
+
+static int copy_file(const char *from, const char *to)
+{
+    char buffer[4096];
+    ssize_t len;
+    int in, out;
+    int ret = 0;
+
+    in = open(from, O_RDONLY);
+    if (in < 0)
+        return -errno;
+    out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return -errno;
+    }
+    while ((len = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, len) != len) {
+            ret = -EIO;
+            break;
+        }
+    }
+    close(out);
+    close(in);
+    return ret;
+}
+
+/* the files audio_hw opens instead of /sys/class/2mic/es325 and /system/etc */
+static int setup_tree(const char *table)
+{
+    char path[PATH_MAX];
+    unsigned int i;
+    int fd;
+
+    if (make_dirs(ES325_SYSFS_PATH) != 0 || make_dirs(ROUTE_TABLE_PATH) != 0) {
+        fprintf(stderr, "cannot create %s\n", ES325_SYSFS_PATH);
+        return -1;
+    }
+
+    for (i = 0; i < sizeof(es325_files) / sizeof(es325_files[0]); i++) {
+        snprintf(path, sizeof(path), "%s%s", ES325_SYSFS_PATH, es325_files[i]);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "cannot create %s\n", path);
+            return -1;
+        }
+        close(fd);
+    }
+
+    unlink(ROUTE_TABLE_PATH);
+    if (table && copy_file(table, ROUTE_TABLE_PATH) != 0) {
+        fprintf(stderr, "cannot copy %s\n", table);
+        return -1;
+    }
+    return 0;
+}
+
+static int bench_open(struct bench *bench)
+{
+    hw_device_t *device;
+    int ret;
+
+    fake_pcm_reset_stats();
+    fake_mixer_reset_stats();
+    bench->stop = false;
+
+    ret = HAL_MODULE_INFO_SYM.common.methods->open(&HAL_MODULE_INFO_SYM.common,
+                                                   AUDIO_HARDWARE_INTERFACE,
+                                                   &device);
+    if (ret != 0) {
+        fprintf(stderr, "cannot open the HAL: %d\n", ret);
+        return ret;
+    }
+    bench->dev = (audio_hw_device_t *)device;
+    return 0;
+}
+
+/* print the hw device mutex lines of the dump, or all of it with -v */
+static void bench_dump(struct bench *bench)
+{
+    char line[1024];
+    bool mutex = false;
+    FILE *f = tmpfile();
+
+    if (!f)
+        return;
+
+    bench->dev->dump(bench->dev, fileno(f));
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        if (bench->verbose) {
+            fputs(line, stdout);
+            continue;
+        }
+        if (strstr(line, "hw device mutex"))
+            mutex = true;
+        else if (!strstr(line, "wait time"))
+            mutex = false;
+        if (mutex)
+            fputs(line, stdout);
+    }
+    fclose(f);
+}
+
+/* the longest wait of a dump histogram, -1 if it is not dumped */
+static long long bench_dump_max_us(struct bench *bench, const char *name)
+{
+    char line[1024];
+    const char *max;
+    long long us = -1;
+    FILE *f = tmpfile();
+
+    if (!f)
+        return -1;
+
+    bench->dev->dump(bench->dev, fileno(f));
+    rewind(f);
+    while (fgets(line, sizeof(line), f)) {
+        max = strstr(line, " max:");
+        if (strstr(line, name) && max) {
+            us = atoll(max + strlen(" max:"));
+            break;
+        }
+    }
+    fclose(f);
+    return us;
+}
+
+static void bench_close(struct bench *bench)
+{
+    struct fake_mixer_stats mixer;
+
+    fake_mixer_get_stats(&mixer);
+    printf("  mixer: %u controls written %u times, %llu ms of I2C\n",
+           mixer.ctls, mixer.writes, (unsigned long long)mixer.cost_us / 1000);
+    bench_dump(bench);
+
+    bench->dev->common.close(&bench->dev->common);
+    bench->dev = NULL;
+}
+
+static int open_output(struct bench *bench, audio_output_flags_t flags,
+                       struct bench_stream *stream)
+{
+    struct audio_config config;
+    int ret;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->bench = bench;
+    stream->rate = 48000;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = 48000;
+    config.channel_mask = AUDIO_CHANNEL_OUT_STEREO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    ret = bench->dev->open_output_stream(bench->dev, 1, AUDIO_DEVICE_OUT_SPEAKER,
+                                         flags, &config, &stream->out);
+    if (ret != 0)
+        fprintf(stderr, "cannot open output %#x: %d\n", flags, ret);
+    return ret;
+}
+
+static int open_input(struct bench *bench, unsigned int rate,
+                      struct bench_stream *stream)
+{
+    struct audio_config config;
+    int ret;
+
+    memset(stream, 0, sizeof(*stream));
+    stream->bench = bench;
+    stream->rate = rate;
+
+    memset(&config, 0, sizeof(config));
+    config.sample_rate = rate;
+    config.channel_mask = AUDIO_CHANNEL_IN_MONO;
+    config.format = AUDIO_FORMAT_PCM_16_BIT;
+    ret = bench->dev->open_input_stream(bench->dev, 2,
+                                        AUDIO_DEVICE_IN_BUILTIN_MIC,
+                                        &config, &stream->in);
+    if (ret != 0)
+        fprintf(stderr, "cannot open input: %d\n", ret);
+    return ret;
+}
+
+static void *writer_thread(void *context)
+{
+    struct bench_stream *stream = context;
+    struct audio_stream_out *out = stream->out;
+    size_t bytes = out->common.get_buffer_size(&out->common);
+    size_t frame_size = sizeof(int16_t) * 2;
+    void *buffer = calloc(1, bytes);
+    ssize_t ret;
+    int64_t start;
+
+    if (!buffer)
+        return NULL;
+
+    while (!stream->bench->stop) {
+        start = now_ns();
+        ret = out->write(out, buffer, bytes);
+        latency_add(&stream->latency, now_ns() - start);
+        if (ret < 0)
+            stream->errors++;
+        else
+            stream->frames += ret / frame_size;
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static void *reader_thread(void *context)
+{
+    struct bench_stream *stream = context;
+    struct audio_stream_in *in = stream->in;
+    size_t bytes = in->common.get_buffer_size(&in->common);
+    void *buffer = calloc(1, bytes);
+    ssize_t ret;
+    int64_t start;
+
+    if (!buffer)
+        return NULL;
+
+    while (!stream->bench->stop) {
+        start = now_ns();
+        ret = in->read(in, buffer, bytes);
+        latency_add(&stream->latency, now_ns() - start);
+        if (ret < 0)
+            stream->errors++;
+        else
+            stream->frames += ret / sizeof(int16_t);
+    }
+
+    free(buffer);
+    return NULL;
+}
+
+static int start_stream(struct bench_stream *stream, void *(*thread)(void *))
+{
+    if (pthread_create(&stream->thread, NULL, thread, stream) != 0) {
+        fprintf(stderr, "cannot create stream thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* join the thread of stream, report it and close the stream */
+static void stop_stream(struct bench_stream *stream, const char *name,
+                        int64_t elapsed_ns)
+{
+    struct bench *bench = stream->bench;
+    struct fake_pcm_stats stats;
+
+    pthread_join(stream->thread, NULL);
+    latency_report(&stream->latency, name, "calls");
+    printf("  %s: %.3f x real time, %u errors\n", name,
+           (double)stream->frames * 1000000000.0 / elapsed_ns / stream->rate,
+           stream->errors);
+    latency_free(&stream->latency);
+
+    if (stream->out) {
+        if (fake_pcm_get_stats(PCM_DEVICE, false, &stats))
+            printf("  playback pcm: %u opens, %u underruns\n", stats.opens,
+                   stats.xruns);
+        bench->dev->close_output_stream(bench->dev, stream->out);
+    } else {
+        bench->dev->close_input_stream(bench->dev, stream->in);
+    }
+}
+
+static int test_fast(struct bench *bench)
+{
+    struct bench_stream writer;
+    int64_t start;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &writer) != 0)
+        return -1;
+
+    start = now_ns();
+    if (start_stream(&writer, writer_thread) != 0)
+        return -1;
+    sleep_ms(bench->duration_s * 1000);
+    bench->stop = true;
+    stop_stream(&writer, "write", now_ns() - start);
+    return 0;
+}
+
+static int test_routing(struct bench *bench)
+{
+    static const audio_devices_t out_devices[] = {
+        AUDIO_DEVICE_OUT_SPEAKER, AUDIO_DEVICE_OUT_WIRED_HEADPHONE,
+    };
+    static const audio_devices_t in_devices[] = {
+        AUDIO_DEVICE_IN_BUILTIN_MIC, AUDIO_DEVICE_IN_BACK_MIC,
+    };
+    struct bench_stream writer, reader;
+    struct latency out_routing, in_routing;
+    char kvpairs[64];
+    int64_t start, end, call;
+    unsigned int i;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &writer) != 0)
+        return -1;
+    if (open_input(bench, 48000, &reader) != 0) {
+        bench->dev->close_output_stream(bench->dev, writer.out);
+        return -1;
+    }
+    memset(&out_routing, 0, sizeof(out_routing));
+    memset(&in_routing, 0, sizeof(in_routing));
+
+    start = now_ns();
+    end = start + bench->duration_s * 1000000000LL;
+    if (start_stream(&writer, writer_thread) != 0 ||
+            start_stream(&reader, reader_thread) != 0)
+        return -1;
+
+    for (i = 1; now_ns() < end; i++) {
+        sleep_ms(ROUTING_INTERVAL_MS);
+
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                 out_devices[i % 2]);
+        call = now_ns();
+        writer.out->common.set_parameters(&writer.out->common, kvpairs);
+        latency_add(&out_routing, now_ns() - call);
+
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d", AUDIO_PARAMETER_STREAM_ROUTING,
+                 in_devices[i % 2]);
+        call = now_ns();
+        reader.in->common.set_parameters(&reader.in->common, kvpairs);
+        latency_add(&in_routing, now_ns() - call);
+    }
+
+    bench->stop = true;
+    stop_stream(&writer, "write", now_ns() - start);
+    stop_stream(&reader, "read", now_ns() - start);
+    latency_report(&out_routing, "output routing", "calls");
+    latency_report(&in_routing, "input routing", "calls");
+    latency_free(&out_routing);
+    latency_free(&in_routing);
+    return 0;
+}
+
+static int test_call(struct bench *bench)
+{
+    struct bench_stream writer;
+    struct latency setup, teardown;
+    int64_t start, end, call;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &writer) != 0)
+        return -1;
+    memset(&setup, 0, sizeof(setup));
+    memset(&teardown, 0, sizeof(teardown));
+
+    start = now_ns();
+    end = start + bench->duration_s * 1000000000LL;
+    if (start_stream(&writer, writer_thread) != 0)
+        return -1;
+
+    while (now_ns() < end) {
+        sleep_ms(CALL_INTERVAL_MS);
+        call = now_ns();
+        bench->dev->set_mode(bench->dev, AUDIO_MODE_IN_CALL);
+        latency_add(&setup, now_ns() - call);
+
+        sleep_ms(CALL_INTERVAL_MS);
+        call = now_ns();
+        bench->dev->set_mode(bench->dev, AUDIO_MODE_NORMAL);
+        latency_add(&teardown, now_ns() - call);
+    }
+
+    bench->stop = true;
+    stop_stream(&writer, "write", now_ns() - start);
+    latency_report(&setup, "call setup", "calls");
+    latency_report(&teardown, "call teardown", "calls");
+    latency_free(&setup);
+    latency_free(&teardown);
+    return 0;
+}
+
+static int test_mmap_no_rt(struct bench *bench)
+{
+    struct bench_stream writer;
+    struct fake_pcm_stats stats;
+    uint32_t latency_ms;
+    int64_t start, elapsed;
+    double speed;
+    int ret = 0;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &writer) != 0)
+        return -1;
+    latency_ms = writer.out->get_latency(writer.out);
+
+    start = now_ns();
+    if (start_stream(&writer, writer_thread) != 0)
+        return -1;
+    sleep_ms(bench->duration_s * 1000);
+    bench->stop = true;
+    elapsed = now_ns() - start;
+    stop_stream(&writer, "write", elapsed);
+    speed = (double)writer.frames * 1000000000.0 / elapsed / 48000;
+
+    if (!fake_pcm_get_stats(PCM_DEVICE, false, &stats)) {
+        printf("  no playback pcm opened\n");
+        return -1;
+    }
+
+    printf("  pcm: flags %#x, %u frames periods, %u periods\n",
+           stats.open_flags, stats.config.period_size,
+           stats.config.period_count);
+    printf("  latency: %u ms reported\n", latency_ms);
+    if (stats.open_flags & PCM_MMAP) {
+        printf("  the output uses the mmap pcm without SCHED_FIFO\n");
+        ret = -1;
+    }
+    if (speed < 0.95) {
+        printf("  the output did not keep up with real time\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+static int test_cadence(struct bench *bench)
+{
+    struct bench_stream deep, fast;
+    struct fake_pcm_stats deep_stats, fast_stats;
+    struct timespec ts0, ts;
+    uint64_t presented0, presented;
+    int64_t start, jump_us;
+    bool ok;
+    int ret = 0;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_DEEP_BUFFER, &deep) != 0)
+        return -1;
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &fast) != 0) {
+        bench->dev->close_output_stream(bench->dev, deep.out);
+        return -1;
+    }
+
+    start = now_ns();
+    if (start_stream(&deep, writer_thread) != 0)
+        return -1;
+    sleep_ms(CADENCE_DEEP_MS);
+    ok = fake_pcm_get_stats(PCM_DEVICE, false, &deep_stats) &&
+            deep.out->get_presentation_position(deep.out, &presented0,
+                                                &ts0) == 0;
+
+    if (start_stream(&fast, writer_thread) != 0)
+        return -1;
+    sleep_ms(ROUTING_INTERVAL_MS);
+    ok = ok && fake_pcm_get_stats(PCM_DEVICE, false, &fast_stats) &&
+            deep.out->get_presentation_position(deep.out, &presented,
+                                                &ts) == 0;
+
+    sleep_ms(bench->duration_s * 1000);
+    bench->stop = true;
+    stop_stream(&fast, "fast write", now_ns() - start);
+    stop_stream(&deep, "deep buffer write", now_ns() - start);
+    if (!ok) {
+        printf("  no playback pcm or position\n");
+        return -1;
+    }
+
+    jump_us = (int64_t)(presented - presented0) * 1000000 / 48000 -
+            ((ts.tv_sec - ts0.tv_sec) * 1000000LL +
+             (ts.tv_nsec - ts0.tv_nsec) / 1000);
+    printf("  pcm: %u frames periods, %u periods, then %u frames periods, "
+           "%u periods\n", deep_stats.config.period_size,
+           deep_stats.config.period_count, fast_stats.config.period_size,
+           fast_stats.config.period_count);
+    printf("  deep buffer position: %lld us ahead of its time\n",
+           (long long)jump_us);
+
+    if (deep_stats.config.period_size <= fast_stats.config.period_size) {
+        printf("  the pcm does not follow the active outputs\n");
+        ret = -1;
+    }
+    if (fast_stats.config.period_size * fast_stats.config.period_count >
+            48000 * CADENCE_FAST_QUEUE_MS / 1000) {
+        printf("  the low latency output plays behind a deep queue\n");
+        ret = -1;
+    }
+    if (jump_us > CADENCE_JUMP_US || jump_us < -CADENCE_JUMP_US) {
+        printf("  the deep buffer output lost frames across the switch\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+/* capture position of in, and the frames lost up to it */
+static int get_capture_position(struct audio_stream_in *in, int64_t *frames,
+                                int64_t *ns, int64_t *lost)
+{
+    char *str = in->common.get_parameters(&in->common,
+                                          "frames_lost;capture_position");
+    long long f, t, l;
+    char *lost_str, *position_str;
+    int ret = -1;
+
+    if (!str)
+        return -1;
+    lost_str = strstr(str, "frames_lost=");
+    position_str = strstr(str, "capture_position=");
+    if (lost_str && position_str &&
+            sscanf(lost_str, "frames_lost=%lld", &l) == 1 &&
+            sscanf(position_str, "capture_position=%lld,%lld", &f, &t) == 2) {
+        *frames = f;
+        *ns = t;
+        *lost = l;
+        ret = 0;
+    }
+    free(str);
+    return ret;
+}
+
+static int test_capture(struct bench *bench)
+{
+    struct bench_stream reader;
+    int64_t frames0, ns0, lost0;
+    int64_t frames, ns, lost;
+    int64_t start, end;
+    int64_t drift_us, lost_ms;
+    unsigned int stalls = 0;
+    int ret = 0;
+
+    if (open_input(bench, 48000, &reader) != 0)
+        return -1;
+
+    start = now_ns();
+    end = start + bench->duration_s * 1000000000LL;
+    if (start_stream(&reader, reader_thread) != 0)
+        return -1;
+
+    sleep_ms(1000);
+    if (get_capture_position(reader.in, &frames0, &ns0, &lost0) != 0) {
+        printf("  no capture position\n");
+        ret = -1;
+    }
+    while (ret == 0 && now_ns() < end) {
+        fake_pcm_fail_capture(CAPTURE_STALL_MS);
+        stalls++;
+        sleep_ms(1000);
+    }
+    if (ret == 0 && get_capture_position(reader.in, &frames, &ns, &lost) != 0) {
+        printf("  no capture position\n");
+        ret = -1;
+    }
+
+    bench->stop = true;
+    stop_stream(&reader, "read", now_ns() - start);
+    if (ret != 0)
+        return ret;
+
+    /* a position ahead of its time has frames counted twice */
+    drift_us = (ns - ns0) / 1000 - (frames - frames0) * 1000000 / 48000;
+    lost_ms = (lost - lost0) * 1000 / 48000;
+    printf("  capture: %u stalls of %d ms, %lld ms lost, position drift %lld us\n",
+           stalls, CAPTURE_STALL_MS, (long long)lost_ms, (long long)drift_us);
+    if (drift_us > CAPTURE_DRIFT_US || drift_us < -CAPTURE_DRIFT_US) {
+        printf("  the capture position drifted from its time\n");
+        ret = -1;
+    }
+    if (lost_ms < stalls * CAPTURE_STALL_MS ||
+            lost_ms > stalls * CAPTURE_STALL_MS * 3 / 2) {
+        printf("  the frames lost do not match the stalls\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+static int test_capture_rates(struct bench *bench)
+{
+    struct bench_stream low, high;
+    struct fake_pcm_stats low_stats, high_stats;
+    int64_t frames0, ns0, lost0;
+    int64_t frames, ns, lost;
+    int64_t start, drift_us;
+    bool ok;
+    int ret = 0;
+
+    if (open_input(bench, CAPTURE_LOW_RATE, &low) != 0)
+        return -1;
+    if (open_input(bench, 48000, &high) != 0) {
+        bench->dev->close_input_stream(bench->dev, low.in);
+        return -1;
+    }
+
+    start = now_ns();
+    if (start_stream(&low, reader_thread) != 0)
+        return -1;
+    sleep_ms(1000);
+    ok = fake_pcm_get_stats(PCM_DEVICE_IN, true, &low_stats) &&
+            get_capture_position(low.in, &frames0, &ns0, &lost0) == 0;
+
+    if (start_stream(&high, reader_thread) != 0)
+        return -1;
+    sleep_ms(bench->duration_s * 1000);
+    ok = ok && fake_pcm_get_stats(PCM_DEVICE_IN, true, &high_stats) &&
+            get_capture_position(low.in, &frames, &ns, &lost) == 0;
+
+    bench->stop = true;
+    stop_stream(&high, "48 kHz read", now_ns() - start);
+    stop_stream(&low, "16 kHz read", now_ns() - start);
+    if (!ok) {
+        printf("  no capture pcm or position\n");
+        return -1;
+    }
+
+    drift_us = (ns - ns0) / 1000 -
+            (frames - frames0) * 1000000 / CAPTURE_LOW_RATE;
+    printf("  pcm: %u Hz, then %u Hz in %u opens\n", low_stats.config.rate,
+           high_stats.config.rate, high_stats.opens);
+    printf("  16 kHz capture: %lld ms lost, position drift %lld us\n",
+           (long long)((lost - lost0) * 1000 / CAPTURE_LOW_RATE),
+           (long long)drift_us);
+    if (low_stats.config.rate != CAPTURE_LOW_RATE ||
+            high_stats.config.rate != 48000) {
+        printf("  the pcm does not run at the highest rate captured\n");
+        ret = -1;
+    }
+    if (drift_us > CAPTURE_DRIFT_US || drift_us < -CAPTURE_DRIFT_US) {
+        printf("  the capture position drifted from its time\n");
+        ret = -1;
+    }
+    return ret;
+}
+
+/*
+ * Frames written and not presented yet: the fifo of the output, the period
+ * the mixer thread holds and what is queued in the pcm.
+ */
+static int64_t output_queued_frames(struct bench_stream *writer,
+                                    uint64_t presented,
+                                    const struct timespec *ts)
+{
+    struct timespec now;
+    int64_t elapsed_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_ns = (now.tv_sec - ts->tv_sec) * 1000000000LL +
+            now.tv_nsec - ts->tv_nsec;
+    return (int64_t)writer->frames - (int64_t)presented -
+            elapsed_ns * 48000 / 1000000000LL;
+}
+
+static int test_mmap(struct bench *bench)
+{
+    struct bench_stream writer;
+    struct fake_pcm_stats stats;
+    struct latency queue;
+    struct timespec ts;
+    uint64_t presented, first = 0, last = 0;
+    int64_t start, end, queued;
+    uint32_t latency_ms;
+    unsigned int backwards = 0;
+    bool started = false;
+    int ret = 0;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &writer) != 0)
+        return -1;
+    latency_ms = writer.out->get_latency(writer.out);
+    memset(&queue, 0, sizeof(queue));
+
+    start = now_ns();
+    end = start + bench->duration_s * 1000000000LL;
+    if (start_stream(&writer, writer_thread) != 0)
+        return -1;
+
+    while (now_ns() < end) {
+        sleep_ms(POSITION_INTERVAL_MS);
+        if (writer.out->get_presentation_position(writer.out, &presented,
+                                                  &ts) != 0)
+            continue;
+        if (!started) {
+            first = presented;
+            started = true;
+        } else if (presented < last) {
+            backwards++;
+        }
+        last = presented;
+
+        queued = output_queued_frames(&writer, presented, &ts);
+        latency_add(&queue, queued * 1000000000LL / 48000);
+    }
+
+    if (!fake_pcm_get_stats(PCM_DEVICE, false, &stats)) {
+        printf("  no playback pcm opened\n");
+        ret = -1;
+    }
+
+    bench->stop = true;
+    stop_stream(&writer, "write", now_ns() - start);
+    if (ret != 0)
+        return ret;
+
+    printf("  pcm: flags %#x, %u frames periods, %u periods\n",
+           stats.open_flags, stats.config.period_size,
+           stats.config.period_count);
+    printf("  presented: %llu frames, went backwards %u times\n",
+           (unsigned long long)(last - first), backwards);
+    latency_report(&queue, "queued", "samples");
+    printf("  latency: %u ms reported\n", latency_ms);
+
+    if ((stats.open_flags & (PCM_MMAP | PCM_NOIRQ)) != (PCM_MMAP | PCM_NOIRQ)) {
+        printf("  the output does not use the mmap/no-irq pcm\n");
+        ret = -1;
+    }
+    if (stats.xruns > bench->underruns) {
+        printf("  the mmap pcm underran\n");
+        ret = -1;
+    }
+    /* the first position is taken once the pcm started */
+    if (backwards != 0 || last - first <
+            (uint64_t)(bench->duration_s * 48000) * 9 / 10 - 48000 / 10) {
+        printf("  the presentation position did not follow the DMA\n");
+        ret = -1;
+    }
+    /* sorted by latency_report(), the tail is left to the host scheduler */
+    if (queue.count == 0 ||
+            latency_percentile(&queue, 990) > latency_ms * 1000000LL) {
+        printf("  more queued than out_get_latency() reports\n");
+        ret = -1;
+    }
+    latency_free(&queue);
+    return ret;
+}
+
+static void *stress_routing_thread(void *context)
+{
+    static const audio_devices_t out_devices[] = {
+        AUDIO_DEVICE_OUT_SPEAKER, AUDIO_DEVICE_OUT_WIRED_HEADSET,
+        AUDIO_DEVICE_OUT_BLUETOOTH_SCO, AUDIO_DEVICE_OUT_EARPIECE,
+        AUDIO_DEVICE_OUT_WIRED_HEADPHONE,
+    };
+    static const audio_devices_t in_devices[] = {
+        AUDIO_DEVICE_IN_BUILTIN_MIC, AUDIO_DEVICE_IN_WIRED_HEADSET,
+        AUDIO_DEVICE_IN_BLUETOOTH_SCO_HEADSET, AUDIO_DEVICE_IN_BACK_MIC,
+    };
+    static const audio_source_t sources[] = {
+        AUDIO_SOURCE_MIC, AUDIO_SOURCE_VOICE_COMMUNICATION,
+        AUDIO_SOURCE_CAMCORDER, AUDIO_SOURCE_VOICE_RECOGNITION,
+    };
+    struct stress_thread *thread = context;
+    char kvpairs[64];
+    unsigned int i;
+
+    for (i = 0; !thread->bench->stop; i++) {
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d",
+                 AUDIO_PARAMETER_STREAM_ROUTING, out_devices[i % 5]);
+        thread->fast->out->common.set_parameters(&thread->fast->out->common,
+                                                 kvpairs);
+        thread->deep->out->common.set_parameters(&thread->deep->out->common,
+                                                 kvpairs);
+        snprintf(kvpairs, sizeof(kvpairs), "%s=%d;%s=%d",
+                 AUDIO_PARAMETER_STREAM_INPUT_SOURCE, sources[i % 4],
+                 AUDIO_PARAMETER_STREAM_ROUTING, in_devices[i % 4]);
+        thread->in->in->common.set_parameters(&thread->in->in->common,
+                                              kvpairs);
+        thread->calls++;
+        sleep_ms(1);
+    }
+    return NULL;
+}
+
+static void *stress_call_thread(void *context)
+{
+    struct stress_thread *thread = context;
+    audio_hw_device_t *dev = thread->bench->dev;
+    unsigned int i;
+
+    for (i = 0; !thread->bench->stop; i++) {
+        dev->set_mode(dev, (i & 1) ? AUDIO_MODE_NORMAL : AUDIO_MODE_IN_CALL);
+        dev->set_voice_volume(dev, (i & 2) ? 1.0f : 0.5f);
+        dev->set_mic_mute(dev, (i & 2) != 0);
+        dev->set_parameters(dev, (i & 2) ? "bt_headset_nrec=on" :
+                            "bt_headset_nrec=off;noise_suppression=off");
+        thread->calls++;
+        sleep_ms(10);
+    }
+    dev->set_mode(dev, AUDIO_MODE_NORMAL);
+    return NULL;
+}
+
+static void *stress_standby_thread(void *context)
+{
+    struct stress_thread *thread = context;
+
+    while (!thread->bench->stop) {
+        thread->fast->out->common.standby(&thread->fast->out->common);
+        thread->deep->out->common.standby(&thread->deep->out->common);
+        thread->in->in->common.standby(&thread->in->in->common);
+        thread->calls++;
+        sleep_ms(20);
+    }
+    return NULL;
+}
+
+static void *stress_query_thread(void *context)
+{
+    struct stress_thread *thread = context;
+    audio_hw_device_t *dev = thread->bench->dev;
+    struct audio_stream_out *out = thread->fast->out;
+    struct audio_stream_in *in = thread->in->in;
+    struct timespec ts;
+    uint64_t frames;
+    uint32_t dsp_frames;
+    char *str;
+    int fd = open("/dev/null", O_WRONLY);
+
+    while (!thread->bench->stop) {
+        str = out->common.get_parameters(&out->common,
+                                         "sup_channels;underruns;hw_xruns");
+        free(str);
+        str = in->common.get_parameters(&in->common,
+                                        "frames_lost;capture_position");
+        free(str);
+        str = dev->get_parameters(dev, "echo_delay_us");
+        free(str);
+        out->get_presentation_position(out, &frames, &ts);
+        out->get_render_position(out, &dsp_frames);
+        out->get_latency(out);
+        in->get_input_frames_lost(in);
+        if (fd >= 0)
+            dev->dump(dev, fd);
+        thread->calls++;
+        sleep_ms(1);
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+/*
+ * A stalled thread holds or waits for a HAL lock, so the streams cannot be
+ * closed: the watchdog reports it and exits.
+ */
+static void stress_watchdog(struct stress_progress *progress,
+                            unsigned int count, int64_t end)
+{
+    int64_t now;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        progress[i].last = *progress[i].counter;
+        progress[i].last_ns = now_ns();
+    }
+
+    while (now_ns() < end) {
+        sleep_ms(WATCHDOG_INTERVAL_MS);
+        now = now_ns();
+        for (i = 0; i < count; i++) {
+            if (*progress[i].counter != progress[i].last) {
+                progress[i].last = *progress[i].counter;
+                progress[i].last_ns = now;
+            } else if (now - progress[i].last_ns >
+                       STRESS_STALL_MS * 1000000LL) {
+                printf("  %s: no progress for %d ms, deadlocked\n",
+                       progress[i].name, STRESS_STALL_MS);
+                printf("stress: FAILED\n");
+                fflush(stdout);
+                _exit(1);
+            }
+        }
+    }
+}
+
+static const struct {
+    const char *name;
+    void *(*run)(void *context);
+} stress_controls[] = {
+    { "routing", stress_routing_thread },
+    { "call", stress_call_thread },
+    { "standby", stress_standby_thread },
+    { "query", stress_query_thread },
+};
+
+#define NUM_STRESS_CONTROLS \
+        (sizeof(stress_controls) / sizeof(stress_controls[0]))
+/* the two writers and the reader */
+#define NUM_STRESS_STREAMS 3
+
+static int test_stress(struct bench *bench)
+{
+    struct bench_stream fast, deep, reader;
+    struct stress_thread threads[NUM_STRESS_CONTROLS];
+    struct stress_progress progress[NUM_STRESS_STREAMS + NUM_STRESS_CONTROLS];
+    int64_t start;
+    long long wait_us;
+    unsigned int i;
+    int ret = 0;
+
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_FAST, &fast) != 0)
+        return -1;
+    if (open_output(bench, AUDIO_OUTPUT_FLAG_DEEP_BUFFER, &deep) != 0) {
+        bench->dev->close_output_stream(bench->dev, fast.out);
+        return -1;
+    }
+    if (open_input(bench, 48000, &reader) != 0) {
+        bench->dev->close_output_stream(bench->dev, fast.out);
+        bench->dev->close_output_stream(bench->dev, deep.out);
+        return -1;
+    }
+
+    progress[0].name = "fast write";
+    progress[0].counter = &fast.frames;
+    progress[1].name = "deep buffer write";
+    progress[1].counter = &deep.frames;
+    progress[2].name = "read";
+    progress[2].counter = &reader.frames;
+
+    start = now_ns();
+    if (start_stream(&fast, writer_thread) != 0 ||
+            start_stream(&deep, writer_thread) != 0 ||
+            start_stream(&reader, reader_thread) != 0)
+        return -1;
+
+    for (i = 0; i < NUM_STRESS_CONTROLS; i++) {
+        memset(&threads[i], 0, sizeof(threads[i]));
+        threads[i].bench = bench;
+        threads[i].fast = &fast;
+        threads[i].deep = &deep;
+        threads[i].in = &reader;
+        threads[i].name = stress_controls[i].name;
+        if (pthread_create(&threads[i].thread, NULL, stress_controls[i].run,
+                           &threads[i]) != 0) {
+            fprintf(stderr, "cannot create %s thread\n", threads[i].name);
+            return -1;
+        }
+        progress[NUM_STRESS_STREAMS + i].name = threads[i].name;
+        progress[NUM_STRESS_STREAMS + i].counter = &threads[i].calls;
+    }
+
+    stress_watchdog(progress, NUM_STRESS_STREAMS + NUM_STRESS_CONTROLS,
+                    start + bench->duration_s * 1000000000LL);
+
+    bench->stop = true;
+    for (i = 0; i < NUM_STRESS_CONTROLS; i++) {
+        pthread_join(threads[i].thread, NULL);
+        printf("  %s: %llu rounds\n", threads[i].name,
+               (unsigned long long)threads[i].calls);
+    }
+    stop_stream(&fast, "fast write", now_ns() - start);
+    stop_stream(&deep, "deep buffer write", now_ns() - start);
+    stop_stream(&reader, "read", now_ns() - start);
+
+    wait_us = bench_dump_max_us(bench, "output mutex wait time");
+    if (wait_us < 0 || wait_us > STRESS_OUTPUT_WAIT_MS * 1000) {
+        printf("  routing and standby waited %lld us for a writer with the "
+               "hw device mutex held\n", wait_us);
+        ret = -1;
+    }
+    return ret;
+}
+
+static const struct bench_test tests[] = {
+    { "fast", test_fast, false },
+    { "routing", test_routing, false },
+    { "call", test_call, false },
+    { "mmap", test_mmap, true },
+    { "mmap_no_rt", test_mmap_no_rt, true, true },
+    { "cadence", test_cadence, false },
+    { "capture", test_capture, false },
+    { "capture_rates", test_capture_rates, false },
+    { "stress", test_stress, false },
+};
+
+#define NUM_TESTS (sizeof(tests) / sizeof(tests[0]))
+
+/*
+ * Take SCHED_FIFO away from the process: no real time priority allowed and,
+ * when running as root, no CAP_SYS_NICE.
+ */
+static int drop_rt(void)
+{
+    struct __user_cap_header_struct header;
+    struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+    struct rlimit limit = { 0, 0 };
+    struct sched_param param;
+
+    setrlimit(RLIMIT_RTPRIO, &limit);
+
+    memset(&header, 0, sizeof(header));
+    header.version = _LINUX_CAPABILITY_VERSION_3;
+    if (syscall(SYS_capget, &header, data) == 0) {
+        data[0].effective &= ~(1U << CAP_SYS_NICE);
+        data[0].permitted &= ~(1U << CAP_SYS_NICE);
+        syscall(SYS_capset, &header, data);
+    }
+
+    param.sched_priority = 1;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) == 0) {
+        fprintf(stderr, "cannot take SCHED_FIFO away\n");
+        return -1;
+    }
+    return 0;
+}
+
+/* the HAL threads inherit the scheduling limits of the child */
+static int run_test_no_rt(struct bench *bench, const struct bench_test *test)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0)
+        return -1;
+    if (pid == 0) {
+        status = (drop_rt() == 0 && bench_open(bench) == 0) ? 0 : 1;
+        if (status == 0) {
+            status = test->run(bench) == 0 ? 0 : 1;
+            bench_close(bench);
+        }
+        fflush(stdout);
+        _exit(status);
+    }
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+static int run_test(struct bench *bench, const struct bench_test *test)
+{
+    int ret;
+
+    printf("%s: %u s\n", test->name, bench->duration_s);
+    property_set(MMAP_OUTPUT_PROPERTY, test->mmap_output ? "1" : "0");
+    if (test->no_rt)
+        return run_test_no_rt(bench, test);
+    if (bench_open(bench) != 0)
+        return -1;
+    ret = test->run(bench);
+    bench_close(bench);
+    return ret;
+}
+
+static void usage(const char *name)
+{
+    unsigned int i;
+
+    fprintf(stderr, "usage: %s [-d seconds] [-c ctl_write_us] "
+            "[-r ril_delay_us] [-w wakeup_us] [-u underruns] "
+            "[-t mixer_paths.bin] [-v] [test...]\ntests:", name);
+    for (i = 0; i < NUM_TESTS; i++)
+        fprintf(stderr, " %s", tests[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char **argv)
+{
+    struct bench bench;
+    struct fake_pcm_timing timing;
+    const char *table = NULL;
+    unsigned int ril_delay_us = DEFAULT_RIL_DELAY_US;
+    char value[16];
+    unsigned int i;
+    int failed = 0;
+    int opt;
+    int j;
+
+    memset(&bench, 0, sizeof(bench));
+    bench.duration_s = DEFAULT_DURATION_S;
+    bench.ctl_write_us = DEFAULT_CTL_WRITE_US;
+    timing.burst_frames = 16;
+    timing.wakeup_us = 50;
+
+    while ((opt = getopt(argc, argv, "d:c:r:w:u:t:v")) != -1) {
+        switch (opt) {
+        case 'd':
+            bench.duration_s = atoi(optarg);
+            break;
+        case 'c':
+            bench.ctl_write_us = atoi(optarg);
+            break;
+        case 'r':
+            ril_delay_us = atoi(optarg);
+            break;
+        case 'w':
+            timing.wakeup_us = atoi(optarg);
+            break;
+        case 'u':
+            bench.underruns = atoi(optarg);
+            break;
+        case 't':
+            table = optarg;
+            break;
+        case 'v':
+            bench.verbose = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (setup_tree(table) != 0)
+        return 1;
+
+    fake_pcm_set_timing(&timing);
+    fake_mixer_set_cost(bench.ctl_write_us, true);
+    snprintf(value, sizeof(value), "%u", ril_delay_us);
+    setenv("FAKE_RIL_DELAY_US", value, 1);
+
+    for (i = 0; i < NUM_TESTS; i++) {
+        if (optind < argc) {
+            for (j = optind; j < argc; j++)
+                if (strcmp(argv[j], tests[i].name) == 0)
+                    break;
+            if (j == argc)
+                continue;
+        }
+        if (run_test(&bench, &tests[i]) != 0) {
+            printf("%s: FAILED\n", tests[i].name);
+            failed++;
+        }
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,328 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the audio_kernels.c kernels. Every kernel is first checked
+ * bit-exact against its C version on random and full scale input, over
+ * buffer sizes that exercise the NEON tails, then timed on one mixer period
+ * in the cache. The time is given in CPU cycles per frame when the perf
+ * cycle counter can be read, in nanoseconds per frame otherwise.
+ *
+ * Built for the device, where the kernels are NEON, and for the host, where
+ * both versions are C and only the cost of the C version is meaningful.
+ *
+ * usage: audio_kernels_bench [-n iterations]
+ */
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "audio_kernels.h"
+
+/* frames per call, a low latency mixer period */
+#define BENCH_FRAMES 240
+#define BENCH_ROUNDS 50
+#define DEFAULT_ITERATIONS 200
+
+/* largest buffer of the bit-exact check, stereo frames */
+#define CHECK_FRAMES 1031
+
+#ifdef __ARM_NEON__
+#define KERNEL_VERSION "neon"
+#else
+#define KERNEL_VERSION "dispatch"
+#endif
+
+/* a kernel working in place on interleaved stereo frames */
+typedef void (*kernel_fn)(int16_t *buffer, size_t frames);
+
+struct kernel {
+    const char *name;
+    kernel_fn fn;       /* the version audio_hw calls */
+    kernel_fn fn_c;
+    bool to_float;      /* writes float_out, leaves the buffer alone */
+};
+
+/* output of the float conversion, stereo samples */
+static float float_out[CHECK_FRAMES * 2];
+static float float_out_c[CHECK_FRAMES * 2];
+
+static const int16_t ramp_down_start[2] = { 0x7000, 0x6000 };
+static const int16_t ramp_down_end[2] = { 0x1000, 0x0800 };
+static const int16_t fade_in_start[2] = { 0, 0 };
+static const int16_t fade_in_end[2] = { GAIN_Q15_UNITY, GAIN_Q15_UNITY };
+static const int16_t constant_gain[2] = { 0x4000, 0x2000 };
+
+static void ramp_down(int16_t *buffer, size_t frames)
+{
+    gain_ramp_stereo_q15(buffer, frames, ramp_down_start, ramp_down_end);
+}
+
+static void ramp_down_c(int16_t *buffer, size_t frames)
+{
+    gain_ramp_stereo_q15_c(buffer, frames, ramp_down_start, ramp_down_end);
+}
+
+static void fade_in(int16_t *buffer, size_t frames)
+{
+    gain_ramp_stereo_q15(buffer, frames, fade_in_start, fade_in_end);
+}
+
+static void fade_in_c(int16_t *buffer, size_t frames)
+{
+    gain_ramp_stereo_q15_c(buffer, frames, fade_in_start, fade_in_end);
+}
+
+static void constant(int16_t *buffer, size_t frames)
+{
+    gain_ramp_stereo_q15(buffer, frames, constant_gain, constant_gain);
+}
+
+static void constant_c(int16_t *buffer, size_t frames)
+{
+    gain_ramp_stereo_q15_c(buffer, frames, constant_gain, constant_gain);
+}
+
+/* capture kernels, in place like get_next_buffer() converts a period */
+static void to_mono_left(int16_t *buffer, size_t frames)
+{
+    stereo_to_mono_left(buffer, buffer, frames);
+}
+
+static void to_mono_left_c(int16_t *buffer, size_t frames)
+{
+    stereo_to_mono_left_c(buffer, buffer, frames);
+}
+
+static void to_mono_right(int16_t *buffer, size_t frames)
+{
+    stereo_to_mono_right(buffer, buffer, frames);
+}
+
+static void to_mono_right_c(int16_t *buffer, size_t frames)
+{
+    stereo_to_mono_right_c(buffer, buffer, frames);
+}
+
+static void to_mono_mix(int16_t *buffer, size_t frames)
+{
+    stereo_to_mono_mix(buffer, buffer, frames);
+}
+
+static void to_mono_mix_c(int16_t *buffer, size_t frames)
+{
+    stereo_to_mono_mix_c(buffer, buffer, frames);
+}
+
+static void to_float(int16_t *buffer, size_t frames)
+{
+    pcm_16_to_float(float_out, buffer, frames * 2);
+}
+
+static void to_float_c(int16_t *buffer, size_t frames)
+{
+    pcm_16_to_float_c(float_out_c, buffer, frames * 2);
+}
+
+static const struct kernel kernels[] = {
+    { "gain_ramp_stereo_q15, ramp down", ramp_down, ramp_down_c },
+    { "gain_ramp_stereo_q15, fade in", fade_in, fade_in_c },
+    { "gain_ramp_stereo_q15, constant", constant, constant_c },
+    { "stereo_to_mono_left", to_mono_left, to_mono_left_c },
+    { "stereo_to_mono_right", to_mono_right, to_mono_right_c },
+    { "stereo_to_mono_mix", to_mono_mix, to_mono_mix_c },
+    { "pcm_16_to_float", to_float, to_float_c, true },
+};
+
+#define NUM_KERNELS (sizeof(kernels) / sizeof(kernels[0]))
+
+static int perf_fd = -1;
+
+static void counter_open(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/* CPU cycles, or nanoseconds without a cycle counter */
+static uint64_t counter_read(void)
+{
+    struct timespec ts;
+    uint64_t cycles;
+
+    if (perf_fd >= 0 && read(perf_fd, &cycles, sizeof(cycles)) == sizeof(cycles))
+        return cycles;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill_random(int16_t *buffer, size_t samples)
+{
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        buffer[i] = (int16_t)(rand() & 0xffff);
+}
+
+/* full scale extremes, where rounding and saturation differ first */
+static void fill_extremes(int16_t *buffer, size_t samples)
+{
+    static const int16_t values[] = { INT16_MIN, INT16_MAX, -1, 1, 0 };
+    size_t i;
+
+    for (i = 0; i < samples; i++)
+        buffer[i] = values[(i * 7 + i / 5) % 5];
+}
+
+static bool check_kernel(const struct kernel *kernel)
+{
+    static int16_t input[CHECK_FRAMES * 2];
+    static int16_t out[CHECK_FRAMES * 2];
+    static int16_t out_c[CHECK_FRAMES * 2];
+    size_t frames;
+    size_t i;
+    int fill;
+
+    for (fill = 0; fill < 2; fill++) {
+        if (fill == 0)
+            fill_random(input, CHECK_FRAMES * 2);
+        else
+            fill_extremes(input, CHECK_FRAMES * 2);
+
+        for (frames = 1; frames <= CHECK_FRAMES;
+                frames += (frames < 64) ? 1 : 97) {
+            memcpy(out, input, frames * 2 * sizeof(int16_t));
+            memcpy(out_c, input, frames * 2 * sizeof(int16_t));
+            kernel->fn(out, frames);
+            kernel->fn_c(out_c, frames);
+            for (i = 0; i < frames * 2; i++) {
+                if (out[i] == out_c[i])
+                    continue;
+                printf("%s: %zu frames, sample %zu is %d, C gives %d\n",
+                       kernel->name, frames, i, out[i], out_c[i]);
+                return false;
+            }
+            if (kernel->to_float && memcmp(float_out, float_out_c,
+                    frames * 2 * sizeof(float)) != 0) {
+                printf("%s: %zu frames, float output differs from C\n",
+                       kernel->name, frames);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* the gain kernels leave the buffer untouched at unity */
+static bool check_unity(void)
+{
+    static const int16_t unity[2] = { GAIN_Q15_UNITY, GAIN_Q15_UNITY };
+    int16_t input[BENCH_FRAMES * 2];
+    int16_t out[BENCH_FRAMES * 2];
+
+    fill_extremes(input, BENCH_FRAMES * 2);
+    memcpy(out, input, sizeof(out));
+    gain_ramp_stereo_q15(out, BENCH_FRAMES, unity, unity);
+    if (memcmp(out, input, sizeof(out)) != 0) {
+        printf("gain_ramp_stereo_q15: unity gain changed the buffer\n");
+        return false;
+    }
+    return true;
+}
+
+/* best of BENCH_ROUNDS, per frame */
+static double time_kernel(kernel_fn fn, int16_t *buffer, unsigned int iterations)
+{
+    uint64_t best = UINT64_MAX;
+    uint64_t start, elapsed;
+    unsigned int round, i;
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        start = counter_read();
+        for (i = 0; i < iterations; i++)
+            fn(buffer, BENCH_FRAMES);
+        elapsed = counter_read() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return (double)best / iterations / BENCH_FRAMES;
+}
+
+int main(int argc, char **argv)
+{
+    static int16_t buffer[BENCH_FRAMES * 2];
+    unsigned int iterations = DEFAULT_ITERATIONS;
+    unsigned int i;
+    double t, t_c;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations == 0)
+        iterations = 1;
+
+    srand(1);
+    if (!check_unity())
+        failed++;
+
+    counter_open();
+    printf("%s per frame, %d frame buffers, best of %d x %u calls\n",
+           perf_fd >= 0 ? "cycles" : "ns", BENCH_FRAMES, BENCH_ROUNDS,
+           iterations);
+    printf("%-40s %-9s %9s %9s\n", "kernel", "check", "c", KERNEL_VERSION);
+
+    for (i = 0; i < NUM_KERNELS; i++) {
+        bool exact = check_kernel(&kernels[i]);
+
+        if (!exact)
+            failed++;
+        fill_random(buffer, BENCH_FRAMES * 2);
+        t_c = time_kernel(kernels[i].fn_c, buffer, iterations);
+        fill_random(buffer, BENCH_FRAMES * 2);
+        t = time_kernel(kernels[i].fn, buffer, iterations);
+        printf("%-40s %-9s %9.2f %9.2f\n", kernels[i].name,
+               exact ? "bit-exact" : "MISMATCH", t_c, t);
+    }
+
+    if (perf_fd >= 0)
+        close(perf_fd);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,292 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Offline benchmark of the routing table. Every (input source, output
+ * device, es325 mode) tuple of route_configs[][] is applied through
+ * route_table.c on the fake mixer of fake_tinyalsa.c, from the initial
+ * mixer state and from every other tuple, the way apply_route() does it:
+ * reset, output path, input path, update. A control write costs
+ * ctl_write_us of I2C and an eS325 preset change preset_us, both only
+ * accounted. Transitions that change the output path also mute the
+ * playback around the switch.
+ *
+ * It prints the cost of each tuple from the initial state and from its
+ * most expensive predecessor, then the slowest transitions with the
+ * controls they write.
+ *
+ * usage: audio_route_bench [-c ctl_write_us] [-p preset_us] [-n slowest]
+ *                          mixer_paths.bin
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fake_alsa.h"
+#include "route_table.h"
+#include "routing.h"
+
+#define MIXER_CARD 0
+
+#define DEFAULT_CTL_WRITE_US 100
+#define DEFAULT_PRESET_US 0
+#define DEFAULT_SLOWEST 10
+
+#define NUM_TUPLES (IN_SOURCE_TAB_SIZE * OUT_DEVICE_TAB_SIZE * ES325_NUM_MODES)
+
+static const char *in_source_names[IN_SOURCE_TAB_SIZE] = {
+    "mic", "camcorder", "voice recognition", "voice communication",
+    "voice call",
+};
+
+static const char *out_device_names[OUT_DEVICE_TAB_SIZE] = {
+    "speaker", "earpiece", "headset", "headphones", "bt sco",
+};
+
+static const char *es325_mode_names[ES325_NUM_MODES] = {
+    "default", "level",
+};
+
+struct tuple {
+    unsigned int in_source;
+    unsigned int out_device;
+    unsigned int es325_mode;
+};
+
+struct transition {
+    unsigned int from;
+    unsigned int to;
+    int writes;
+    bool preset;
+    bool muted;                 /* output path changed, playback muted */
+    unsigned int cost_us;
+};
+
+static unsigned int ctl_write_us = DEFAULT_CTL_WRITE_US;
+static unsigned int preset_us = DEFAULT_PRESET_US;
+
+static void tuple_get(unsigned int index, struct tuple *tuple)
+{
+    tuple->es325_mode = index % ES325_NUM_MODES;
+    index /= ES325_NUM_MODES;
+    tuple->out_device = index % OUT_DEVICE_TAB_SIZE;
+    tuple->in_source = index / OUT_DEVICE_TAB_SIZE;
+}
+
+static const struct route_config *tuple_config(unsigned int index)
+{
+    struct tuple tuple;
+
+    tuple_get(index, &tuple);
+    return route_configs[tuple.in_source][tuple.out_device];
+}
+
+static int tuple_preset(unsigned int index)
+{
+    struct tuple tuple;
+
+    tuple_get(index, &tuple);
+    return route_configs[tuple.in_source][tuple.out_device]->es325_preset[
+            tuple.es325_mode];
+}
+
+static void tuple_name(unsigned int index, char *name, size_t size)
+{
+    struct tuple tuple;
+
+    tuple_get(index, &tuple);
+    snprintf(name, size, "%s/%s/%s", in_source_names[tuple.in_source],
+             out_device_names[tuple.out_device],
+             es325_mode_names[tuple.es325_mode]);
+}
+
+static bool path_equal(const char *a, const char *b)
+{
+    if (!a || !b)
+        return a == b;
+    return strcmp(a, b) == 0;
+}
+
+/* apply the paths of a tuple, returns the number of controls written */
+static int apply_tuple(struct route_table *table, unsigned int index)
+{
+    struct tuple tuple;
+
+    tuple_get(index, &tuple);
+    route_table_reset(table);
+    route_table_apply_path(table, route_table_get_path(table, tuple.in_source,
+                                                       tuple.out_device, false));
+    route_table_apply_path(table, route_table_get_path(table, tuple.in_source,
+                                                       tuple.out_device, true));
+    return route_table_update_mixer(table);
+}
+
+/* from is NUM_TUPLES for the initial mixer state */
+static void measure(struct route_table *table, unsigned int from,
+                    unsigned int to, struct transition *transition)
+{
+    transition->from = from;
+    transition->to = to;
+    /* the HAL starts from ES325_PRESET_INIT, which no route uses */
+    transition->preset = tuple_preset(to) != ES325_PRESET_CURRENT;
+    transition->muted = tuple_config(to)->output_route != NULL;
+
+    route_table_reset(table);
+    route_table_update_mixer(table);
+    if (from < NUM_TUPLES) {
+        apply_tuple(table, from);
+        transition->preset = transition->preset &&
+                tuple_preset(from) != tuple_preset(to);
+        transition->muted = !path_equal(tuple_config(from)->output_route,
+                                        tuple_config(to)->output_route);
+    }
+
+    transition->writes = apply_tuple(table, to);
+    transition->cost_us = transition->writes * ctl_write_us +
+            (transition->preset ? preset_us : 0);
+}
+
+static void print_write(void *context, const char *ctl, int value)
+{
+    printf("      %s = %d\n", ctl, value);
+}
+
+static int compare_cost(const void *a, const void *b)
+{
+    const struct transition *x = a;
+    const struct transition *y = b;
+
+    if (x->cost_us != y->cost_us)
+        return (x->cost_us < y->cost_us) - (x->cost_us > y->cost_us);
+    if (x->from != y->from)
+        return (x->from > y->from) - (x->from < y->from);
+    return (x->to > y->to) - (x->to < y->to);
+}
+
+int main(int argc, char **argv)
+{
+    struct route_table *table;
+    struct transition *transitions;
+    struct transition initial, worst;
+    unsigned int num_transitions = 0;
+    unsigned int slowest = DEFAULT_SLOWEST;
+    unsigned int from, to, i, j, shown;
+    char from_name[64], to_name[64];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:p:n:")) != -1) {
+        switch (opt) {
+        case 'c':
+            ctl_write_us = atoi(optarg);
+            break;
+        case 'p':
+            preset_us = atoi(optarg);
+            break;
+        case 'n':
+            slowest = atoi(optarg);
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "usage: %s [-c ctl_write_us] [-p preset_us] "
+                "[-n slowest] mixer_paths.bin\n", argv[0]);
+        return 2;
+    }
+
+    fake_mixer_set_cost(ctl_write_us, false);
+    table = route_table_open(argv[optind], MIXER_CARD, IN_SOURCE_TAB_SIZE,
+                             OUT_DEVICE_TAB_SIZE);
+    if (!table) {
+        fprintf(stderr, "%s: not a route table for this routing.h\n",
+                argv[optind]);
+        return 1;
+    }
+
+    transitions = malloc(NUM_TUPLES * NUM_TUPLES * sizeof(*transitions));
+    if (!transitions) {
+        route_table_close(table);
+        return 1;
+    }
+
+    printf("%u tuples, %u us per control write, %u us per preset change\n",
+           NUM_TUPLES, ctl_write_us, preset_us);
+    printf("%-38s %-24s %-26s %6s %8s %s\n", "tuple", "output", "input",
+           "preset", "initial", "worst from");
+
+    for (to = 0; to < NUM_TUPLES; to++) {
+        measure(table, NUM_TUPLES, to, &initial);
+        worst.cost_us = 0;
+        worst.from = to;
+        for (from = 0; from < NUM_TUPLES; from++) {
+            if (from == to)
+                continue;
+            measure(table, from, to, &transitions[num_transitions]);
+            if (transitions[num_transitions].cost_us >= worst.cost_us)
+                worst = transitions[num_transitions];
+            num_transitions++;
+        }
+
+        tuple_name(to, to_name, sizeof(to_name));
+        tuple_name(worst.from, from_name, sizeof(from_name));
+        printf("%-38s %-24s %-26s %6d %5u us %u us, %s\n", to_name,
+               tuple_config(to)->output_route, tuple_config(to)->input_route,
+               tuple_preset(to), initial.cost_us, worst.cost_us, from_name);
+    }
+
+    qsort(transitions, num_transitions, sizeof(*transitions), compare_cost);
+
+    /* transitions differing only by the es325 modes are listed once */
+    printf("\n%u slowest of %u transitions:\n", slowest, num_transitions);
+    for (i = 0, shown = 0; i < num_transitions && shown < slowest; i++) {
+        for (j = 0; j < i; j++) {
+            if (transitions[j].from / ES325_NUM_MODES ==
+                        transitions[i].from / ES325_NUM_MODES &&
+                    transitions[j].to / ES325_NUM_MODES ==
+                        transitions[i].to / ES325_NUM_MODES &&
+                    transitions[j].cost_us == transitions[i].cost_us)
+                break;
+        }
+        if (j < i)
+            continue;
+        shown++;
+
+        tuple_name(transitions[i].from, from_name, sizeof(from_name));
+        tuple_name(transitions[i].to, to_name, sizeof(to_name));
+        printf("  %u us: %s -> %s, %d writes%s%s\n", transitions[i].cost_us,
+               from_name, to_name, transitions[i].writes,
+               transitions[i].preset ? ", preset change" : "",
+               transitions[i].muted ? ", output muted" : "");
+
+        /* replay it to print the writes */
+        route_table_reset(table);
+        route_table_update_mixer(table);
+        apply_tuple(table, transitions[i].from);
+        fake_mixer_set_observer(print_write, NULL);
+        apply_tuple(table, transitions[i].to);
+        fake_mixer_set_observer(NULL, NULL);
+    }
+
+    free(transitions);
+    route_table_close(table);
+    return 0;
+}
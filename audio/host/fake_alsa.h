@@ -0,0 +1,87 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FAKE_ALSA_H
+#define FAKE_ALSA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <tinyalsa/asoundlib.h>
+
+/*
+ * Host stand-ins for the libraries the HAL runs on, see audio_hw_bench.c.
+ * This is their benchmark side: the DMA timing of the fake pcms, the I2C
+ * cost of the fake mixer controls and what both recorded.
+ *
+ * A fake pcm moves its hardware pointer with CLOCK_MONOTONIC at the config
+ * rate, one period at a time like the period interrupts of the real DMA.
+ * PCM_NOIRQ pcms move it in bursts of burst_frames instead. Playback data is
+ * dropped, capture data is a 1 kHz tone at -20 dBFS.
+ */
+struct fake_pcm_timing {
+    unsigned int burst_frames;  /* DMA granularity of PCM_NOIRQ pcms */
+    unsigned int wakeup_us;     /* scheduling latency added to every wakeup
+                                 * of a blocked read or write */
+};
+
+void fake_pcm_set_timing(const struct fake_pcm_timing *timing);
+
+/*
+ * Capture stops for the next ms, like a codec that lost its clock: pcm_read()
+ * blocks until then and fails with -EIO.
+ */
+void fake_pcm_fail_capture(unsigned int ms);
+
+#define FAKE_PCM_DEVICES 8
+
+struct fake_pcm_stats {
+    unsigned int opens;
+    unsigned int open_flags;    /* of the last open */
+    struct pcm_config config;   /* of the last open */
+    bool running;
+    unsigned int xruns;
+    uint64_t frames;            /* transferred since startup */
+};
+
+/* statistics of a device since the last reset, false for an unknown one */
+bool fake_pcm_get_stats(unsigned int device, bool capture,
+                        struct fake_pcm_stats *stats);
+void fake_pcm_reset_stats(void);
+
+/*
+ * Every mixer_ctl_set_value() costs ctl_write_us of I2C time. It is only
+ * accounted, or also slept when sleep is set so that routing takes as long
+ * as on the device.
+ */
+void fake_mixer_set_cost(unsigned int ctl_write_us, bool sleep);
+
+struct fake_mixer_stats {
+    unsigned int ctls;          /* controls looked up so far */
+    unsigned int writes;        /* mixer_ctl_set_value() calls */
+    uint64_t cost_us;           /* I2C time of those writes */
+};
+
+void fake_mixer_get_stats(struct fake_mixer_stats *stats);
+void fake_mixer_reset_stats(void);
+
+/* called on every control write until it is set to NULL */
+typedef void (*fake_mixer_observer_t)(void *context, const char *ctl,
+                                      int value);
+
+void fake_mixer_set_observer(fake_mixer_observer_t observer, void *context);
+
+#endif
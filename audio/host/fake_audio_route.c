@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for libaudioroute, used by audio_hw when mixer_paths.bin is
+ * missing. It does not parse mixer_paths.xml: every path is one fake mixer
+ * control named after it, written on audio_route_update_mixer() when the
+ * path was applied or reset since the last update, so that the control
+ * writes show up in the fake mixer statistics.
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <tinyalsa/asoundlib.h>
+#include <audio_route/audio_route.h>
+
+#define MAX_PATHS 64
+
+struct route_path {
+    char *name;
+    struct mixer_ctl *ctl;
+    bool active;        /* value to write on the next update */
+    bool written;       /* value the control has */
+};
+
+struct audio_route {
+    struct mixer *mixer;
+    struct route_path paths[MAX_PATHS];
+    unsigned int num_paths;
+};
+
+struct audio_route *audio_route_init(unsigned int card, const char *xml_path)
+{
+    struct audio_route *ar = calloc(1, sizeof(struct audio_route));
+
+    if (!ar)
+        return NULL;
+
+    ar->mixer = mixer_open(card);
+    if (!ar->mixer) {
+        free(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+void audio_route_free(struct audio_route *ar)
+{
+    unsigned int i;
+
+    if (!ar)
+        return;
+
+    for (i = 0; i < ar->num_paths; i++)
+        free(ar->paths[i].name);
+    mixer_close(ar->mixer);
+    free(ar);
+}
+
+static struct route_path *audio_route_get_path(struct audio_route *ar,
+                                               const char *name)
+{
+    struct route_path *path;
+    unsigned int i;
+
+    for (i = 0; i < ar->num_paths; i++)
+        if (strcmp(ar->paths[i].name, name) == 0)
+            return &ar->paths[i];
+
+    if (ar->num_paths == MAX_PATHS)
+        return NULL;
+
+    path = &ar->paths[ar->num_paths];
+    path->ctl = mixer_get_ctl_by_name(ar->mixer, name);
+    if (!path->ctl)
+        return NULL;
+    path->name = strdup(name);
+    ar->num_paths++;
+    return path;
+}
+
+int audio_route_apply_path(struct audio_route *ar, const char *name)
+{
+    struct route_path *path = audio_route_get_path(ar, name);
+
+    if (!path)
+        return -1;
+    path->active = true;
+    return 0;
+}
+
+int audio_route_reset_path(struct audio_route *ar, const char *name)
+{
+    struct route_path *path = audio_route_get_path(ar, name);
+
+    if (!path)
+        return -1;
+    path->active = false;
+    return 0;
+}
+
+void audio_route_reset(struct audio_route *ar)
+{
+    unsigned int i;
+
+    for (i = 0; i < ar->num_paths; i++)
+        ar->paths[i].active = false;
+}
+
+int audio_route_update_mixer(struct audio_route *ar)
+{
+    struct route_path *path;
+    unsigned int i;
+
+    for (i = 0; i < ar->num_paths; i++) {
+        path = &ar->paths[i];
+        if (path->active == path->written)
+            continue;
+        mixer_ctl_set_value(path->ctl, 0, path->active);
+        path->written = path->active;
+    }
+    return 0;
+}
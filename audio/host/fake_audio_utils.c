@@ -0,0 +1,278 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-ins for the parts of libaudioutils audio_hw uses: the
+ * single reader, single writer fifo, a linear interpolating resampler with
+ * the speex resampler interface and the stereo to mono downmix. The
+ * resampler is cheaper than speex, the capture benchmarks do not measure
+ * it against the device.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/atomic.h>
+#include <audio_utils/fifo.h>
+#include <audio_utils/primitives.h>
+#include <audio_utils/resampler.h>
+
+/*
+ * mFront and mRear count frames modulo twice the fifo size, so that a full
+ * fifo is told apart from an empty one for any size.
+ */
+void audio_utils_fifo_init(struct audio_utils_fifo *fifo, size_t frameCount,
+                           size_t frameSize, void *buffer)
+{
+    fifo->mFrameCount = frameCount;
+    fifo->mFrameCountP2 = frameCount * 2;
+    fifo->mFudgeFactor = 0;
+    fifo->mFrameSize = frameSize;
+    fifo->mBuffer = buffer;
+    fifo->mFront = 0;
+    fifo->mRear = 0;
+}
+
+void audio_utils_fifo_deinit(struct audio_utils_fifo *fifo)
+{
+}
+
+static size_t fifo_filled(struct audio_utils_fifo *fifo, int32_t front,
+                          int32_t rear)
+{
+    return (rear - front + fifo->mFrameCountP2) % fifo->mFrameCountP2;
+}
+
+/* copy count frames from or to the ring at position, which may wrap */
+static void fifo_copy(struct audio_utils_fifo *fifo, int32_t position,
+                      void *buffer, size_t count, bool to_ring)
+{
+    size_t offset = position % fifo->mFrameCount;
+    size_t part = fifo->mFrameCount - offset;
+    char *ring = fifo->mBuffer;
+    char *data = buffer;
+
+    if (part > count)
+        part = count;
+
+    if (to_ring) {
+        memcpy(ring + offset * fifo->mFrameSize, data, part * fifo->mFrameSize);
+        memcpy(ring, data + part * fifo->mFrameSize,
+               (count - part) * fifo->mFrameSize);
+    } else {
+        memcpy(data, ring + offset * fifo->mFrameSize, part * fifo->mFrameSize);
+        memcpy(data + part * fifo->mFrameSize, ring,
+               (count - part) * fifo->mFrameSize);
+    }
+}
+
+ssize_t audio_utils_fifo_write(struct audio_utils_fifo *fifo,
+                               const void *buffer, size_t count)
+{
+    int32_t front = android_atomic_acquire_load(&fifo->mFront);
+    int32_t rear = fifo->mRear;
+    size_t space = fifo->mFrameCount - fifo_filled(fifo, front, rear);
+
+    if (count > space)
+        count = space;
+
+    fifo_copy(fifo, rear, (void *)buffer, count, true);
+    android_atomic_release_store((rear + count) % fifo->mFrameCountP2,
+                                 &fifo->mRear);
+    return count;
+}
+
+ssize_t audio_utils_fifo_read(struct audio_utils_fifo *fifo, void *buffer,
+                              size_t count)
+{
+    int32_t rear = android_atomic_acquire_load(&fifo->mRear);
+    int32_t front = fifo->mFront;
+    size_t filled = fifo_filled(fifo, front, rear);
+
+    if (count > filled)
+        count = filled;
+
+    fifo_copy(fifo, front, buffer, count, false);
+    android_atomic_release_store((front + count) % fifo->mFrameCountP2,
+                                 &fifo->mFront);
+    return count;
+}
+
+void downmix_to_mono_i16_from_stereo_i16(int16_t *dst, const int16_t *src,
+                                         size_t count)
+{
+    while (count--) {
+        *dst++ = (int16_t)(((int32_t)src[0] + (int32_t)src[1]) >> 1);
+        src += 2;
+    }
+}
+
+#define PHASE_ONE (1ULL << 32)
+
+struct linear_resampler {
+    struct resampler_itfe itfe;
+    struct resampler_buffer_provider *provider;
+    uint32_t in_rate;
+    uint32_t out_rate;
+    uint32_t channels;
+    uint64_t step;          /* input frames per output frame, Q32 */
+    uint64_t phase;         /* position between prev and cur, Q32 */
+    int16_t prev[2];
+    int16_t cur[2];
+};
+
+static void resampler_push(struct linear_resampler *rs, const int16_t *frame)
+{
+    uint32_t c;
+
+    for (c = 0; c < rs->channels; c++) {
+        rs->prev[c] = rs->cur[c];
+        rs->cur[c] = frame[c];
+    }
+    rs->phase -= PHASE_ONE;
+}
+
+static void resampler_output(struct linear_resampler *rs, int16_t *out)
+{
+    int64_t frac = rs->phase >> 17;     /* Q15 */
+    uint32_t c;
+
+    for (c = 0; c < rs->channels; c++)
+        out[c] = (int16_t)(rs->prev[c] +
+                (((rs->cur[c] - rs->prev[c]) * frac) >> 15));
+    rs->phase += rs->step;
+}
+
+static int resampler_set_sample_rate(struct resampler_itfe *resampler,
+                                     uint32_t in_rate, uint32_t out_rate)
+{
+    struct linear_resampler *rs = (struct linear_resampler *)resampler;
+
+    rs->in_rate = in_rate;
+    rs->out_rate = out_rate;
+    rs->step = ((uint64_t)in_rate << 32) / out_rate;
+    return 0;
+}
+
+static void resampler_reset(struct resampler_itfe *resampler)
+{
+    struct linear_resampler *rs = (struct linear_resampler *)resampler;
+
+    /* the first output frame needs two input frames */
+    rs->phase = 2 * PHASE_ONE;
+    memset(rs->prev, 0, sizeof(rs->prev));
+    memset(rs->cur, 0, sizeof(rs->cur));
+}
+
+static int32_t resampler_delay_ns(struct resampler_itfe *resampler)
+{
+    struct linear_resampler *rs = (struct linear_resampler *)resampler;
+
+    return (int32_t)(1000000000LL / rs->in_rate);
+}
+
+static int resampler_resample_from_provider(struct resampler_itfe *resampler,
+                                            int16_t *out, size_t *outFrameCount)
+{
+    struct linear_resampler *rs = (struct linear_resampler *)resampler;
+    struct resampler_buffer buf;
+    size_t frames = 0;
+    size_t used;
+
+    if (!rs->provider)
+        return -EINVAL;
+
+    while (frames < *outFrameCount) {
+        if (rs->phase < PHASE_ONE) {
+            resampler_output(rs, out + frames * rs->channels);
+            frames++;
+            continue;
+        }
+
+        buf.frame_count = (*outFrameCount - frames) * rs->step / PHASE_ONE + 1;
+        if (rs->provider->get_next_buffer(rs->provider, &buf) != 0 ||
+                buf.raw == NULL || buf.frame_count == 0)
+            break;
+        for (used = 0; used < buf.frame_count && rs->phase >= PHASE_ONE; used++)
+            resampler_push(rs, buf.i16 + used * rs->channels);
+        buf.frame_count = used;
+        rs->provider->release_buffer(rs->provider, &buf);
+    }
+
+    *outFrameCount = frames;
+    return 0;
+}
+
+static int resampler_resample_from_input(struct resampler_itfe *resampler,
+                                         int16_t *in, size_t *inFrameCount,
+                                         int16_t *out, size_t *outFrameCount)
+{
+    struct linear_resampler *rs = (struct linear_resampler *)resampler;
+    size_t in_frames = 0;
+    size_t frames = 0;
+
+    while (frames < *outFrameCount) {
+        if (rs->phase < PHASE_ONE) {
+            resampler_output(rs, out + frames * rs->channels);
+            frames++;
+        } else if (in_frames < *inFrameCount) {
+            resampler_push(rs, in + in_frames * rs->channels);
+            in_frames++;
+        } else {
+            break;
+        }
+    }
+
+    *inFrameCount = in_frames;
+    *outFrameCount = frames;
+    return 0;
+}
+
+int create_resampler(uint32_t inSampleRate, uint32_t outSampleRate,
+                     uint32_t channelCount, uint32_t quality,
+                     struct resampler_buffer_provider *provider,
+                     struct resampler_itfe **resampler)
+{
+    struct linear_resampler *rs;
+
+    if (channelCount < 1 || channelCount > 2 || inSampleRate == 0 ||
+            outSampleRate == 0)
+        return -EINVAL;
+
+    rs = calloc(1, sizeof(struct linear_resampler));
+    if (!rs)
+        return -ENOMEM;
+
+    rs->itfe.set_sample_rate = resampler_set_sample_rate;
+    rs->itfe.resample_from_provider = resampler_resample_from_provider;
+    rs->itfe.resample_from_input = resampler_resample_from_input;
+    rs->itfe.reset = resampler_reset;
+    rs->itfe.delay_ns = resampler_delay_ns;
+    rs->provider = provider;
+    rs->channels = channelCount;
+    resampler_set_sample_rate(&rs->itfe, inSampleRate, outSampleRate);
+    resampler_reset(&rs->itfe);
+
+    *resampler = &rs->itfe;
+    return 0;
+}
+
+void release_resampler(struct resampler_itfe *resampler)
+{
+    free(resampler);
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host stand-in for libsecril-client, dlopen()ed by ril_interface.c. Every
+ * request to the modem takes FAKE_RIL_DELAY_US microseconds, like the round
+ * trip through rild on the device.
+ */
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "ril_interface.h"
+
+struct fake_ril_client {
+    int connected;
+    unsigned int delay_us;
+};
+
+static int fake_ril_request(struct fake_ril_client *client)
+{
+    struct timespec ts;
+
+    if (!client->connected)
+        return RIL_CLIENT_ERR_CONNECT;
+
+    if (client->delay_us > 0) {
+        ts.tv_sec = client->delay_us / 1000000;
+        ts.tv_nsec = (client->delay_us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+void *OpenClient_RILD(void)
+{
+    struct fake_ril_client *client = calloc(1, sizeof(struct fake_ril_client));
+    const char *delay = getenv("FAKE_RIL_DELAY_US");
+
+    if (client && delay)
+        client->delay_us = atoi(delay);
+    return client;
+}
+
+int CloseClient_RILD(void *client)
+{
+    free(client);
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+int Connect_RILD(void *client)
+{
+    ((struct fake_ril_client *)client)->connected = 1;
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+int isConnected_RILD(void *client)
+{
+    return ((struct fake_ril_client *)client)->connected;
+}
+
+int Disconnect_RILD(void *client)
+{
+    ((struct fake_ril_client *)client)->connected = 0;
+    return RIL_CLIENT_ERR_SUCCESS;
+}
+
+int SetCallVolume(void *client, enum ril_sound_type type, int level)
+{
+    return fake_ril_request(client);
+}
+
+int SetCallAudioPath(void *client, enum ril_audio_path path, int mode)
+{
+    return fake_ril_request(client);
+}
+
+int SetCallClockSync(void *client, enum ril_clock_state state)
+{
+    return fake_ril_request(client);
+}
+
+int SetMute(void *client, int state)
+{
+    return fake_ril_request(client);
+}
+
+int SetTwoMicControl(void *client, enum ril_two_mic_device device,
+                     enum ril_two_mic_state state)
+{
+    return fake_ril_request(client);
+}
+
+int RegisterUnsolicitedHandler(void *client, int id, void *handler)
+{
+    return RIL_CLIENT_ERR_SUCCESS;
+}
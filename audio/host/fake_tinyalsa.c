@@ -0,0 +1,646 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "fake_alsa.h"
+
+#define NSEC_PER_SEC 1000000000LL
+
+#define FAKE_TONE_HZ 1000
+#define FAKE_TONE_LEVEL 3277    /* -20 dBFS */
+
+struct pcm {
+    unsigned int flags;
+    unsigned int device;
+    struct pcm_config config;
+    unsigned int buffer_size;
+    unsigned int granule;       /* frames the hardware pointer moves by */
+    int16_t *buffer;            /* mmap area */
+    char error[PCM_ERROR_MAX];
+
+    bool running;
+    int64_t start_ns;           /* hw_ptr was hw_base then */
+    uint64_t hw_base;
+    uint64_t hw_ptr;            /* frames played or captured */
+    uint64_t appl_ptr;          /* frames written or read */
+    struct fake_pcm_stats *stats;
+};
+
+struct mixer_ctl {
+    char *name;
+    int value;
+};
+
+struct mixer {
+    struct mixer_ctl **ctls;
+    unsigned int num_ctls;
+    unsigned int ctls_size;
+};
+
+static pthread_mutex_t fake_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct fake_pcm_timing fake_timing = { 16, 0 };
+static int64_t fake_capture_fail_ns;    /* capture stopped until then */
+static struct fake_pcm_stats fake_stats[FAKE_PCM_DEVICES][2];
+static unsigned int fake_ctl_write_us;
+static bool fake_ctl_sleep;
+static struct fake_mixer_stats fake_mixer;
+static fake_mixer_observer_t fake_observer;
+static void *fake_observer_context;
+
+static int64_t fake_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static void fake_sleep_until(int64_t ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec = ns / NSEC_PER_SEC;
+    ts.tv_nsec = ns % NSEC_PER_SEC;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+void fake_pcm_set_timing(const struct fake_pcm_timing *timing)
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_timing = *timing;
+    if (fake_timing.burst_frames == 0)
+        fake_timing.burst_frames = 1;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_pcm_fail_capture(unsigned int ms)
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_capture_fail_ns = fake_now_ns() + ms * 1000000LL;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+bool fake_pcm_get_stats(unsigned int device, bool capture,
+                        struct fake_pcm_stats *stats)
+{
+    if (device >= FAKE_PCM_DEVICES)
+        return false;
+
+    pthread_mutex_lock(&fake_lock);
+    *stats = fake_stats[device][capture];
+    pthread_mutex_unlock(&fake_lock);
+    return stats->opens > 0;
+}
+
+void fake_pcm_reset_stats(void)
+{
+    pthread_mutex_lock(&fake_lock);
+    memset(fake_stats, 0, sizeof(fake_stats));
+    pthread_mutex_unlock(&fake_lock);
+}
+
+static bool pcm_is_capture(struct pcm *pcm)
+{
+    return (pcm->flags & PCM_IN) != 0;
+}
+
+/* time the hardware pointer reaches frame, while running */
+static int64_t pcm_frame_time(struct pcm *pcm, uint64_t frame)
+{
+    return pcm->start_ns + (int64_t)(frame - pcm->hw_base) * NSEC_PER_SEC /
+            pcm->config.rate + fake_timing.wakeup_us * 1000LL;
+}
+
+/* move the hardware pointer to now and detect xruns */
+static void pcm_update(struct pcm *pcm)
+{
+    uint64_t frames;
+    uint64_t lost;
+
+    if (!pcm->running)
+        return;
+
+    frames = (uint64_t)(fake_now_ns() - pcm->start_ns) * pcm->config.rate /
+            NSEC_PER_SEC;
+    pcm->hw_ptr = pcm->hw_base + frames / pcm->granule * pcm->granule;
+
+    if (!pcm_is_capture(pcm)) {
+        /* the DMA played past the frames written, the pointer stops there
+         * like a real stop_threshold of buffer_size */
+        if (pcm->hw_ptr > pcm->appl_ptr) {
+            pcm->running = false;
+            pthread_mutex_lock(&fake_lock);
+            pcm->stats->xruns++;
+            pcm->stats->running = false;
+            pthread_mutex_unlock(&fake_lock);
+        }
+        return;
+    }
+
+    /* frames not read within the buffer are overwritten */
+    if (pcm->hw_ptr - pcm->appl_ptr >= pcm->config.stop_threshold) {
+        pcm->running = false;
+        pthread_mutex_lock(&fake_lock);
+        pcm->stats->xruns++;
+        pcm->stats->running = false;
+        pthread_mutex_unlock(&fake_lock);
+    } else if (pcm->hw_ptr - pcm->appl_ptr > pcm->buffer_size) {
+        lost = pcm->hw_ptr - pcm->appl_ptr - pcm->buffer_size;
+        pcm->appl_ptr += lost;
+    }
+}
+
+static void pcm_set_running(struct pcm *pcm, bool running)
+{
+    pcm->running = running;
+    pthread_mutex_lock(&fake_lock);
+    pcm->stats->running = running;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+static void pcm_account(struct pcm *pcm, unsigned int frames)
+{
+    pthread_mutex_lock(&fake_lock);
+    pcm->stats->frames += frames;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+struct pcm *pcm_open(unsigned int card, unsigned int device,
+                     unsigned int flags, struct pcm_config *config)
+{
+    struct pcm *pcm;
+
+    pcm = calloc(1, sizeof(struct pcm));
+    if (!pcm)
+        return NULL;
+
+    pcm->flags = flags;
+    pcm->device = device;
+    pcm->config = *config;
+    pcm->buffer_size = config->period_size * config->period_count;
+
+    /* same defaults as tinyalsa */
+    if (!pcm->config.start_threshold)
+        pcm->config.start_threshold = (flags & PCM_IN) ? 1 : pcm->buffer_size / 2;
+    if (!pcm->config.stop_threshold)
+        pcm->config.stop_threshold = (flags & PCM_IN) ?
+                pcm->buffer_size * 10 : pcm->buffer_size;
+
+    pthread_mutex_lock(&fake_lock);
+    pcm->granule = (flags & PCM_NOIRQ) ? fake_timing.burst_frames :
+            config->period_size;
+    pthread_mutex_unlock(&fake_lock);
+
+    if (device >= FAKE_PCM_DEVICES || config->rate == 0 ||
+            pcm->buffer_size == 0 || config->format != PCM_FORMAT_S16_LE) {
+        snprintf(pcm->error, sizeof(pcm->error), "cannot open device %u",
+                 device);
+        return pcm;
+    }
+
+    if (flags & PCM_MMAP) {
+        pcm->buffer = calloc(pcm->buffer_size, config->channels * sizeof(int16_t));
+        if (!pcm->buffer) {
+            snprintf(pcm->error, sizeof(pcm->error), "cannot map buffer");
+            return pcm;
+        }
+    }
+
+    pthread_mutex_lock(&fake_lock);
+    pcm->stats = &fake_stats[device][(flags & PCM_IN) != 0];
+    pcm->stats->opens++;
+    pcm->stats->open_flags = flags;
+    pcm->stats->config = pcm->config;
+    pcm->stats->running = false;
+    pthread_mutex_unlock(&fake_lock);
+
+    return pcm;
+}
+
+int pcm_close(struct pcm *pcm)
+{
+    if (!pcm)
+        return 0;
+
+    if (pcm->stats)
+        pcm_set_running(pcm, false);
+    free(pcm->buffer);
+    free(pcm);
+    return 0;
+}
+
+int pcm_is_ready(struct pcm *pcm)
+{
+    return pcm->stats != NULL;
+}
+
+const char *pcm_get_error(struct pcm *pcm)
+{
+    return pcm ? pcm->error : "no pcm";
+}
+
+unsigned int pcm_get_buffer_size(struct pcm *pcm)
+{
+    return pcm->buffer_size;
+}
+
+unsigned int pcm_format_to_bits(enum pcm_format format)
+{
+    return (format == PCM_FORMAT_S16_LE) ? 16 : 32;
+}
+
+unsigned int pcm_frames_to_bytes(struct pcm *pcm, unsigned int frames)
+{
+    return frames * pcm->config.channels * sizeof(int16_t);
+}
+
+unsigned int pcm_bytes_to_frames(struct pcm *pcm, unsigned int bytes)
+{
+    return bytes / (pcm->config.channels * sizeof(int16_t));
+}
+
+int pcm_prepare(struct pcm *pcm)
+{
+    pcm_set_running(pcm, false);
+    pcm->hw_base = 0;
+    pcm->hw_ptr = 0;
+    pcm->appl_ptr = 0;
+    return 0;
+}
+
+int pcm_start(struct pcm *pcm)
+{
+    if (pcm->running)
+        return 0;
+
+    pcm->start_ns = fake_now_ns();
+    pcm->hw_base = pcm->hw_ptr;
+    pcm_set_running(pcm, true);
+    return 0;
+}
+
+int pcm_stop(struct pcm *pcm)
+{
+    pcm_update(pcm);
+    pcm_set_running(pcm, false);
+    return 0;
+}
+
+/* frames the application may write or read */
+static unsigned int pcm_avail(struct pcm *pcm)
+{
+    if (pcm_is_capture(pcm))
+        return pcm->hw_ptr - pcm->appl_ptr;
+    return pcm->buffer_size - (pcm->appl_ptr - pcm->hw_ptr);
+}
+
+int pcm_avail_update(struct pcm *pcm)
+{
+    pcm_update(pcm);
+    /* may exceed the buffer size after an xrun, like the kernel pointer */
+    if (pcm_is_capture(pcm))
+        return (int)(pcm->hw_ptr - pcm->appl_ptr);
+    return (int)(pcm->hw_ptr + pcm->buffer_size - pcm->appl_ptr);
+}
+
+int pcm_get_htimestamp(struct pcm *pcm, unsigned int *avail,
+                       struct timespec *tstamp)
+{
+    int64_t ns;
+
+    pcm_update(pcm);
+    if (!pcm->running)
+        return -1;
+
+    *avail = pcm_avail(pcm);
+    ns = pcm_frame_time(pcm, pcm->hw_ptr) - fake_timing.wakeup_us * 1000LL;
+    tstamp->tv_sec = ns / NSEC_PER_SEC;
+    tstamp->tv_nsec = ns % NSEC_PER_SEC;
+    return 0;
+}
+
+/* block until the hardware pointer moves by one granule */
+static void pcm_wait_granule(struct pcm *pcm)
+{
+    fake_sleep_until(pcm_frame_time(pcm, pcm->hw_ptr + pcm->granule));
+}
+
+int pcm_wait(struct pcm *pcm, int timeout)
+{
+    pcm_update(pcm);
+    if (pcm->running && pcm_avail(pcm) < (unsigned int)pcm->config.avail_min)
+        pcm_wait_granule(pcm);
+    return 1;
+}
+
+int pcm_write(struct pcm *pcm, const void *data, unsigned int count)
+{
+    unsigned int frames = pcm_bytes_to_frames(pcm, count);
+    unsigned int avail;
+    unsigned int chunk;
+
+    if (pcm_is_capture(pcm) || (pcm->flags & PCM_MMAP))
+        return -EINVAL;
+
+    pcm_update(pcm);
+    if (!pcm->running && pcm->appl_ptr > 0 && pcm->hw_ptr > pcm->appl_ptr) {
+        /* the underrun is reported once, the next write restarts */
+        pcm_prepare(pcm);
+        snprintf(pcm->error, sizeof(pcm->error), "underrun");
+        if (pcm->flags & PCM_NORESTART)
+            return -EPIPE;
+    }
+
+    while (frames > 0) {
+        pcm_update(pcm);
+        avail = pcm_avail(pcm);
+        if (avail == 0) {
+            pcm_wait_granule(pcm);
+            continue;
+        }
+        chunk = (avail < frames) ? avail : frames;
+        pcm->appl_ptr += chunk;
+        frames -= chunk;
+        pcm_account(pcm, chunk);
+        if (!pcm->running && pcm->appl_ptr >= pcm->config.start_threshold)
+            pcm_start(pcm);
+    }
+
+    return 0;
+}
+
+static void pcm_fill_tone(struct pcm *pcm, int16_t *data, uint64_t frame,
+                          unsigned int frames)
+{
+    unsigned int i, c;
+    int16_t sample;
+
+    for (i = 0; i < frames; i++) {
+        sample = (int16_t)(FAKE_TONE_LEVEL *
+                sin(2.0 * M_PI * FAKE_TONE_HZ * (double)(frame + i) /
+                    pcm->config.rate));
+        for (c = 0; c < pcm->config.channels; c++)
+            *data++ = sample;
+    }
+}
+
+int pcm_read(struct pcm *pcm, void *data, unsigned int count)
+{
+    unsigned int frames = pcm_bytes_to_frames(pcm, count);
+    unsigned int chunk;
+    int16_t *out = data;
+    int64_t fail_ns;
+
+    if (!pcm_is_capture(pcm) || (pcm->flags & PCM_MMAP))
+        return -EINVAL;
+
+    pthread_mutex_lock(&fake_lock);
+    fail_ns = fake_capture_fail_ns;
+    pthread_mutex_unlock(&fake_lock);
+    if (fake_now_ns() < fail_ns) {
+        fake_sleep_until(fail_ns);
+        snprintf(pcm->error, sizeof(pcm->error), "input/output error");
+        return -EIO;
+    }
+
+    pcm_update(pcm);
+    if (!pcm->running) {
+        /* tinyalsa restarts a capture that overran */
+        pcm_prepare(pcm);
+        pcm_start(pcm);
+    }
+
+    while (frames > 0) {
+        pcm_update(pcm);
+        if (!pcm->running) {
+            snprintf(pcm->error, sizeof(pcm->error), "overrun");
+            pcm_prepare(pcm);
+            pcm_start(pcm);
+            continue;
+        }
+        chunk = pcm_avail(pcm);
+        if (chunk == 0) {
+            pcm_wait_granule(pcm);
+            continue;
+        }
+        if (chunk > frames)
+            chunk = frames;
+        pcm_fill_tone(pcm, out, pcm->appl_ptr, chunk);
+        out += chunk * pcm->config.channels;
+        pcm->appl_ptr += chunk;
+        frames -= chunk;
+        pcm_account(pcm, chunk);
+    }
+
+    return 0;
+}
+
+int pcm_mmap_begin(struct pcm *pcm, void **areas, unsigned int *offset,
+                   unsigned int *frames)
+{
+    unsigned int avail;
+    unsigned int contiguous;
+
+    if (!pcm->buffer)
+        return -EINVAL;
+
+    pcm_update(pcm);
+    avail = pcm_avail(pcm);
+    if (avail > pcm->buffer_size)
+        avail = pcm->buffer_size;
+    *offset = pcm->appl_ptr % pcm->buffer_size;
+    contiguous = pcm->buffer_size - *offset;
+    if (*frames > avail)
+        *frames = avail;
+    if (*frames > contiguous)
+        *frames = contiguous;
+    *areas = pcm->buffer;
+    return 0;
+}
+
+int pcm_mmap_commit(struct pcm *pcm, unsigned int offset, unsigned int frames)
+{
+    pcm->appl_ptr += frames;
+    pcm_account(pcm, frames);
+    return frames;
+}
+
+/* mixer controls, created on their first lookup */
+
+struct mixer *mixer_open(unsigned int card)
+{
+    return calloc(1, sizeof(struct mixer));
+}
+
+void mixer_close(struct mixer *mixer)
+{
+    unsigned int i;
+
+    if (!mixer)
+        return;
+
+    for (i = 0; i < mixer->num_ctls; i++) {
+        free(mixer->ctls[i]->name);
+        free(mixer->ctls[i]);
+    }
+    free(mixer->ctls);
+    free(mixer);
+}
+
+unsigned int mixer_get_num_ctls(struct mixer *mixer)
+{
+    return mixer->num_ctls;
+}
+
+struct mixer_ctl *mixer_get_ctl(struct mixer *mixer, unsigned int id)
+{
+    return (id < mixer->num_ctls) ? mixer->ctls[id] : NULL;
+}
+
+struct mixer_ctl *mixer_get_ctl_by_name(struct mixer *mixer, const char *name)
+{
+    struct mixer_ctl **ctls;
+    struct mixer_ctl *ctl;
+    unsigned int i;
+
+    for (i = 0; i < mixer->num_ctls; i++)
+        if (strcmp(mixer->ctls[i]->name, name) == 0)
+            return mixer->ctls[i];
+
+    if (mixer->num_ctls == mixer->ctls_size) {
+        ctls = realloc(mixer->ctls, (mixer->ctls_size * 2 + 16) * sizeof(*ctls));
+        if (!ctls)
+            return NULL;
+        mixer->ctls = ctls;
+        mixer->ctls_size = mixer->ctls_size * 2 + 16;
+    }
+
+    ctl = calloc(1, sizeof(struct mixer_ctl));
+    if (!ctl)
+        return NULL;
+    ctl->name = strdup(name);
+    mixer->ctls[mixer->num_ctls++] = ctl;
+
+    pthread_mutex_lock(&fake_lock);
+    fake_mixer.ctls++;
+    pthread_mutex_unlock(&fake_lock);
+    return ctl;
+}
+
+const char *mixer_ctl_get_name(struct mixer_ctl *ctl)
+{
+    return ctl->name;
+}
+
+enum mixer_ctl_type mixer_ctl_get_type(struct mixer_ctl *ctl)
+{
+    return MIXER_CTL_TYPE_INT;
+}
+
+unsigned int mixer_ctl_get_num_values(struct mixer_ctl *ctl)
+{
+    return 1;
+}
+
+unsigned int mixer_ctl_get_num_enums(struct mixer_ctl *ctl)
+{
+    return 0;
+}
+
+const char *mixer_ctl_get_enum_string(struct mixer_ctl *ctl,
+                                      unsigned int enum_id)
+{
+    return NULL;
+}
+
+int mixer_ctl_get_value(struct mixer_ctl *ctl, unsigned int id)
+{
+    return ctl->value;
+}
+
+int mixer_ctl_set_value(struct mixer_ctl *ctl, unsigned int id, int value)
+{
+    unsigned int cost_us;
+    bool sleep;
+    fake_mixer_observer_t observer;
+    void *context;
+    struct timespec ts;
+
+    pthread_mutex_lock(&fake_lock);
+    cost_us = fake_ctl_write_us;
+    sleep = fake_ctl_sleep;
+    observer = fake_observer;
+    context = fake_observer_context;
+    fake_mixer.writes++;
+    fake_mixer.cost_us += cost_us;
+    pthread_mutex_unlock(&fake_lock);
+
+    ctl->value = value;
+    if (observer)
+        observer(context, ctl->name, value);
+
+    if (sleep && cost_us > 0) {
+        ts.tv_sec = cost_us / 1000000;
+        ts.tv_nsec = (cost_us % 1000000) * 1000;
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+int mixer_ctl_set_enum_by_string(struct mixer_ctl *ctl, const char *string)
+{
+    return mixer_ctl_set_value(ctl, 0, atoi(string));
+}
+
+void fake_mixer_set_cost(unsigned int ctl_write_us, bool sleep)
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_ctl_write_us = ctl_write_us;
+    fake_ctl_sleep = sleep;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_mixer_set_observer(fake_mixer_observer_t observer, void *context)
+{
+    pthread_mutex_lock(&fake_lock);
+    fake_observer = observer;
+    fake_observer_context = context;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_mixer_get_stats(struct fake_mixer_stats *stats)
+{
+    pthread_mutex_lock(&fake_lock);
+    *stats = fake_mixer;
+    pthread_mutex_unlock(&fake_lock);
+}
+
+void fake_mixer_reset_stats(void)
+{
+    pthread_mutex_lock(&fake_lock);
+    memset(&fake_mixer, 0, sizeof(fake_mixer));
+    pthread_mutex_unlock(&fake_lock);
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Bionic functions audio_hw uses that glibc lacks.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+int pthread_cond_timeout_np(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                            unsigned int msecs)
+{
+    struct timespec ts;
+
+    /* the condition variables of audio_hw use the default CLOCK_REALTIME */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += msecs / 1000;
+    ts.tv_nsec += (msecs % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(cond, mutex, &ts);
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Benchmark of the kvpairs.c parser against libcutils str_parms, on the
+ * strings AudioFlinger, AudioService and the telephony stack pass to the
+ * set_parameters() and get_parameters() entry points. Each string is first
+ * checked to give the same value as str_parms for every key, then both
+ * paths are timed the way the entry points use them: str_parms creates a
+ * map, looks up each key the HAL handles and destroys it, kvpairs parses
+ * once on the stack and reads the keys found. The get cases also build the
+ * reply and return its heap copy.
+ *
+ * usage: kvpairs_bench [-n iterations]
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cutils/str_parms.h>
+
+#include "audio_hw_params.h"
+#include "kvpairs.h"
+
+#define BENCH_ROUNDS 50
+#define DEFAULT_ITERATIONS 2000
+
+struct bench_case {
+    const char *name;
+    const char *str;
+    bool get;           /* a get_parameters() query */
+};
+
+static const struct bench_case cases[] = {
+    { "output routing", "routing=2", false },
+    { "input routing", "input_source=7;routing=-2147483644", false },
+    { "bt sco connect",
+      "bt_headset_name=Headset;bt_headset_nrec=on;bt_samplerate=8000", false },
+    { "noise suppression", "noise_suppression=off", false },
+    { "unknown key", "screen_state=on", false },
+    { "sup_channels query", "sup_channels", true },
+    { "counters query", "underruns;hw_xruns;hw_errors;hw_reopens", true },
+    { "capture position", "capture_position", true },
+};
+
+#define NUM_CASES (sizeof(cases) / sizeof(cases[0]))
+
+/* corner cases only checked against str_parms */
+static const char *check_strs[] = {
+    "", ";", ";;routing=2;", "routing", "routing=", "routing=2;routing=3",
+    "=2", "routingx=2", "routin=2", "bt_headset_nrec=on=off",
+};
+
+#define NUM_CHECK_STRS (sizeof(check_strs) / sizeof(check_strs[0]))
+
+/* reply value of every get key, a channel list or a counter */
+static const char *reply_value(unsigned int key)
+{
+    return key == GET_KEY_SUP_CHANNELS ? "AUDIO_CHANNEL_OUT_STEREO" : "0";
+}
+
+static bool check_str(const char *str, const struct kvpairs_key *keys,
+                      unsigned int num_keys)
+{
+    struct str_parms *parms;
+    struct kvpairs pairs;
+    char value[64], value_kv[64];
+    unsigned int key;
+    int ret, ret_kv;
+    bool same = true;
+
+    parms = str_parms_create_str(str);
+    kvpairs_parse(&pairs, str, keys, num_keys);
+
+    for (key = 0; key < num_keys; key++) {
+        ret = str_parms_get_str(parms, keys[key].name, value, sizeof(value));
+        ret_kv = kvpairs_get_str(&pairs, key, value_kv, sizeof(value_kv));
+        if (ret < 0 && ret_kv < 0)
+            continue;
+        if (ret >= 0 && ret_kv >= 0 && strcmp(value, value_kv) == 0)
+            continue;
+        printf("\"%s\": %s is %s with str_parms, %s with kvpairs\n", str,
+               keys[key].name, ret < 0 ? "absent" : value,
+               ret_kv < 0 ? "absent" : value_kv);
+        same = false;
+    }
+
+    str_parms_destroy(parms);
+    return same;
+}
+
+static void set_str_parms(const char *str)
+{
+    struct str_parms *parms;
+    char value[32];
+    unsigned int key;
+
+    parms = str_parms_create_str(str);
+    for (key = 0; key < SET_KEY_CNT; key++)
+        str_parms_get_str(parms, set_keys[key].name, value, sizeof(value));
+    str_parms_destroy(parms);
+}
+
+static void set_kvpairs(const char *str)
+{
+    struct kvpairs pairs;
+    char value[32];
+    unsigned int key;
+
+    kvpairs_parse(&pairs, str, set_keys, SET_KEY_CNT);
+    for (key = 0; key < SET_KEY_CNT; key++) {
+        if (kvpairs_has(&pairs, key))
+            kvpairs_get_str(&pairs, key, value, sizeof(value));
+    }
+}
+
+static void get_str_parms(const char *str)
+{
+    struct str_parms *query;
+    struct str_parms *reply;
+    char value[32];
+    unsigned int key;
+    char *reply_str;
+
+    query = str_parms_create_str(str);
+    reply = str_parms_create();
+    for (key = 0; key < GET_KEY_CNT; key++) {
+        if (str_parms_get_str(query, get_keys[key].name, value,
+                              sizeof(value)) >= 0)
+            str_parms_add_str(reply, get_keys[key].name, reply_value(key));
+    }
+    reply_str = str_parms_to_str(reply);
+    free(strdup(reply_str));
+    free(reply_str);
+    str_parms_destroy(query);
+    str_parms_destroy(reply);
+}
+
+static void get_kvpairs(const char *str)
+{
+    struct kvpairs query;
+    struct kvpairs_reply reply;
+    unsigned int key;
+
+    kvpairs_parse(&query, str, get_keys, GET_KEY_CNT);
+    kvpairs_reply_init(&reply);
+    for (key = 0; key < GET_KEY_CNT; key++) {
+        if (kvpairs_has(&query, key))
+            kvpairs_reply_add_str(&reply, get_keys[key].name,
+                                  reply_value(key));
+    }
+    free(kvpairs_reply_to_str(&reply));
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* best of BENCH_ROUNDS, per call */
+static double time_path(void (*fn)(const char *str), const char *str,
+                        unsigned int iterations)
+{
+    uint64_t best = UINT64_MAX;
+    uint64_t start, elapsed;
+    unsigned int round, i;
+
+    for (round = 0; round < BENCH_ROUNDS; round++) {
+        start = now_ns();
+        for (i = 0; i < iterations; i++)
+            fn(str);
+        elapsed = now_ns() - start;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    return (double)best / iterations;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned int iterations = DEFAULT_ITERATIONS;
+    unsigned int i;
+    double t, t_kv;
+    int failed = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n iterations]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations == 0)
+        iterations = 1;
+
+    for (i = 0; i < NUM_CHECK_STRS; i++) {
+        if (!check_str(check_strs[i], set_keys, SET_KEY_CNT))
+            failed++;
+    }
+
+    printf("ns per call, best of %d x %u calls\n", BENCH_ROUNDS, iterations);
+    printf("%-20s %-9s %10s %10s %7s\n", "case", "check", "str_parms",
+           "kvpairs", "ratio");
+
+    for (i = 0; i < NUM_CASES; i++) {
+        bool same;
+
+        if (cases[i].get) {
+            same = check_str(cases[i].str, get_keys, GET_KEY_CNT);
+            t = time_path(get_str_parms, cases[i].str, iterations);
+            t_kv = time_path(get_kvpairs, cases[i].str, iterations);
+        } else {
+            same = check_str(cases[i].str, set_keys, SET_KEY_CNT);
+            t = time_path(set_str_parms, cases[i].str, iterations);
+            t_kv = time_path(set_kvpairs, cases[i].str, iterations);
+        }
+        if (!same)
+            failed++;
+        printf("%-20s %-9s %10.0f %10.0f %6.1fx\n", cases[i].name,
+               same ? "same" : "MISMATCH", t, t_kv, t / t_kv);
+    }
+
+    return failed ? 1 : 0;
+}
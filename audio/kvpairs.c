@@ -0,0 +1,149 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_kvpairs"
+/*#define LOG_NDEBUG 0*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+#include "kvpairs.h"
+
+static int kvpairs_find_key(const struct kvpairs_key *keys,
+                            unsigned int num_keys, const char *name,
+                            size_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < num_keys; i++) {
+        if (keys[i].len == len && memcmp(keys[i].name, name, len) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int kvpairs_parse(struct kvpairs *pairs, const char *str,
+                  const struct kvpairs_key *keys, unsigned int num_keys)
+{
+    const char *end;
+    const char *eq;
+    size_t len;
+    int found = 0;
+    int key;
+
+    memset(pairs, 0, sizeof(struct kvpairs));
+    if (num_keys > KVPAIRS_MAX_KEYS) {
+        ALOGE("%s: %u keys, at most %d are supported", __func__, num_keys,
+              KVPAIRS_MAX_KEYS);
+        num_keys = KVPAIRS_MAX_KEYS;
+    }
+
+    while (*str) {
+        end = strchr(str, ';');
+        if (!end)
+            end = str + strlen(str);
+        len = end - str;
+        eq = memchr(str, '=', len);
+
+        key = kvpairs_find_key(keys, num_keys, str, eq ? (size_t)(eq - str) : len);
+        if (key >= 0) {
+            if (!pairs->value[key])
+                found++;
+            pairs->value[key] = eq ? eq + 1 : end;
+            pairs->len[key] = eq ? (size_t)(end - eq - 1) : 0;
+        }
+
+        str = *end ? end + 1 : end;
+    }
+
+    return found;
+}
+
+int kvpairs_get_str(const struct kvpairs *pairs, unsigned int key,
+                    char *value, size_t size)
+{
+    size_t len;
+
+    if (!pairs->value[key])
+        return -ENOENT;
+
+    len = pairs->len[key];
+    if (len >= size)
+        len = size - 1;
+    memcpy(value, pairs->value[key], len);
+    value[len] = '\0';
+    return len;
+}
+
+int kvpairs_get_int(const struct kvpairs *pairs, unsigned int key, int *value)
+{
+    char str[16];
+    int ret;
+
+    ret = kvpairs_get_str(pairs, key, str, sizeof(str));
+    if (ret < 0)
+        return ret;
+
+    *value = atoi(str);
+    return 0;
+}
+
+bool kvpairs_value_is(const struct kvpairs *pairs, unsigned int key,
+                      const char *value)
+{
+    return pairs->value[key] && pairs->len[key] == strlen(value) &&
+            memcmp(pairs->value[key], value, pairs->len[key]) == 0;
+}
+
+void kvpairs_reply_init(struct kvpairs_reply *reply)
+{
+    reply->str[0] = '\0';
+    reply->len = 0;
+}
+
+void kvpairs_reply_add_str(struct kvpairs_reply *reply, const char *key,
+                           const char *value)
+{
+    size_t avail = sizeof(reply->str) - reply->len;
+    int ret;
+
+    ret = snprintf(reply->str + reply->len, avail, "%s%s=%s",
+                   reply->len ? ";" : "", key, value);
+    if (ret < 0 || (size_t)ret >= avail) {
+        ALOGW("%s: no room for %s", __func__, key);
+        reply->str[reply->len] = '\0';
+        return;
+    }
+    reply->len += ret;
+}
+
+void kvpairs_reply_add_int(struct kvpairs_reply *reply, const char *key,
+                           int value)
+{
+    char str[16];
+
+    snprintf(str, sizeof(str), "%d", value);
+    kvpairs_reply_add_str(reply, key, str);
+}
+
+char *kvpairs_reply_to_str(const struct kvpairs_reply *reply)
+{
+    return strdup(reply->str);
+}
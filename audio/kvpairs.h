@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef KVPAIRS_H
+#define KVPAIRS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Allocation free parsing of the "key1=value1;key2=value2" strings passed to
+ * the set_parameters() and get_parameters() entry points.
+ *
+ * Callers describe the keys they handle in a constant table indexed by their
+ * own key ids. Parsing walks the string once, matching each key against the
+ * table by length first, and records where the value of every known key
+ * starts in the caller's string; nothing is copied until a value is read.
+ * Unknown keys are ignored and, as with str_parms, the last occurrence of a
+ * key wins. A key without '=' has an empty value, which is how
+ * get_parameters() queries are written.
+ */
+
+#define KVPAIRS_MAX_KEYS 16
+#define KVPAIRS_REPLY_SIZE 256
+
+struct kvpairs_key {
+    const char *name;
+    size_t len;
+};
+
+#define KVPAIRS_KEY(name) { (name), sizeof(name) - 1 }
+
+struct kvpairs {
+    const char *value[KVPAIRS_MAX_KEYS];    /* NULL if the key is absent */
+    size_t len[KVPAIRS_MAX_KEYS];
+};
+
+/* returns the number of known keys found in str */
+int kvpairs_parse(struct kvpairs *pairs, const char *str,
+                  const struct kvpairs_key *keys, unsigned int num_keys);
+
+static inline bool kvpairs_has(const struct kvpairs *pairs, unsigned int key)
+{
+    return pairs->value[key] != NULL;
+}
+
+/* same return values as str_parms_get_str(): the length or -ENOENT */
+int kvpairs_get_str(const struct kvpairs *pairs, unsigned int key,
+                    char *value, size_t size);
+int kvpairs_get_int(const struct kvpairs *pairs, unsigned int key, int *value);
+bool kvpairs_value_is(const struct kvpairs *pairs, unsigned int key,
+                      const char *value);
+
+/*
+ * get_parameters() reply built in place. Pairs that do not fit are dropped
+ * with a warning.
+ */
+struct kvpairs_reply {
+    char str[KVPAIRS_REPLY_SIZE];
+    size_t len;
+};
+
+void kvpairs_reply_init(struct kvpairs_reply *reply);
+void kvpairs_reply_add_str(struct kvpairs_reply *reply, const char *key,
+                           const char *value);
+void kvpairs_reply_add_int(struct kvpairs_reply *reply, const char *key,
+                           int value);
+static inline bool kvpairs_reply_empty(const struct kvpairs_reply *reply)
+{
+    return reply->len == 0;
+}
+/* heap copy of the reply, as get_parameters() returns to its caller */
+char *kvpairs_reply_to_str(const struct kvpairs_reply *reply);
+
+#endif
@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Host tool compiling mixer_paths.xml and route_configs[][] into the route
+ * table described in route_table.h:
+ *
+ *     mixer_paths_compiler mixer_paths.xml mixer_paths.bin
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <expat.h>
+
+#include "route_table.h"
+#include "routing.h"
+
+struct settings {
+    struct route_table_setting *items;
+    uint32_t count;
+    uint32_t size;
+};
+
+struct compiler {
+    const char *xml;
+    XML_Parser parser;
+    int depth;
+    int error;
+
+    char *strings;
+    uint32_t strings_size;
+    uint32_t strings_alloc;
+
+    uint32_t *ctls;             /* string offsets */
+    uint32_t num_ctls;
+    uint32_t ctls_size;
+
+    struct settings initial;
+    struct settings settings;   /* settings of all paths */
+    struct route_table_path *paths;
+    uint32_t num_paths;
+    uint32_t paths_size;
+    struct route_table_path *cur_path;  /* path being defined */
+};
+
+static void *grow(void *array, uint32_t count, uint32_t *size, size_t item_size)
+{
+    if (count < *size)
+        return array;
+
+    *size = *size ? *size * 2 : 64;
+    array = realloc(array, *size * item_size);
+    if (!array) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return array;
+}
+
+static void parse_error(struct compiler *c, const char *msg, const char *arg)
+{
+    fprintf(stderr, "%s:%lu: %s%s%s\n", c->xml,
+            (unsigned long)XML_GetCurrentLineNumber(c->parser), msg,
+            arg ? ": " : "", arg ? arg : "");
+    c->error = 1;
+}
+
+static uint32_t add_string(struct compiler *c, const char *str)
+{
+    uint32_t offset = 0;
+    size_t len = strlen(str) + 1;
+
+    while (offset < c->strings_size) {
+        if (strcmp(c->strings + offset, str) == 0)
+            return offset;
+        offset += strlen(c->strings + offset) + 1;
+    }
+
+    while (c->strings_size + len > c->strings_alloc)
+        c->strings = grow(c->strings, c->strings_alloc, &c->strings_alloc, 1);
+    memcpy(c->strings + c->strings_size, str, len);
+    c->strings_size += len;
+
+    return offset;
+}
+
+static uint32_t add_ctl(struct compiler *c, const char *name)
+{
+    uint32_t offset = add_string(c, name);
+    uint32_t i;
+
+    for (i = 0; i < c->num_ctls; i++) {
+        if (c->ctls[i] == offset)
+            return i;
+    }
+
+    c->ctls = grow(c->ctls, c->num_ctls, &c->ctls_size, sizeof(uint32_t));
+    c->ctls[c->num_ctls] = offset;
+    return c->num_ctls++;
+}
+
+/* a control set twice in a path keeps its first position and last value */
+static void add_setting(struct settings *s, uint32_t first,
+                        const struct route_table_setting *setting)
+{
+    uint32_t i;
+
+    for (i = first; i < s->count; i++) {
+        if (s->items[i].ctl == setting->ctl) {
+            s->items[i].value = setting->value;
+            return;
+        }
+    }
+
+    s->items = grow(s->items, s->count, &s->size, sizeof(*setting));
+    s->items[s->count++] = *setting;
+}
+
+static const char *get_attr(const XML_Char **attr, const char *name)
+{
+    for (; attr[0]; attr += 2) {
+        if (strcmp(attr[0], name) == 0)
+            return attr[1];
+    }
+    return NULL;
+}
+
+static struct route_table_path *find_path(struct compiler *c, const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < c->num_paths; i++) {
+        if (strcmp(c->strings + c->paths[i].name, name) == 0)
+            return &c->paths[i];
+    }
+    return NULL;
+}
+
+static void start_path(struct compiler *c, const char *name)
+{
+    struct route_table_path *path;
+    struct route_table_setting setting;
+    uint32_t i;
+
+    if (!name) {
+        parse_error(c, "path without a name", NULL);
+        return;
+    }
+
+    /* inside a path definition: include the settings of another path */
+    if (c->cur_path) {
+        path = find_path(c, name);
+        if (!path) {
+            parse_error(c, "unknown path", name);
+            return;
+        }
+        for (i = 0; i < path->num_settings; i++) {
+            /* add_setting() may move the items */
+            setting = c->settings.items[path->first_setting + i];
+            add_setting(&c->settings, c->cur_path->first_setting, &setting);
+        }
+        return;
+    }
+
+    if (find_path(c, name)) {
+        parse_error(c, "duplicate path", name);
+        return;
+    }
+
+    c->paths = grow(c->paths, c->num_paths, &c->paths_size, sizeof(*c->paths));
+    c->cur_path = &c->paths[c->num_paths++];
+    c->cur_path->name = add_string(c, name);
+    c->cur_path->first_setting = c->settings.count;
+    c->cur_path->num_settings = 0;
+}
+
+static void start_ctl(struct compiler *c, const XML_Char **attr)
+{
+    const char *name = get_attr(attr, "name");
+    const char *value = get_attr(attr, "value");
+    struct route_table_setting setting;
+
+    if (!name || !value) {
+        parse_error(c, "ctl needs a name and a value", name);
+        return;
+    }
+    if (get_attr(attr, "id")) {
+        parse_error(c, "ctl id is not supported", name);
+        return;
+    }
+
+    setting.ctl = add_ctl(c, name);
+    setting.value = add_string(c, value);
+
+    if (c->cur_path)
+        add_setting(&c->settings, c->cur_path->first_setting, &setting);
+    else
+        add_setting(&c->initial, 0, &setting);
+}
+
+static void start_tag(void *data, const XML_Char *tag, const XML_Char **attr)
+{
+    struct compiler *c = (struct compiler *)data;
+
+    if (strcmp(tag, "path") == 0)
+        start_path(c, get_attr(attr, "name"));
+    else if (strcmp(tag, "ctl") == 0)
+        start_ctl(c, attr);
+    else if (strcmp(tag, "mixer") != 0 || c->depth != 0)
+        parse_error(c, "unexpected element", tag);
+
+    c->depth++;
+}
+
+static void end_tag(void *data, const XML_Char *tag)
+{
+    struct compiler *c = (struct compiler *)data;
+
+    c->depth--;
+    if (strcmp(tag, "path") == 0 && c->depth == 1 && c->cur_path) {
+        c->cur_path->num_settings =
+                c->settings.count - c->cur_path->first_setting;
+        c->cur_path = NULL;
+    }
+}
+
+static int parse(struct compiler *c)
+{
+    char buf[4096];
+    FILE *file;
+    size_t len;
+    int done;
+
+    file = fopen(c->xml, "r");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", c->xml, strerror(errno));
+        return -1;
+    }
+
+    c->parser = XML_ParserCreate(NULL);
+    XML_SetUserData(c->parser, c);
+    XML_SetElementHandler(c->parser, start_tag, end_tag);
+
+    do {
+        len = fread(buf, 1, sizeof(buf), file);
+        done = len < sizeof(buf);
+        if (XML_Parse(c->parser, buf, len, done) == XML_STATUS_ERROR) {
+            parse_error(c, XML_ErrorString(XML_GetErrorCode(c->parser)), NULL);
+            break;
+        }
+    } while (!done && !c->error);
+
+    XML_ParserFree(c->parser);
+    fclose(file);
+    return c->error ? -1 : 0;
+}
+
+static uint32_t route_path(struct compiler *c, const char *name)
+{
+    struct route_table_path *path;
+
+    if (!name)
+        return ROUTE_TABLE_NO_PATH;
+
+    path = find_path(c, name);
+    if (!path) {
+        fprintf(stderr, "%s: warning: route_configs uses unknown path %s\n",
+                c->xml, name);
+        return ROUTE_TABLE_NO_PATH;
+    }
+    return path - c->paths;
+}
+
+static int write_table(struct compiler *c, const char *out)
+{
+    struct route_table_header header;
+    struct route_table_route routes[IN_SOURCE_TAB_SIZE][OUT_DEVICE_TAB_SIZE];
+    uint32_t pad = 0;
+    uint32_t i, j;
+    FILE *file;
+    int ret = 0;
+
+    for (i = 0; i < IN_SOURCE_TAB_SIZE; i++) {
+        for (j = 0; j < OUT_DEVICE_TAB_SIZE; j++) {
+            routes[i][j].output_path =
+                    route_path(c, route_configs[i][j]->output_route);
+            routes[i][j].input_path =
+                    route_path(c, route_configs[i][j]->input_route);
+        }
+    }
+
+    /* the initial settings come first, then the paths */
+    for (i = 0; i < c->num_paths; i++)
+        c->paths[i].first_setting += c->initial.count;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = ROUTE_TABLE_MAGIC;
+    header.version = ROUTE_TABLE_VERSION;
+    header.num_ctls = c->num_ctls;
+    header.ctls = sizeof(header);
+    header.num_settings = c->initial.count + c->settings.count;
+    header.settings = header.ctls + c->num_ctls * sizeof(uint32_t);
+    header.num_paths = c->num_paths;
+    header.paths = header.settings +
+            header.num_settings * sizeof(struct route_table_setting);
+    header.initial.name = add_string(c, "");
+    header.initial.first_setting = 0;
+    header.initial.num_settings = c->initial.count;
+    header.in_sources = IN_SOURCE_TAB_SIZE;
+    header.out_devices = OUT_DEVICE_TAB_SIZE;
+    header.routes = header.paths + c->num_paths * sizeof(struct route_table_path);
+    header.strings = header.routes + sizeof(routes);
+    header.strings_size = c->strings_size;
+    header.size = header.strings + ((c->strings_size + 3) & ~3);
+
+    file = fopen(out, "wb");
+    if (!file) {
+        fprintf(stderr, "%s: %s\n", out, strerror(errno));
+        return -1;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1 ||
+            fwrite(c->ctls, sizeof(uint32_t), c->num_ctls, file) != c->num_ctls ||
+            fwrite(c->initial.items, sizeof(struct route_table_setting),
+                   c->initial.count, file) != c->initial.count ||
+            fwrite(c->settings.items, sizeof(struct route_table_setting),
+                   c->settings.count, file) != c->settings.count ||
+            fwrite(c->paths, sizeof(struct route_table_path),
+                   c->num_paths, file) != c->num_paths ||
+            fwrite(routes, sizeof(routes), 1, file) != 1 ||
+            fwrite(c->strings, 1, c->strings_size, file) != c->strings_size ||
+            fwrite(&pad, 1, header.size - header.strings - c->strings_size,
+                   file) != header.size - header.strings - c->strings_size) {
+        fprintf(stderr, "%s: write error\n", out);
+        ret = -1;
+    }
+
+    if (fclose(file) != 0)
+        ret = -1;
+    if (ret != 0)
+        remove(out);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    struct compiler c;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s mixer_paths.xml mixer_paths.bin\n", argv[0]);
+        return 1;
+    }
+
+    memset(&c, 0, sizeof(c));
+    c.xml = argv[1];
+
+    if (parse(&c) != 0 || write_table(&c, argv[2]) != 0)
+        return 1;
+
+    printf("%s: %u controls, %u paths, %u settings\n", argv[2], c.num_ctls,
+           c.num_paths, c.initial.count + c.settings.count);
+    return 0;
+}
@@ -93,6 +93,7 @@ int ril_open(struct ril_handle *ril)
     if (!ril)
         return -1;
 
+    pthread_mutex_init(&ril->lock, NULL);
     ril->handle = dlopen(RIL_CLIENT_LIBPATH, RTLD_NOW);
 
     if (!ril->handle) {
@@ -163,43 +164,63 @@ int ril_close(struct ril_handle *ril)
 int ril_set_call_volume(struct ril_handle *ril, enum ril_sound_type sound_type,
                         float volume)
 {
-    if (ril_connect_if_required(ril))
-        return 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&ril->lock);
+    if (ril_connect_if_required(ril) == 0)
+        ret = _ril_set_call_volume(ril->client, sound_type,
+                                   (int)(volume * ril->volume_steps_max));
+    pthread_mutex_unlock(&ril->lock);
 
-    return _ril_set_call_volume(ril->client, sound_type,
-                                (int)(volume * ril->volume_steps_max));
+    return ret;
 }
 
 int ril_set_call_audio_path(struct ril_handle *ril,
                             enum ril_audio_path path,
                             enum ril_extra_volume mode)
 {
-    if (ril_connect_if_required(ril))
-        return 0;
+    int ret = 0;
 
-    return _ril_set_call_audio_path(ril->client, path, mode);
+    pthread_mutex_lock(&ril->lock);
+    if (ril_connect_if_required(ril) == 0)
+        ret = _ril_set_call_audio_path(ril->client, path, mode);
+    pthread_mutex_unlock(&ril->lock);
+
+    return ret;
 }
 
 int ril_set_call_clock_sync(struct ril_handle *ril, enum ril_clock_state state)
 {
-    if (ril_connect_if_required(ril))
-        return 0;
+    int ret = 0;
 
-    return _ril_set_call_clock_sync(ril->client, state);
+    pthread_mutex_lock(&ril->lock);
+    if (ril_connect_if_required(ril) == 0)
+        ret = _ril_set_call_clock_sync(ril->client, state);
+    pthread_mutex_unlock(&ril->lock);
+
+    return ret;
 }
 
 int ril_set_mute(struct ril_handle *ril, enum ril_mute_state state)
 {
-    if (ril_connect_if_required(ril))
-        return 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&ril->lock);
+    if (ril_connect_if_required(ril) == 0)
+        ret = _ril_set_mute(ril->client, state);
+    pthread_mutex_unlock(&ril->lock);
 
-    return _ril_set_mute(ril->client, state);
+    return ret;
 }
 
 int ril_set_two_mic_control(struct ril_handle *ril, enum ril_two_mic_device device, enum ril_two_mic_state state)
 {
-    if (ril_connect_if_required(ril))
-        return 0;
+    int ret = 0;
+
+    pthread_mutex_lock(&ril->lock);
+    if (ril_connect_if_required(ril) == 0)
+        ret = _ril_set_two_mic_control(ril->client, device, state);
+    pthread_mutex_unlock(&ril->lock);
 
-    return _ril_set_two_mic_control(ril->client, device, state);
+    return ret;
 }
@@ -17,6 +17,8 @@
 #ifndef RIL_INTERFACE_H
 #define RIL_INTERFACE_H
 
+#include <pthread.h>
+
 #define RIL_CLIENT_LIBPATH "libsecril-client.so"
 
 #define RIL_CLIENT_ERR_SUCCESS      0
@@ -37,6 +39,8 @@ struct ril_handle
     void *handle;
     void *client;
     int volume_steps_max;
+    pthread_mutex_t lock;   /* serializes the client calls, the call audio
+                             * path is set from the HAL routing thread */
 };
 
 enum ril_sound_type {
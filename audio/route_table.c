@@ -0,0 +1,318 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "audio_hw_route_table"
+/*#define LOG_NDEBUG 0*/
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cutils/log.h>
+
+#include <tinyalsa/asoundlib.h>
+
+#include "route_table.h"
+
+/* setting whose control or enum value the card does not have */
+#define ROUTE_TABLE_SKIP INT32_MIN
+
+struct route_table {
+    void *map;
+    size_t map_size;
+    const struct route_table_header *header;
+    const char *strings;
+    const struct route_table_setting *settings;
+    const struct route_table_path *paths;
+    const struct route_table_route *routes;
+
+    struct mixer *mixer;
+    struct mixer_ctl **ctls;    /* NULL for controls the card does not have */
+    int32_t *values;            /* resolved value of every setting */
+    int32_t *reset_values;      /* per control, state after the initial settings */
+    int32_t *new_values;        /* per control, state being built */
+    int32_t *cur_values;        /* per control, value the codec holds */
+};
+
+static bool route_table_range_ok(size_t size, uint32_t offset, uint32_t count,
+                                 size_t item_size)
+{
+    return (offset % sizeof(uint32_t) == 0) && (offset <= size) &&
+            (count <= (size - offset) / item_size);
+}
+
+static bool route_table_path_ok(const struct route_table_header *header,
+                                const struct route_table_path *path)
+{
+    return (path->name < header->strings_size) &&
+            (path->first_setting <= header->num_settings) &&
+            (path->num_settings <= header->num_settings - path->first_setting);
+}
+
+static bool route_table_validate(const struct route_table_header *header,
+                                 size_t size, unsigned int in_sources,
+                                 unsigned int out_devices)
+{
+    const uint8_t *base = (const uint8_t *)header;
+    const uint32_t *ctls;
+    const struct route_table_setting *settings;
+    const struct route_table_path *paths;
+    const struct route_table_route *routes;
+    const char *strings;
+    uint32_t i;
+
+    if (size < sizeof(*header) || header->magic != ROUTE_TABLE_MAGIC ||
+            header->version != ROUTE_TABLE_VERSION || header->size != size)
+        return false;
+    if (header->in_sources != in_sources || header->out_devices != out_devices) {
+        ALOGW("%s: table built for another route_configs layout", __func__);
+        return false;
+    }
+
+    if (!route_table_range_ok(size, header->ctls, header->num_ctls,
+                              sizeof(uint32_t)) ||
+            !route_table_range_ok(size, header->settings, header->num_settings,
+                                  sizeof(struct route_table_setting)) ||
+            !route_table_range_ok(size, header->paths, header->num_paths,
+                                  sizeof(struct route_table_path)) ||
+            !route_table_range_ok(size, header->routes, in_sources * out_devices,
+                                  sizeof(struct route_table_route)) ||
+            !route_table_range_ok(size, header->strings, header->strings_size, 1))
+        return false;
+
+    strings = (const char *)(base + header->strings);
+    if (header->strings_size == 0 || strings[header->strings_size - 1] != '\0')
+        return false;
+
+    ctls = (const uint32_t *)(base + header->ctls);
+    for (i = 0; i < header->num_ctls; i++)
+        if (ctls[i] >= header->strings_size)
+            return false;
+
+    settings = (const struct route_table_setting *)(base + header->settings);
+    for (i = 0; i < header->num_settings; i++)
+        if (settings[i].ctl >= header->num_ctls ||
+                settings[i].value >= header->strings_size)
+            return false;
+
+    paths = (const struct route_table_path *)(base + header->paths);
+    for (i = 0; i < header->num_paths; i++)
+        if (!route_table_path_ok(header, &paths[i]))
+            return false;
+    if (!route_table_path_ok(header, &header->initial))
+        return false;
+
+    routes = (const struct route_table_route *)(base + header->routes);
+    for (i = 0; i < in_sources * out_devices; i++) {
+        if ((routes[i].output_path != ROUTE_TABLE_NO_PATH &&
+                    routes[i].output_path >= header->num_paths) ||
+                (routes[i].input_path != ROUTE_TABLE_NO_PATH &&
+                    routes[i].input_path >= header->num_paths))
+            return false;
+    }
+
+    return true;
+}
+
+/* same value conversion as audio_route */
+static int32_t route_table_resolve_value(struct mixer_ctl *ctl,
+                                         const char *value)
+{
+    unsigned int i;
+
+    if (mixer_ctl_get_type(ctl) != MIXER_CTL_TYPE_ENUM)
+        return atoi(value);
+
+    for (i = 0; i < mixer_ctl_get_num_enums(ctl); i++) {
+        if (strcmp(mixer_ctl_get_enum_string(ctl, i), value) == 0)
+            return i;
+    }
+
+    ALOGE("%s: %s has no value %s", __func__, mixer_ctl_get_name(ctl), value);
+    return ROUTE_TABLE_SKIP;
+}
+
+static void route_table_apply_settings(struct route_table *table,
+                                       const struct route_table_path *path,
+                                       int32_t *values)
+{
+    uint32_t i;
+    uint32_t setting;
+
+    for (i = 0; i < path->num_settings; i++) {
+        setting = path->first_setting + i;
+        if (table->values[setting] != ROUTE_TABLE_SKIP)
+            values[table->settings[setting].ctl] = table->values[setting];
+    }
+}
+
+struct route_table *route_table_open(const char *path, unsigned int card,
+                                     unsigned int in_sources,
+                                     unsigned int out_devices)
+{
+    const struct route_table_header *header;
+    const uint32_t *ctl_names;
+    struct route_table *table;
+    struct mixer_ctl *ctl;
+    struct stat st;
+    void *map;
+    size_t size;
+    uint32_t i;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        close(fd);
+        return NULL;
+    }
+    size = st.st_size;
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    header = (const struct route_table_header *)map;
+    if (!route_table_validate(header, size, in_sources, out_devices)) {
+        ALOGE("%s: %s is not a valid route table", __func__, path);
+        munmap(map, size);
+        return NULL;
+    }
+
+    /* a single allocation for all the runtime state */
+    table = calloc(1, sizeof(struct route_table) +
+                   header->num_ctls * sizeof(struct mixer_ctl *) +
+                   header->num_settings * sizeof(int32_t) +
+                   header->num_ctls * 3 * sizeof(int32_t));
+    if (!table) {
+        munmap(map, size);
+        return NULL;
+    }
+    table->ctls = (struct mixer_ctl **)(table + 1);
+    table->values = (int32_t *)(table->ctls + header->num_ctls);
+    table->reset_values = table->values + header->num_settings;
+    table->new_values = table->reset_values + header->num_ctls;
+    table->cur_values = table->new_values + header->num_ctls;
+
+    table->map = map;
+    table->map_size = size;
+    table->header = header;
+    table->strings = (const char *)map + header->strings;
+    table->settings = (const struct route_table_setting *)
+            ((const char *)map + header->settings);
+    table->paths = (const struct route_table_path *)
+            ((const char *)map + header->paths);
+    table->routes = (const struct route_table_route *)
+            ((const char *)map + header->routes);
+
+    table->mixer = mixer_open(card);
+    if (!table->mixer) {
+        ALOGE("%s: cannot open mixer of card %u", __func__, card);
+        route_table_close(table);
+        return NULL;
+    }
+
+    ctl_names = (const uint32_t *)((const char *)map + header->ctls);
+    for (i = 0; i < header->num_ctls; i++) {
+        ctl = mixer_get_ctl_by_name(table->mixer, table->strings + ctl_names[i]);
+        if (!ctl)
+            ALOGW("%s: no control %s", __func__, table->strings + ctl_names[i]);
+        else
+            table->cur_values[i] = mixer_ctl_get_value(ctl, 0);
+        table->ctls[i] = ctl;
+    }
+
+    for (i = 0; i < header->num_settings; i++) {
+        ctl = table->ctls[table->settings[i].ctl];
+        table->values[i] = ctl ?
+                route_table_resolve_value(ctl,
+                                          table->strings + table->settings[i].value) :
+                ROUTE_TABLE_SKIP;
+    }
+
+    memcpy(table->reset_values, table->cur_values,
+           header->num_ctls * sizeof(int32_t));
+    route_table_apply_settings(table, &header->initial, table->reset_values);
+    route_table_reset(table);
+    route_table_update_mixer(table);
+
+    ALOGV("%s: %u controls, %u paths", __func__, header->num_ctls,
+          header->num_paths);
+    return table;
+}
+
+void route_table_close(struct route_table *table)
+{
+    if (table->mixer)
+        mixer_close(table->mixer);
+    munmap(table->map, table->map_size);
+    free(table);
+}
+
+uint32_t route_table_get_path(struct route_table *table,
+                              unsigned int in_source, unsigned int out_device,
+                              bool input)
+{
+    const struct route_table_route *route;
+
+    if (in_source >= table->header->in_sources ||
+            out_device >= table->header->out_devices)
+        return ROUTE_TABLE_NO_PATH;
+
+    route = &table->routes[in_source * table->header->out_devices + out_device];
+    return input ? route->input_path : route->output_path;
+}
+
+void route_table_reset(struct route_table *table)
+{
+    memcpy(table->new_values, table->reset_values,
+           table->header->num_ctls * sizeof(int32_t));
+}
+
+void route_table_apply_path(struct route_table *table, uint32_t path)
+{
+    if (path >= table->header->num_paths)
+        return;
+
+    route_table_apply_settings(table, &table->paths[path], table->new_values);
+}
+
+/* write the controls that differ from what the codec holds */
+int route_table_update_mixer(struct route_table *table)
+{
+    struct mixer_ctl *ctl;
+    unsigned int j;
+    uint32_t i;
+    int writes = 0;
+
+    for (i = 0; i < table->header->num_ctls; i++) {
+        ctl = table->ctls[i];
+        if (!ctl || table->new_values[i] == table->cur_values[i])
+            continue;
+
+        for (j = 0; j < mixer_ctl_get_num_values(ctl); j++)
+            mixer_ctl_set_value(ctl, j, table->new_values[i]);
+        table->cur_values[i] = table->new_values[i];
+        writes++;
+    }
+
+    return writes;
+}
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2013 The CyanogenMod Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ROUTE_TABLE_H
+#define ROUTE_TABLE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Compiled route table.
+ *
+ * mixer_paths_compiler turns mixer_paths.xml and route_configs[][] into
+ * mixer_paths.bin at build time: control names are collected once, nested
+ * paths are flattened into lists of (control index, value) settings and
+ * every route_configs[][] entry points to its paths by index. The HAL maps
+ * the file, looks each control up once and then applies routes without any
+ * parsing or name lookup. It falls back to audio_route and the XML when the
+ * file is missing or does not match the HAL.
+ *
+ * All fields are little endian, offsets are from the start of the file and
+ * strings are NUL terminated offsets into the string pool.
+ */
+
+#define ROUTE_TABLE_MAGIC 0x31425452    /* "RTB1" */
+#define ROUTE_TABLE_VERSION 1
+#define ROUTE_TABLE_NO_PATH 0xffffffff
+
+struct route_table_path {
+    uint32_t name;
+    uint32_t first_setting;
+    uint32_t num_settings;
+};
+
+struct route_table_setting {
+    uint32_t ctl;               /* index in the control table */
+    uint32_t value;             /* value as written in the XML */
+};
+
+struct route_table_route {
+    uint32_t output_path;       /* path index or ROUTE_TABLE_NO_PATH */
+    uint32_t input_path;
+};
+
+struct route_table_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;              /* of the whole file */
+    uint32_t num_ctls;
+    uint32_t ctls;              /* uint32_t name[num_ctls] */
+    uint32_t num_settings;
+    uint32_t settings;          /* struct route_table_setting[num_settings] */
+    uint32_t num_paths;
+    uint32_t paths;             /* struct route_table_path[num_paths] */
+    struct route_table_path initial;    /* settings outside any path */
+    uint32_t in_sources;
+    uint32_t out_devices;
+    uint32_t routes;            /* struct route_table_route[in][out] */
+    uint32_t strings_size;
+    uint32_t strings;
+};
+
+/* runtime side, used by the HAL */
+
+struct route_table;
+
+/*
+ * Map the table and set the mixer of card to its initial state. Returns
+ * NULL if the file is missing, corrupt, or was compiled for another
+ * route_configs[][] layout.
+ */
+struct route_table *route_table_open(const char *path, unsigned int card,
+                                     unsigned int in_sources,
+                                     unsigned int out_devices);
+void route_table_close(struct route_table *table);
+
+/* path index of an entry of route_configs[][] */
+uint32_t route_table_get_path(struct route_table *table,
+                              unsigned int in_source, unsigned int out_device,
+                              bool input);
+
+/* same as the audio_route functions, the mixer is only written by update */
+void route_table_reset(struct route_table *table);
+void route_table_apply_path(struct route_table *table, uint32_t path);
+int route_table_update_mixer(struct route_table *table);
+
+#endif
@@ -25,8 +25,6 @@ enum {
     OUT_DEVICE_HEADSET,
     OUT_DEVICE_HEADPHONES,
     OUT_DEVICE_BT_SCO,
-    OUT_DEVICE_SPEAKER_AND_HEADSET,
-    OUT_DEVICE_SPEAKER_AND_EARPIECE,
     OUT_DEVICE_TAB_SIZE,           /* number of rows in route_configs[][] */
     OUT_DEVICE_NONE,
     OUT_DEVICE_CNT
@@ -49,11 +47,22 @@ enum {
     ES325_NUM_MODES,
 };
 
+/*
+ * What a mono capture stream keeps of the stereo capture, see
+ * INPUT_CHANNEL_MAP in mixer_paths.xml for the mic in each slot.
+ */
+enum {
+    INPUT_CHANNEL_LEFT,
+    INPUT_CHANNEL_RIGHT,
+    INPUT_CHANNEL_MIX,
+};
+
 struct route_config {
     const char * const output_route;
     const char * const input_route;
     int es325_preset[ES325_NUM_MODES]; // es325 preset for this route.
                                        // -1 means es325 bypass
+    int input_channel;                 // INPUT_CHANNEL_LEFT if omitted
 };
 
 /* TODO: Figure out whether voice routes need to set ES325 presets */
@@ -61,21 +70,24 @@ const struct route_config voice_speaker = {
     "voice-speaker",
     "voice-main-mic",
     { ES325_PRESET_OFF,
-      ES325_PRESET_OFF }
+      ES325_PRESET_OFF },
+    INPUT_CHANNEL_MIX           /* builtin and back mics */
 };
 
 const struct route_config voice_earpiece = {
     "voice-earpiece",
     "voice-main-mic",
     { ES325_PRESET_OFF,
-      ES325_PRESET_OFF }
+      ES325_PRESET_OFF },
+    INPUT_CHANNEL_MIX           /* builtin and back mics */
 };
 
 const struct route_config voice_headphones = {
     "voice-headphones",
     "voice-main-mic",
     { ES325_PRESET_OFF,
-      ES325_PRESET_OFF }
+      ES325_PRESET_OFF },
+    INPUT_CHANNEL_MIX           /* builtin and back mics */
 };
 
 const struct route_config voice_headset = {
@@ -117,14 +129,16 @@ const struct route_config camcorder_speaker = {
     "media-speaker",
     "media-second-mic",
     { ES325_PRESET_CAMCORDER,
-      ES325_PRESET_CAMCORDER }
+      ES325_PRESET_CAMCORDER },
+    INPUT_CHANNEL_RIGHT         /* back mic */
 };
 
 const struct route_config camcorder_headphones = {
     "media-headphones",
     "media-second-mic",
     { ES325_PRESET_CAMCORDER,
-      ES325_PRESET_CAMCORDER }
+      ES325_PRESET_CAMCORDER },
+    INPUT_CHANNEL_RIGHT         /* back mic */
 };
 
 const struct route_config voice_rec_speaker = {
@@ -176,13 +190,6 @@ const struct route_config communication_headset = {
       ES325_PRESET_VOIP_HEADSET }
 };
 
-const struct route_config speaker_and_headphones = {
-    "speaker-and-headphones",
-    "main-mic",
-    { ES325_PRESET_CURRENT,
-      ES325_PRESET_CURRENT }
-};
-
 const struct route_config bluetooth_sco = {
     "bt-sco-headset",
     "bt-sco-mic",
@@ -197,6 +204,20 @@ const struct route_config none = {
       ES325_PRESET_OFF }
 };
 
+/*
+ * A combination of output devices plays on the output route of each of its
+ * devices. The input route and the eS325 preset come from the device of the
+ * combination listed first here, the most private one: a ringtone on the
+ * speaker and a headset keeps recording from the headset mic.
+ */
+const int out_device_priority[OUT_DEVICE_TAB_SIZE] = {
+    OUT_DEVICE_BT_SCO,
+    OUT_DEVICE_HEADSET,
+    OUT_DEVICE_HEADPHONES,
+    OUT_DEVICE_EARPIECE,
+    OUT_DEVICE_SPEAKER
+};
+
 const struct route_config * const route_configs[IN_SOURCE_TAB_SIZE]
                                                [OUT_DEVICE_TAB_SIZE] = {
     {   /* IN_SOURCE_MIC */
@@ -204,45 +225,35 @@ const struct route_config * const route_configs[IN_SOURCE_TAB_SIZE]
         &media_earpiece,            /* OUT_DEVICE_EARPIECE */
         &media_headset,             /* OUT_DEVICE_HEADSET */
         &media_headphones,          /* OUT_DEVICE_HEADPHONES */
-        &bluetooth_sco,             /* OUT_DEVICE_BT_SCO */
-        &speaker_and_headphones,    /* OUT_DEVICE_SPEAKER_AND_HEADSET */
-        &media_speaker              /* OUT_DEVICE_SPEAKER_AND_EARPIECE */
+        &bluetooth_sco              /* OUT_DEVICE_BT_SCO */
     },
     {   /* IN_SOURCE_CAMCORDER */
         &camcorder_speaker,         /* OUT_DEVICE_SPEAKER */
         &none,                      /* OUT_DEVICE_EARPIECE */
         &camcorder_headphones,      /* OUT_DEVICE_HEADSET */
         &camcorder_headphones,      /* OUT_DEVICE_HEADPHONES */
-        &bluetooth_sco,             /* OUT_DEVICE_BT_SCO */
-        &speaker_and_headphones,    /* OUT_DEVICE_SPEAKER_AND_HEADSET */
-        &camcorder_speaker          /* OUT_DEVICE_SPEAKER_AND_EARPIECE */
+        &bluetooth_sco              /* OUT_DEVICE_BT_SCO */
     },
     {   /* IN_SOURCE_VOICE_RECOGNITION */
         &voice_rec_speaker,         /* OUT_DEVICE_SPEAKER */
         &none,                      /* OUT_DEVICE_EARPIECE */
         &voice_rec_headset,         /* OUT_DEVICE_HEADSET */
         &voice_rec_headphones,      /* OUT_DEVICE_HEADPHONES */
-        &bluetooth_sco,             /* OUT_DEVICE_BT_SCO */
-        &speaker_and_headphones,    /* OUT_DEVICE_SPEAKER_AND_HEADSET */
-        &voice_rec_speaker          /* OUT_DEVICE_SPEAKER_AND_EARPIECE */
+        &bluetooth_sco              /* OUT_DEVICE_BT_SCO */
     },
     {   /* IN_SOURCE_VOICE_COMMUNICATION */
         &communication_speaker,     /* OUT_DEVICE_SPEAKER */
         &communication_earpiece,    /* OUT_DEVICE_EARPIECE */
         &communication_headset,     /* OUT_DEVICE_HEADSET */
         &communication_headphones,  /* OUT_DEVICE_HEADPHONES */
-        &bluetooth_sco,             /* OUT_DEVICE_BT_SCO */
-        &speaker_and_headphones,    /* OUT_DEVICE_SPEAKER_AND_HEADSET */
-        &communication_earpiece     /* OUT_DEVICE_SPEAKER_AND_EARPIECE */
+        &bluetooth_sco              /* OUT_DEVICE_BT_SCO */
     },
     {   /* IN_SOURCE_VOICE_CALL */
         &voice_speaker,             /* OUT_DEVICE_SPEAKER */
         &voice_earpiece,            /* OUT_DEVICE_EARPIECE */
         &voice_headset,             /* OUT_DEVICE_HEADSET */
         &voice_headphones,          /* OUT_DEVICE_HEADPHONES */
-        &bluetooth_sco,             /* OUT_DEVICE_BT_SCO */
-        &voice_headphones,          /* OUT_DEVICE_SPEAKER_AND_HEADSET */
-        &voice_earpiece             /* OUT_DEVICE_SPEAKER_AND_EARPIECE */
+        &bluetooth_sco              /* OUT_DEVICE_BT_SCO */
     },
 };
 
@@ -54,6 +54,7 @@ PRODUCT_PACKAGES += \
     audio.primary.universal5410 \
     audio.usb.default \
     audio.r_submix.default \
+    mixer_paths.bin \
     mixer_paths.xml \
     tinymix
 